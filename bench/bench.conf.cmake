@@ -0,0 +1,15 @@
+# spmfilter configuration used by the bench target
+[global]
+engine = smtpd
+lib_dir = ${CMAKE_BINARY_DIR}/src
+queue_dir = ${CMAKE_CURRENT_BINARY_DIR}/queue
+pid_file = ${CMAKE_CURRENT_BINARY_DIR}/spmfilter.pid
+nexthop = /dev/null
+debug = false
+foreground = true
+add_header = true
+bind_ip = 127.0.0.1
+bind_port = ${BENCH_PORT}
+max_childs = 64
+spare_childs = ${BENCH_CONNECTIONS}
+max_spare_childs = 64
@@ -0,0 +1,136 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* helpers shared by the SMTP benchmark tools, see bench_common.h */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "bench_common.h"
+
+double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+int conn_open(conn_t *c, const char *host, const char *port) {
+    struct addrinfo hints, *ai, *aptr;
+    int rc;
+
+    c->fd = -1;
+    c->count = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((rc = getaddrinfo(host, port, &hints, &ai)) != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(rc));
+        return -1;
+    }
+
+    for (aptr = ai; aptr != NULL; aptr = aptr->ai_next) {
+        if ((c->fd = socket(aptr->ai_family, aptr->ai_socktype, aptr->ai_protocol)) < 0)
+            continue;
+
+        if (connect(c->fd, aptr->ai_addr, aptr->ai_addrlen) == 0)
+            break;
+
+        close(c->fd);
+        c->fd = -1;
+    }
+    freeaddrinfo(ai);
+
+    return (c->fd < 0) ? -1 : 0;
+}
+
+int conn_write(conn_t *c, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(c->fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* read a (possibly multiline) reply and return the reply code */
+int conn_reply(conn_t *c) {
+    char *eol;
+    ssize_t n;
+    size_t linelen;
+    int code;
+    int last;
+
+    for (;;) {
+        while ((eol = memchr(c->buf, '\n', c->count)) == NULL) {
+            if (c->count == sizeof(c->buf))
+                return -1;
+
+            if ((n = read(c->fd, c->buf + c->count, sizeof(c->buf) - c->count)) <= 0) {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                return -1;
+            }
+            c->count += n;
+        }
+
+        linelen = eol - c->buf + 1;
+        code = (linelen > 3) ? atoi(c->buf) : -1;
+        last = (linelen <= 3) || (c->buf[3] != '-');
+
+        memmove(c->buf, c->buf + linelen, c->count - linelen);
+        c->count -= linelen;
+
+        if (last)
+            return code;
+    }
+}
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(const double *latencies, int num_latencies, double p) {
+    int idx;
+
+    if (num_latencies == 0)
+        return 0.0;
+
+    idx = (int)(p * num_latencies + 0.5) - 1;
+    if (idx < 0) idx = 0;
+    if (idx >= num_latencies) idx = num_latencies - 1;
+
+    return latencies[idx] * 1000.0;
+}
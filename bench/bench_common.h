@@ -0,0 +1,51 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* helpers shared by the SMTP benchmark tools */
+
+#ifndef _BENCH_COMMON_H
+#define _BENCH_COMMON_H
+
+#include <stddef.h>
+
+#define REPLY_SIZE 4096
+
+typedef struct {
+    int fd;
+    char buf[REPLY_SIZE];
+    size_t count;
+} conn_t;
+
+/* wall clock time in seconds */
+double now(void);
+
+/* connect to host and port, returns 0 on success or -1 */
+int conn_open(conn_t *c, const char *host, const char *port);
+
+/* write the whole buffer, returns 0 on success or -1 */
+int conn_write(conn_t *c, const char *buf, size_t len);
+
+/* read a (possibly multiline) reply and return the reply code */
+int conn_reply(conn_t *c);
+
+/* qsort() comparison of doubles */
+int cmp_double(const void *a, const void *b);
+
+/* percentile p (0..1) of sorted latencies in seconds, in milliseconds */
+double percentile(const double *latencies, int num_latencies, double p);
+
+#endif /* _BENCH_COMMON_H */
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# usage: run_bench.sh <spmfilter> <config> <smf_loadgen> [smf_loadgen options]
+#
+# Starts spmfilter with the given config, runs the load generator
+# against it and shuts the daemon down again.
+
+SPMFILTER=$1
+CONFIG=$2
+LOADGEN=$3
+shift 3
+
+QUEUE_DIR=`sed -n 's/^queue_dir *= *//p' $CONFIG`
+mkdir -p $QUEUE_DIR
+
+$SPMFILTER -f $CONFIG &
+PID=$!
+
+# give the daemon some time to bind and prefork
+sleep 2
+if ! kill -0 $PID 2>/dev/null; then
+	echo "spmfilter failed to start" >&2
+	exit 1
+fi
+
+$LOADGEN "$@"
+RC=$?
+
+kill -TERM $PID
+wait $PID
+
+exit $RC
@@ -0,0 +1,339 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SMTP load generator
+ *
+ * Replays a directory of sample messages (and optional synthetic
+ * messages of a given size) over a number of concurrent connections
+ * against a running spmfilter smtpd engine and reports throughput and
+ * latency percentiles. The latency of a message is the time between
+ * sending MAIL FROM and receiving the final reply after the
+ * end-of-data marker.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bench_common.h"
+
+#define MAX_SYNTHETIC 8
+
+typedef struct {
+    char *data; /* message in wire format, CRLF and dot-stuffed */
+    size_t len;
+} message_t;
+
+static const char *host = "127.0.0.1";
+static const char *port = "10025";
+static const char *sender = "<bench@example.org>";
+static const char *rcpt = "<sink@example.org>";
+static int concurrency = 8;
+static int total = 1000;
+static int per_conn = 1;
+
+static message_t *corpus = NULL;
+static int corpus_size = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_msg = 0;
+static int failed = 0;
+static unsigned long long bytes_sent = 0;
+static double *latencies = NULL;
+static int num_latencies = 0;
+
+/* convert raw message content to SMTP wire format */
+static void add_message(const char *raw, size_t len) {
+    message_t *m;
+    size_t i;
+    size_t pos = 0;
+    int bol = 1;
+
+    corpus = realloc(corpus, (corpus_size + 1) * sizeof(message_t));
+    m = &corpus[corpus_size++];
+
+    /* worst case: every byte is a LF or a leading dot */
+    m->data = malloc(len * 2 + 3);
+    for (i = 0; i < len; i++) {
+        if (bol && raw[i] == '.')
+            m->data[pos++] = '.';
+
+        if (raw[i] == '\n') {
+            if (pos == 0 || m->data[pos - 1] != '\r')
+                m->data[pos++] = '\r';
+            bol = 1;
+        } else
+            bol = 0;
+
+        m->data[pos++] = raw[i];
+    }
+
+    if (!bol) {
+        m->data[pos++] = '\r';
+        m->data[pos++] = '\n';
+    }
+
+    m->len = pos;
+}
+
+static int load_corpus(const char *dir) {
+    DIR *dh;
+    struct dirent *de;
+    struct stat st;
+    char *path = NULL;
+    char *buf;
+    FILE *fh;
+
+    if ((dh = opendir(dir)) == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    while ((de = readdir(dh)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        asprintf(&path, "%s/%s", dir, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            free(path);
+            continue;
+        }
+
+        if ((fh = fopen(path, "r")) != NULL) {
+            buf = malloc(st.st_size);
+            if (fread(buf, 1, st.st_size, fh) == (size_t)st.st_size)
+                add_message(buf, st.st_size);
+            free(buf);
+            fclose(fh);
+        }
+        free(path);
+    }
+    closedir(dh);
+
+    return 0;
+}
+
+static void add_synthetic(size_t size) {
+    static const char line[] = "Lorem ipsum dolor sit amet, consectetur adipisici elit, sed eiusmod tempor\n";
+    char *raw;
+    size_t pos;
+
+    raw = malloc(size + sizeof(line) + 256);
+    pos = sprintf(raw,
+        "From: bench@example.org\n"
+        "To: sink@example.org\n"
+        "Subject: synthetic message of %lu bytes\n"
+        "Message-Id: <synthetic.%lu@example.org>\n"
+        "Date: Thu, 01 Jan 2009 00:00:00 +0000\n\n",
+        (unsigned long)size, (unsigned long)size);
+
+    while (pos < size) {
+        memcpy(raw + pos, line, sizeof(line) - 1);
+        pos += sizeof(line) - 1;
+    }
+
+    add_message(raw, pos);
+    free(raw);
+}
+
+static int conn_command(conn_t *c, const char *cmd, int expected) {
+    if (conn_write(c, cmd, strlen(cmd)) != 0)
+        return -1;
+
+    return (conn_reply(c) / 100 == expected / 100) ? 0 : -1;
+}
+
+static int send_message(conn_t *c, message_t *m, double *latency) {
+    char *cmd = NULL;
+    double start;
+    int rc;
+
+    start = now();
+    asprintf(&cmd, "MAIL FROM:%s\r\n", sender);
+    rc = conn_command(c, cmd, 250);
+    free(cmd);
+    if (rc != 0)
+        return -1;
+
+    asprintf(&cmd, "RCPT TO:%s\r\n", rcpt);
+    rc = conn_command(c, cmd, 250);
+    free(cmd);
+    if (rc != 0)
+        return -1;
+
+    if (conn_command(c, "DATA\r\n", 354) != 0)
+        return -1;
+
+    if (conn_write(c, m->data, m->len) != 0)
+        return -1;
+
+    if (conn_command(c, ".\r\n", 250) != 0)
+        return -1;
+
+    *latency = now() - start;
+
+    return 0;
+}
+
+static void *worker(void *arg) {
+    conn_t conn;
+    int sent = 0;
+    int connected = 0;
+    int i;
+    double latency;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        i = (next_msg < total) ? next_msg++ : -1;
+        pthread_mutex_unlock(&lock);
+
+        if (i < 0)
+            break;
+
+        if (!connected) {
+            if (conn_open(&conn, host, port) != 0 || conn_reply(&conn) != 220
+                    || conn_command(&conn, "EHLO bench.example.org\r\n", 250) != 0) {
+                if (conn.fd >= 0)
+                    close(conn.fd);
+                pthread_mutex_lock(&lock);
+                failed++;
+                pthread_mutex_unlock(&lock);
+                continue;
+            }
+            connected = 1;
+            sent = 0;
+        }
+
+        if (send_message(&conn, &corpus[i % corpus_size], &latency) != 0) {
+            pthread_mutex_lock(&lock);
+            failed++;
+            pthread_mutex_unlock(&lock);
+            close(conn.fd);
+            connected = 0;
+            continue;
+        }
+
+        pthread_mutex_lock(&lock);
+        latencies[num_latencies++] = latency;
+        bytes_sent += corpus[i % corpus_size].len;
+        pthread_mutex_unlock(&lock);
+
+        if (++sent >= per_conn) {
+            conn_command(&conn, "QUIT\r\n", 221);
+            close(conn.fd);
+            connected = 0;
+        }
+    }
+
+    if (connected) {
+        conn_command(&conn, "QUIT\r\n", 221);
+        close(conn.fd);
+    }
+
+    return NULL;
+}
+
+static void usage(void) {
+    printf("usage: smf_loadgen [options] <sample dir>...\n\n");
+    printf("  -H <host>       smtpd host (default 127.0.0.1)\n");
+    printf("  -p <port>       smtpd port (default 10025)\n");
+    printf("  -c <num>        number of concurrent connections (default 8)\n");
+    printf("  -n <num>        total number of messages (default 1000)\n");
+    printf("  -m <num>        messages per connection (default 1)\n");
+    printf("  -s <bytes>      add a synthetic message of the given size, may be repeated\n");
+    printf("  -h              show this help\n");
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t *threads;
+    size_t synthetic[MAX_SYNTHETIC];
+    int num_synthetic = 0;
+    double start, elapsed;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "H:p:c:n:m:s:h")) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'c': concurrency = atoi(optarg); break;
+            case 'n': total = atoi(optarg); break;
+            case 'm': per_conn = atoi(optarg); break;
+            case 's':
+                if (num_synthetic < MAX_SYNTHETIC)
+                    synthetic[num_synthetic++] = strtoul(optarg, NULL, 0);
+                break;
+            case 'h':
+            default:
+                usage();
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (concurrency < 1 || total < 1 || per_conn < 1) {
+        usage();
+        return 1;
+    }
+
+    for (i = optind; i < argc; i++)
+        if (load_corpus(argv[i]) != 0)
+            return 1;
+
+    for (i = 0; i < num_synthetic; i++)
+        add_synthetic(synthetic[i]);
+
+    if (corpus_size == 0) {
+        fprintf(stderr, "no messages to send\n");
+        return 1;
+    }
+
+    latencies = calloc(total, sizeof(double));
+    threads = calloc(concurrency, sizeof(pthread_t));
+
+    start = now();
+    for (i = 0; i < concurrency; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+    for (i = 0; i < concurrency; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = now() - start;
+
+    qsort(latencies, num_latencies, sizeof(double), cmp_double);
+
+    printf("corpus:      %d messages\n", corpus_size);
+    printf("connections: %d concurrent, %d message(s) each\n", concurrency, per_conn);
+    printf("messages:    %d sent, %d failed\n", num_latencies, failed);
+    printf("elapsed:     %.3f s\n", elapsed);
+    printf("throughput:  %.1f msg/s, %.1f KiB/s\n",
+        num_latencies / elapsed, (double)bytes_sent / 1024.0 / elapsed);
+    printf("latency:     p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+        percentile(latencies, num_latencies, 0.50), percentile(latencies, num_latencies, 0.99), percentile(latencies, num_latencies, 0.999), percentile(latencies, num_latencies, 1.0));
+
+    free(threads);
+    free(latencies);
+    for (i = 0; i < corpus_size; i++)
+        free(corpus[i].data);
+    free(corpus);
+
+    return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,437 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Micro-benchmarks for the core primitives of libsmf
+ *
+ * Every benchmark runs a fixed number of iterations and prints one line
+ * "<name> <iterations> <ns/op>", the benchmarks are always executed in
+ * the same order, so the output can be compared between two builds.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../src/smf_core.h"
+#include "../src/smf_dict.h"
+#include "../src/smf_header.h"
+#include "../src/smf_internal.h"
+#include "../src/smf_list.h"
+#include "../src/smf_message.h"
+#include "../src/smf_modules.h"
+#include "../src/smf_session.h"
+#include "../src/smf_settings.h"
+#include "../src/smf_settings_private.h"
+#include "../src/smf_trace.h"
+
+#define NUM_KEYS 1000
+#define MAX_SAMPLES 256
+
+typedef struct {
+    const char *name;
+    long iterations;
+    double (*run)(long iterations); /* returns the measured time in ns */
+} bench_t;
+
+static char *samples[MAX_SAMPLES];
+static int num_samples = 0;
+static char *work_dir = NULL;
+
+static double ns(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void header_destroy(void *data) {
+    smf_header_free((SMFHeader_T *)data);
+}
+
+static double bench_dict_set(long iterations) {
+    struct timespec start, end;
+    SMFDict_T *dict;
+    char key[32];
+    double total = 0;
+    long i;
+
+    for (i = 0; i < iterations; i += NUM_KEYS) {
+        int j;
+        dict = smf_dict_new();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (j = 0; j < NUM_KEYS; j++) {
+            snprintf(key, sizeof(key), "key%d", j);
+            smf_dict_set(dict, key, "value");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        total += ns(&start, &end);
+        smf_dict_free(dict);
+    }
+
+    return total;
+}
+
+static double bench_dict_get(long iterations) {
+    struct timespec start, end;
+    SMFDict_T *dict = smf_dict_new();
+    char key[32];
+    long i;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        snprintf(key, sizeof(key), "key%ld", i);
+        smf_dict_set(dict, key, "value");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        snprintf(key, sizeof(key), "key%ld", i % NUM_KEYS);
+        smf_dict_get(dict, key);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    smf_dict_free(dict);
+
+    return ns(&start, &end);
+}
+
+static double bench_dict_remove(long iterations) {
+    struct timespec start, end;
+    SMFDict_T *dict;
+    char key[32];
+    double total = 0;
+    long i;
+
+    for (i = 0; i < iterations; i += NUM_KEYS) {
+        int j;
+        dict = smf_dict_new();
+        for (j = 0; j < NUM_KEYS; j++) {
+            snprintf(key, sizeof(key), "key%d", j);
+            smf_dict_set(dict, key, "value");
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (j = 0; j < NUM_KEYS; j++) {
+            snprintf(key, sizeof(key), "key%d", j);
+            smf_dict_remove(dict, key);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        total += ns(&start, &end);
+        smf_dict_free(dict);
+    }
+
+    return total;
+}
+
+static double bench_message_from_file(long iterations, int header_only) {
+    struct timespec start, end;
+    SMFMessage_T *msg;
+    double total = 0;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        msg = smf_message_new();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        smf_message_from_file(&msg, samples[i % num_samples], header_only);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        total += ns(&start, &end);
+        smf_message_free(msg);
+    }
+
+    return total;
+}
+
+static double bench_message_from_file_full(long iterations) {
+    return bench_message_from_file(iterations, 0);
+}
+
+static double bench_message_from_file_headers(long iterations) {
+    return bench_message_from_file(iterations, 1);
+}
+
+static double bench_header_update(long iterations) {
+    struct timespec start, end;
+    SMFMessage_T *msg = smf_message_new();
+    long i;
+
+    smf_message_from_file(&msg, samples[0], 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        smf_message_add_header(msg, "X-Bench", "value");
+        smf_message_get_header(msg, "X-Bench");
+        smf_message_update_header(msg, "X-Bench", "updated");
+        smf_message_remove_header(msg, "X-Bench");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    smf_message_free(msg);
+
+    return ns(&start, &end);
+}
+
+static double bench_flush_dirty(long iterations) {
+    struct timespec start, end;
+    SMFSettings_T *settings = smf_settings_new();
+    SMFSession_T *session = smf_session_new();
+    SMFList_T *initial_headers = NULL;
+    SMFListElem_T *elem;
+    SMFMessage_T *msg;
+    char *spool = NULL;
+    double total = 0;
+    long i;
+    int j;
+
+    smf_settings_set_queue_dir(settings, work_dir);
+    asprintf(&spool, "%s/flush.eml", work_dir);
+    smf_session_set_message_file(session, spool);
+
+    for (i = 0; i < iterations; i++) {
+        smf_core_copy_file(samples[i % num_samples], spool);
+
+        msg = smf_message_new();
+        smf_message_from_file(&msg, spool, 1);
+
+        smf_list_new(&initial_headers, header_destroy);
+        elem = smf_list_head(msg->headers);
+        while (elem != NULL) {
+            SMFHeader_T *o = (SMFHeader_T *)smf_list_data(elem);
+            SMFHeader_T *n = smf_header_new();
+            smf_header_set_name(n, smf_header_get_name(o));
+            for (j = 0; j < smf_header_get_count(o); j++)
+                smf_header_set_value(n, smf_header_get_value(o, j), 0);
+            smf_list_append(initial_headers, n);
+            elem = elem->next;
+        }
+
+        smf_message_add_header(msg, "X-Bench", "dirty");
+        smf_envelope_set_message(session->envelope, msg);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        smf_modules_flush_dirty(settings, session, initial_headers);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        total += ns(&start, &end);
+
+        smf_list_free(initial_headers);
+        smf_message_free(msg);
+        session->envelope->message = NULL;
+    }
+
+    unlink(spool);
+    free(spool);
+    smf_session_free(session);
+    smf_settings_free(settings);
+
+    return total;
+}
+
+static double bench_expand_string(long iterations) {
+    struct timespec start, end;
+    const char *query = "SELECT * FROM users WHERE email='%s' AND user='%u' AND domain='%d'";
+    char *s = NULL;
+    long i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++) {
+        smf_core_expand_string(query, "user@example.org", &s);
+        free(s);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ns(&start, &end);
+}
+
+static double bench_md5sum(long iterations) {
+    struct timespec start, end;
+    char data[1025];
+    long i;
+
+    memset(data, 'a', sizeof(data) - 1);
+    data[sizeof(data) - 1] = '\0';
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations; i++)
+        free(smf_core_md5sum(data));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ns(&start, &end);
+}
+
+/* one iteration reads one line of 78 bytes */
+static double bench_readline(long iterations) {
+    struct timespec start, end;
+    static const char line[] = "Lorem ipsum dolor sit amet, consectetur adipisici elit, sed eiusmod tempor\r\n";
+    char buf[MAXLINE];
+    char *path = NULL;
+    void *rl = NULL;
+    FILE *fh;
+    long i;
+    int fd;
+
+    asprintf(&path, "%s/readline.txt", work_dir);
+    if ((fh = fopen(path, "w")) == NULL) {
+        free(path);
+        return 0;
+    }
+    for (i = 0; i < iterations; i++)
+        fputs(line, fh);
+    fclose(fh);
+
+    fd = open(path, O_RDONLY);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (smf_internal_readline(fd, buf, MAXLINE, &rl) > 0)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd);
+    free(rl);
+
+    unlink(path);
+    free(path);
+
+    return ns(&start, &end);
+}
+
+static bench_t benchmarks[] = {
+    { "dict_set", 100000, bench_dict_set },
+    { "dict_get", 1000000, bench_dict_get },
+    { "dict_remove", 100000, bench_dict_remove },
+    { "message_from_file_full", 2000, bench_message_from_file_full },
+    { "message_from_file_headers", 5000, bench_message_from_file_headers },
+    { "header_update", 100000, bench_header_update },
+    { "flush_dirty", 1000, bench_flush_dirty },
+    { "expand_string", 1000000, bench_expand_string },
+    { "md5sum", 100000, bench_md5sum },
+    { "readline", 1000000, bench_readline },
+    { NULL, 0, NULL }
+};
+
+static int load_samples(const char *dir) {
+    DIR *dh;
+    struct dirent *de;
+    struct stat st;
+    char *path = NULL;
+    char **names = NULL;
+    int i;
+
+    if ((dh = opendir(dir)) == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    while ((de = readdir(dh)) != NULL && num_samples < MAX_SAMPLES) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        asprintf(&path, "%s/%s", dir, de->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+            samples[num_samples++] = path;
+        else
+            free(path);
+    }
+    closedir(dh);
+
+    /* readdir order depends on the filesystem, sort for stable results */
+    names = samples;
+    for (i = 1; i < num_samples; i++) {
+        char *s = names[i];
+        int j = i - 1;
+        while (j >= 0 && strcmp(names[j], s) > 0) {
+            names[j + 1] = names[j];
+            j--;
+        }
+        names[j + 1] = s;
+    }
+
+    return (num_samples > 0) ? 0 : -1;
+}
+
+static void usage(void) {
+    printf("usage: smf_microbench [-s <scale>] -d <sample dir> [benchmark...]\n\n");
+    printf("  -d <dir>      directory with sample messages\n");
+    printf("  -s <scale>    multiply the number of iterations by scale (default 1)\n");
+    printf("  -h            show this help\n");
+}
+
+int main(int argc, char *argv[]) {
+    char tmpl[] = "/tmp/smf_microbench.XXXXXX";
+    const char *dir = NULL;
+    double scale = 1.0;
+    bench_t *b;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "d:s:h")) != -1) {
+        switch (opt) {
+            case 'd': dir = optarg; break;
+            case 's': scale = atof(optarg); break;
+            case 'h':
+            default:
+                usage();
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (dir == NULL || scale <= 0) {
+        usage();
+        return 1;
+    }
+
+    if (load_samples(dir) != 0) {
+        fprintf(stderr, "no sample messages found in %s\n", dir);
+        return 1;
+    }
+
+    if ((work_dir = mkdtemp(tmpl)) == NULL) {
+        fprintf(stderr, "failed to create working directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    /* library traces would dominate the results */
+    configure_trace_destination(TRACE_DEST_SYSLOG);
+    openlog("smf_microbench", LOG_PID, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_ERR));
+
+    for (b = benchmarks; b->name != NULL; b++) {
+        long iterations = (long)(b->iterations * scale);
+        double total;
+
+        if (optind < argc) {
+            for (i = optind; i < argc; i++)
+                if (strcmp(argv[i], b->name) == 0)
+                    break;
+            if (i == argc)
+                continue;
+        }
+
+        if (iterations < 1)
+            iterations = 1;
+
+        total = b->run(iterations);
+        printf("%-28s %10ld %12.1f ns/op\n", b->name, iterations, total / iterations);
+        fflush(stdout);
+    }
+
+    rmdir(work_dir);
+    for (i = 0; i < num_samples; i++)
+        free(samples[i]);
+    closelog();
+
+    return 0;
+}
@@ -0,0 +1,374 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SMTP session replay
+ *
+ * Feeds session captures recorded by the smtpd engine (see capture_dir
+ * in spmfilter.conf(5)) back to a server. Every session is started at
+ * its original offset relative to the first captured session and every
+ * line is sent at its original offset within the session, both divided
+ * by the speed factor. A speed factor of 0 replays without any delay.
+ *
+ * The replay waits for the server reply wherever the original client
+ * had to, i.e. after every command and after the end-of-data marker,
+ * so the server sees the same dialogue regardless of the pace.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "bench_common.h"
+
+#define CAPTURE_MAGIC "spmfilter-capture 1 "
+
+typedef struct {
+    double offset;
+    char *data;
+    size_t len;
+} record_t;
+
+typedef struct {
+    char *path;
+    double start;
+    record_t *records;
+    int num_records;
+} capture_t;
+
+static const char *host = "127.0.0.1";
+static const char *port = "10025";
+static double speed = 1.0;
+static int concurrency = 256;
+
+static capture_t *captures = NULL;
+static int num_captures = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static int active = 0;
+static int failed = 0;
+static int messages = 0;
+static int replies[6];
+static double max_lag = 0.0;
+static double *latencies = NULL;
+static int num_latencies = 0;
+static int max_latencies = 0;
+
+static void sleep_until(double t) {
+    double d = t - now();
+    struct timespec ts;
+
+    if (d <= 0)
+        return;
+
+    ts.tv_sec = (time_t)d;
+    ts.tv_nsec = (long)((d - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+static int load_capture(const char *path) {
+    capture_t c;
+    struct stat st;
+    char *buf, *p, *end, *nl;
+    FILE *fh;
+
+    if ((fh = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fileno(fh), &st) != 0 || st.st_size == 0) {
+        fclose(fh);
+        return -1;
+    }
+
+    buf = malloc(st.st_size + 1);
+    if (fread(buf, 1, st.st_size, fh) != (size_t)st.st_size) {
+        fprintf(stderr, "failed to read %s\n", path);
+        free(buf);
+        fclose(fh);
+        return -1;
+    }
+    fclose(fh);
+    buf[st.st_size] = '\0';
+    end = buf + st.st_size;
+
+    if (strncmp(buf, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0
+            || (nl = memchr(buf, '\n', st.st_size)) == NULL) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        free(buf);
+        return -1;
+    }
+
+    c.path = strdup(path);
+    c.start = strtod(buf + strlen(CAPTURE_MAGIC), NULL);
+    c.records = NULL;
+    c.num_records = 0;
+
+    /* records point into buf, which is kept for the lifetime of the program */
+    p = nl + 1;
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        record_t r;
+        char *q;
+
+        r.offset = strtod(p, &q);
+        r.len = strtoul(q, NULL, 10);
+        r.data = nl + 1;
+        if (r.data + r.len > end) {
+            fprintf(stderr, "%s: truncated record, ignoring the rest\n", path);
+            break;
+        }
+
+        c.records = realloc(c.records, (c.num_records + 1) * sizeof(record_t));
+        c.records[c.num_records++] = r;
+        p = r.data + r.len;
+    }
+
+    captures = realloc(captures, (num_captures + 1) * sizeof(capture_t));
+    captures[num_captures++] = c;
+
+    return 0;
+}
+
+static int load_path(const char *path) {
+    DIR *dh;
+    struct dirent *de;
+    struct stat st;
+    char *file = NULL;
+    size_t len;
+
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "failed to stat %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+        return load_capture(path);
+
+    if ((dh = opendir(path)) == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while ((de = readdir(dh)) != NULL) {
+        len = strlen(de->d_name);
+        if (len < 5 || strcmp(de->d_name + len - 4, ".cap") != 0)
+            continue;
+
+        asprintf(&file, "%s/%s", path, de->d_name);
+        load_capture(file);
+        free(file);
+    }
+    closedir(dh);
+
+    return 0;
+}
+
+static int is_data_end(record_t *r) {
+    return (r->len == 3 && memcmp(r->data, ".\r\n", 3) == 0)
+        || (r->len == 2 && memcmp(r->data, ".\n", 2) == 0);
+}
+
+static int replay(capture_t *c, double *lag) {
+    conn_t conn;
+    double t0, due, sent, latency;
+    int in_data = 0;
+    int rc = 0;
+    int code, i;
+
+    if (conn_open(&conn, host, port) != 0)
+        return -1;
+
+    t0 = now();
+    if (conn_reply(&conn) != 220) {
+        close(conn.fd);
+        return -1;
+    }
+
+    for (i = 0; i < c->num_records; i++) {
+        record_t *r = &c->records[i];
+
+        if (speed > 0) {
+            due = t0 + r->offset / speed;
+            sleep_until(due);
+            if (now() - due > *lag)
+                *lag = now() - due;
+        }
+
+        sent = now();
+        if (conn_write(&conn, r->data, r->len) != 0) {
+            rc = -1;
+            break;
+        }
+
+        /* lines inside DATA are not answered */
+        if (in_data && !is_data_end(r))
+            continue;
+
+        if ((code = conn_reply(&conn)) < 0) {
+            rc = -1;
+            break;
+        }
+        latency = now() - sent;
+
+        pthread_mutex_lock(&lock);
+        if (code / 100 >= 2 && code / 100 <= 5)
+            replies[code / 100]++;
+        if (in_data)
+            messages++;
+        if (num_latencies == max_latencies) {
+            max_latencies = max_latencies ? max_latencies * 2 : 1024;
+            latencies = realloc(latencies, max_latencies * sizeof(double));
+        }
+        latencies[num_latencies++] = latency;
+        pthread_mutex_unlock(&lock);
+
+        if (in_data)
+            in_data = 0;
+        else if (code == 354)
+            in_data = 1;
+        else if (code == 221)
+            break;
+    }
+    close(conn.fd);
+
+    return rc;
+}
+
+static void *worker(void *arg) {
+    capture_t *c = (capture_t *)arg;
+    double lag = 0.0;
+    int rc;
+
+    rc = replay(c, &lag);
+
+    pthread_mutex_lock(&lock);
+    if (rc != 0) {
+        fprintf(stderr, "replay of %s failed\n", c->path);
+        failed++;
+    }
+    if (lag > max_lag)
+        max_lag = lag;
+    active--;
+    pthread_cond_signal(&done);
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+static int cmp_capture(const void *a, const void *b) {
+    double x = ((const capture_t *)a)->start;
+    double y = ((const capture_t *)b)->start;
+    return (x > y) - (x < y);
+}
+
+static void usage(void) {
+    printf("usage: smf_replay [options] <capture file or dir>...\n\n");
+    printf("  -H <host>       smtpd host (default 127.0.0.1)\n");
+    printf("  -p <port>       smtpd port (default 10025)\n");
+    printf("  -x <factor>     speed factor, 2 replays twice as fast, 0 without delays (default 1)\n");
+    printf("  -c <num>        maximum number of concurrent sessions (default 256)\n");
+    printf("  -h              show this help\n");
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    double start, elapsed;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "H:p:x:c:h")) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'x': speed = atof(optarg); break;
+            case 'c': concurrency = atoi(optarg); break;
+            case 'h':
+            default:
+                usage();
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind >= argc || speed < 0 || concurrency < 1) {
+        usage();
+        return 1;
+    }
+
+    for (i = optind; i < argc; i++)
+        load_path(argv[i]);
+
+    if (num_captures == 0) {
+        fprintf(stderr, "no captured sessions found\n");
+        return 1;
+    }
+
+    /* replay sessions in the order they were recorded */
+    qsort(captures, num_captures, sizeof(capture_t), cmp_capture);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    start = now();
+    for (i = 0; i < num_captures; i++) {
+        if (speed > 0)
+            sleep_until(start + (captures[i].start - captures[0].start) / speed);
+
+        pthread_mutex_lock(&lock);
+        while (active >= concurrency)
+            pthread_cond_wait(&done, &lock);
+        active++;
+        pthread_mutex_unlock(&lock);
+
+        if (pthread_create(&thread, &attr, worker, &captures[i]) != 0) {
+            fprintf(stderr, "failed to create thread: %s\n", strerror(errno));
+            pthread_mutex_lock(&lock);
+            active--;
+            failed++;
+            pthread_mutex_unlock(&lock);
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    while (active > 0)
+        pthread_cond_wait(&done, &lock);
+    pthread_mutex_unlock(&lock);
+    elapsed = now() - start;
+
+    qsort(latencies, num_latencies, sizeof(double), cmp_double);
+
+    printf("sessions:        %d (%d failed)\n", num_captures, failed);
+    printf("messages:        %d\n", messages);
+    printf("replies:         2xx %d, 3xx %d, 4xx %d, 5xx %d\n",
+        replies[2], replies[3], replies[4], replies[5]);
+    printf("elapsed:         %.3f s\n", elapsed);
+    printf("max lag:         %.3f ms\n", max_lag * 1000.0);
+    printf("reply latency:   p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+        percentile(latencies, num_latencies, 0.50), percentile(latencies, num_latencies, 0.99), percentile(latencies, num_latencies, 0.999), percentile(latencies, num_latencies, 1.0));
+
+    return (failed > 0) ? 1 : 0;
+}
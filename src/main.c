@@ -30,6 +30,7 @@
 #include "smf_trace.h"
 #include "smf_modules.h"
 #include "smf_internal.h"
+#include "smf_server.h"
 
 #define THIS_MODULE "spmfilter"
 
@@ -41,7 +42,8 @@ void usage(void) {
         "  -h, --help    Show help options\n\n"
         "Application Options:\n"
         "  -d, --debug   verbose logging\n"
-        "  -f, --file    alternate config file\n");
+        "  -f, --file    alternate config file\n"
+        "  -q, --queue   recover the messages of died processes in queue_dir\n");
     exit(0);
 }
 
@@ -49,8 +51,11 @@ int main(int argc, char *argv[]) {
     int ret = 0;
     int option = 0;
     int debug = 0;
+    int queue = 0;
     int opt_index = 0;
     char *config_file = NULL;
+    char *upgrade_argv[6];
+    int n = 0;
     SMFSettings_T *settings = NULL;
     struct stat sb;
     
@@ -58,11 +63,12 @@ int main(int argc, char *argv[]) {
         { "debug", 0, NULL, 'd' },
         { "file", 1, NULL, 'f' },
         { "help", 0, NULL, 'h' },
+        { "queue", 0, NULL, 'q' },
         { NULL, 0, NULL, 0 }
     };
 
     while(1) {
-        option = getopt_long(argc, argv, "df:h",long_options,&opt_index);
+        option = getopt_long(argc, argv, "df:hq",long_options,&opt_index);
         if (option == EOF)
             break;
 
@@ -76,12 +82,25 @@ int main(int argc, char *argv[]) {
             case 'f':
                 config_file = strdup(optarg);
                 break;
+            case 'q':
+                queue = 1;
+                break;
             default:
                 usage();
                 break;
         }
     }
 
+    /* the daemon changes its working directory, use an absolute config
+     * path for reloads and binary upgrades */
+    if ((config_file != NULL) && (config_file[0] != '/')) {
+        char *path = realpath(config_file, NULL);
+        if (path != NULL) {
+            free(config_file);
+            config_file = path;
+        }
+    }
+
     settings = smf_settings_new();
     /* parse config file and fill settings struct */
     if (smf_settings_parse_config(&settings,config_file) != 0) {
@@ -90,11 +109,28 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    /* command line of the new master for a binary upgrade */
+    upgrade_argv[n++] = argv[0];
+    if (debug == 1)
+        upgrade_argv[n++] = "-d";
+    if (config_file != NULL) {
+        upgrade_argv[n++] = "-f";
+        upgrade_argv[n++] = strdup(config_file);
+    }
+    if (queue == 1)
+        upgrade_argv[n++] = "-q";
+    upgrade_argv[n] = NULL;
+    smf_server_set_argv(upgrade_argv);
+
     if (config_file != NULL) free(config_file);
 
     if (debug == 1)
         smf_settings_set_debug(settings,debug);
 
+    /* the queue runner replaces the configured engine */
+    if (queue == 1)
+        smf_settings_set_engine(settings,"queue");
+
     openlog("spmfilter", LOG_PID, smf_settings_get_syslog_facility(settings));
 
     /* connect to database/ldap server, if necessary */
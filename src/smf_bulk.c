@@ -0,0 +1,530 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "spmfilter_config.h"
+#include "smf_core.h"
+#include "smf_modules.h"
+#include "smf_trace.h"
+#include "smf_settings.h"
+#include "smf_session.h"
+#include "smf_message_private.h"
+#include "smf_internal.h"
+
+#define THIS_MODULE "bulk"
+
+/* a single message of the input, mbox files contain many of them */
+typedef struct {
+    char *path;
+    off_t offset;
+    off_t length;
+    int mbox;
+} SMFBulkItem_T;
+
+/* progress counters, shared between the master and all workers */
+typedef struct {
+    volatile long next; /* index of the next item to process */
+    volatile long done;
+    volatile long stopped; /* processing stopped by a module */
+    volatile long failed;
+    volatile long long bytes;
+    volatile int stop;
+} SMFBulkStats_T;
+
+static SMFBulkItem_T *items = NULL;
+static long num_items = 0;
+static long max_items = 0;
+static SMFBulkStats_T *stats = NULL;
+
+static volatile sig_atomic_t report = 0;
+
+static void smf_bulk_sig_handler(int sig) {
+    if (sig == SIGALRM)
+        report = 1;
+    else if (stats != NULL)
+        stats->stop = 1;
+}
+
+static int smf_bulk_handle_q_error(SMFSettings_T *settings, SMFSession_T *session) {
+    switch (settings->module_fail) {
+        case 1:
+            return(1);
+        default:
+            return(0);
+    }
+}
+
+static int smf_bulk_handle_q_processing_error(SMFSettings_T *settings, SMFSession_T *session, int retval) {
+    if (retval == -1) {
+        switch (settings->module_fail) {
+            case 1:
+                return(1);
+            default:
+                return(0);
+        }
+    } else if(retval == 2) {
+        return(2);
+    }
+
+    return(1);
+}
+
+static int smf_bulk_handle_nexthop_error(SMFSettings_T *settings, SMFSession_T *session) {
+    return(0);
+}
+
+static int smf_bulk_add_item(char *path, off_t offset, off_t length, int mbox) {
+    SMFBulkItem_T *p = NULL;
+
+    if (num_items == max_items) {
+        max_items = (max_items == 0) ? 1024 : max_items * 2;
+        if ((p = realloc(items, max_items * sizeof(SMFBulkItem_T))) == NULL) {
+            TRACE(TRACE_ERR,"failed to allocate item list: %s (%d)",strerror(errno),errno);
+            return -1;
+        }
+        items = p;
+    }
+
+    items[num_items].path = path;
+    items[num_items].offset = offset;
+    items[num_items].length = length;
+    items[num_items].mbox = mbox;
+    num_items++;
+
+    return 0;
+}
+
+/* add all regular files of a directory, if suffix is set only files
+ * with this suffix are added */
+static int smf_bulk_scan_dir(const char *dir, const char *suffix) {
+    DIR *d = NULL;
+    struct dirent *de = NULL;
+    struct stat sb;
+    char *path = NULL;
+    size_t len;
+    size_t slen = (suffix != NULL) ? strlen(suffix) : 0;
+
+    if ((d = opendir(dir)) == NULL) {
+        TRACE(TRACE_ERR,"failed to open directory %s: %s (%d)",dir,strerror(errno),errno);
+        return -1;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        len = strlen(de->d_name);
+        if ((suffix != NULL) && ((len <= slen) || (strcasecmp(de->d_name + len - slen, suffix) != 0)))
+            continue;
+
+        asprintf(&path, "%s/%s", dir, de->d_name);
+        if ((stat(path, &sb) != 0) || !S_ISREG(sb.st_mode)) {
+            free(path);
+            continue;
+        }
+
+        if (smf_bulk_add_item(path, 0, sb.st_size, 0) != 0) {
+            free(path);
+            closedir(d);
+            return -1;
+        }
+    }
+
+    closedir(d);
+    return 0;
+}
+
+/* split a mbox file into messages, every message starts with a
+ * "From " line at the beginning of the file or behind an empty line */
+static int smf_bulk_scan_mbox(char *path) {
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t nread;
+    off_t pos = 0;
+    off_t start = -1;
+    off_t blank = 0; /* length of the previous line, if it was empty */
+    int prev_empty = 1;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        TRACE(TRACE_ERR,"failed to open mbox %s: %s (%d)",path,strerror(errno),errno);
+        return -1;
+    }
+
+    while ((nread = getline(&line, &len, fp)) != -1) {
+        if (prev_empty && (strncmp(line, "From ", 5) == 0)) {
+            if (start != -1)
+                smf_bulk_add_item(path, start, pos - blank - start, 1);
+            start = pos + nread;
+        }
+
+        prev_empty = ((strcmp(line, LF) == 0) || (strcmp(line, CRLF) == 0));
+        blank = prev_empty ? nread : 0;
+        pos += nread;
+    }
+
+    if (start != -1)
+        smf_bulk_add_item(path, start, pos - blank - start, 1);
+
+    free(line);
+    fclose(fp);
+
+    return 0;
+}
+
+static int smf_bulk_scan(char *source) {
+    struct stat sb;
+    char *cur = NULL;
+    char *new = NULL;
+    int ret;
+
+    if (stat(source, &sb) != 0) {
+        TRACE(TRACE_ERR,"failed to stat %s: %s (%d)",source,strerror(errno),errno);
+        return -1;
+    }
+
+    if (S_ISREG(sb.st_mode))
+        return smf_bulk_scan_mbox(strdup(source));
+
+    if (!S_ISDIR(sb.st_mode)) {
+        TRACE(TRACE_ERR,"%s is neither a mbox file nor a directory",source);
+        return -1;
+    }
+
+    /* a Maildir has cur and new subdirectories, everything else is
+     * treated as directory of .eml files */
+    asprintf(&cur, "%s/cur", source);
+    asprintf(&new, "%s/new", source);
+    if ((stat(cur, &sb) == 0) && S_ISDIR(sb.st_mode) && (stat(new, &sb) == 0) && S_ISDIR(sb.st_mode)) {
+        ret = smf_bulk_scan_dir(cur, NULL);
+        if (ret == 0)
+            ret = smf_bulk_scan_dir(new, NULL);
+    } else
+        ret = smf_bulk_scan_dir(source, ".eml");
+
+    free(cur);
+    free(new);
+
+    return ret;
+}
+
+/* write a mbox message to the spool file and undo the ">From " quoting */
+static int smf_bulk_copy_mbox(SMFBulkItem_T *item, FILE *spool_file) {
+    FILE *fp = NULL;
+    char *line = NULL;
+    char *p = NULL;
+    size_t len = 0;
+    ssize_t nread;
+    off_t left = item->length;
+    int ret = 0;
+
+    if ((fp = fopen(item->path, "r")) == NULL)
+        return -1;
+
+    if (fseeko(fp, item->offset, SEEK_SET) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    while ((left > 0) && ((nread = getline(&line, &len, fp)) != -1)) {
+        if (nread > left)
+            nread = left;
+        left -= nread;
+
+        p = line;
+        if (*p == '>') {
+            while (*p == '>') p++;
+            p = (strncmp(p, "From ", 5) == 0) ? line + 1 : line;
+        }
+
+        if (fwrite(p, sizeof(char), nread - (p - line), spool_file) != (size_t)(nread - (p - line))) {
+            ret = -1;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    return ret;
+}
+
+/* run the module chain over a single message, returns the result of
+ * smf_modules_process() */
+static int smf_bulk_process(SMFSettings_T *settings, SMFProcessQueue_T *q, SMFBulkItem_T *item) {
+    SMFSession_T *session = smf_session_new();
+    SMFMessage_T *message = NULL;
+    FILE *spool_file = NULL;
+    char *qdir = NULL;
+    int fd, src;
+    int ret = -1;
+
+    if (settings->timing_log != NULL)
+        smf_session_enable_timing(session);
+
+    STRACE(TRACE_DEBUG,session->id,"processing %s at offset %ld",item->path,(long)item->offset);
+
+    if ((qdir = smf_core_queue_dir(settings->queue_dir, session->id, settings->queue_hash_depth)) == NULL) {
+        STRACE(TRACE_ERR,session->id,"failed to create queue directory: %s (%d)",strerror(errno),errno);
+        smf_session_free(session);
+        return -1;
+    }
+
+    if ((fd = smf_core_spool_open(qdir, session->id, &session->message_file)) == -1) {
+        STRACE(TRACE_ERR,session->id,"unable to create spool file: %s (%d)",strerror(errno),errno);
+        free(qdir);
+        smf_session_free(session);
+        return -1;
+    }
+
+    if ((spool_file = fdopen(fd, "w+")) == NULL) {
+        STRACE(TRACE_ERR,session->id,"unable to open spool file: %s (%d)",strerror(errno),errno);
+        close(fd);
+        free(qdir);
+        smf_session_free(session);
+        return -1;
+    }
+    setvbuf(spool_file, NULL, _IOFBF, IOBUFSIZE);
+
+    if (item->mbox) {
+        ret = smf_bulk_copy_mbox(item, spool_file);
+    } else if ((src = open(item->path, O_RDONLY)) != -1) {
+        ret = (smf_internal_copy_fd(src, 0, fd) == -1) ? -1 : 0;
+        close(src);
+    }
+
+    if ((ret != 0) || (fflush(spool_file) != 0) ||
+            (smf_core_spool_link(fd, qdir, session->id, &session->message_file) != 0)) {
+        STRACE(TRACE_ERR,session->id,"failed to spool %s: %s (%d)",item->path,strerror(errno),errno);
+        fclose(spool_file);
+        if (session->message_file != NULL)
+            remove(session->message_file);
+        free(qdir);
+        smf_session_free(session);
+        return -1;
+    }
+    fclose(spool_file);
+    free(qdir);
+
+    message = smf_message_new();
+    if (smf_message_from_file(&message,session->message_file,1) != 0) {
+        STRACE(TRACE_ERR,session->id,"smf_message_from_file() failed");
+        smf_message_free(message);
+        ret = -1;
+    } else {
+        session->envelope->message = message;
+        ret = smf_modules_process(q,session,settings);
+    }
+
+    remove(session->message_file);
+
+    if (settings->timing_log != NULL)
+        smf_session_timing_write(session, settings->timing_log);
+
+    smf_session_free(session);
+
+    return ret;
+}
+
+static void smf_bulk_worker(SMFSettings_T *settings, SMFProcessQueue_T *q) {
+    long i;
+    int ret;
+
+    while (!stats->stop) {
+        if ((i = __sync_fetch_and_add(&stats->next, 1)) >= num_items)
+            break;
+
+        ret = smf_bulk_process(settings, q, &items[i]);
+        if (ret == -1) {
+            TRACE(TRACE_WARNING,"failed to process %s at offset %ld",items[i].path,(long)items[i].offset);
+            __sync_fetch_and_add(&stats->failed, 1);
+        } else if (ret == 1)
+            __sync_fetch_and_add(&stats->stopped, 1);
+
+        __sync_fetch_and_add(&stats->bytes, (long long)items[i].length);
+        __sync_fetch_and_add(&stats->done, 1);
+    }
+}
+
+static void smf_bulk_report(struct timeval *start, int final) {
+    struct timeval now, diff;
+    double secs;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+    secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+    if (secs <= 0)
+        secs = 0.000001;
+
+    printf("%s%ld/%ld messages, %ld stopped, %ld failed, %.1f msg/s, %.2f MB/s, %.1fs\n",
+        final ? "done: " : "", stats->done, num_items, stats->stopped, stats->failed,
+        stats->done / secs, stats->bytes / secs / (1024 * 1024), secs);
+    fflush(stdout);
+
+    TRACE(TRACE_INFO,"%ld/%ld messages, %ld stopped, %ld failed, %.1f msg/s",
+        stats->done, num_items, stats->stopped, stats->failed, stats->done / secs);
+}
+
+int load(SMFSettings_T *settings) {
+    SMFProcessQueue_T *q;
+    struct sigaction action;
+    struct timeval start;
+    char *source = NULL;
+    char **sources = NULL;
+    char **p = NULL;
+    int workers, interval;
+    int running = 0;
+    int status;
+    int i;
+    pid_t pid;
+    int ret = 0;
+
+    TRACE(TRACE_INFO,"starting bulk engine");
+
+    /* messages are only filtered, they are not delivered again */
+    if (settings->nexthop != NULL) {
+        TRACE(TRACE_WARNING,"nexthop is ignored by the bulk engine");
+        free(settings->nexthop);
+        settings->nexthop = NULL;
+    }
+
+    if ((source = smf_settings_group_get(settings, "bulk", "source")) == NULL) {
+        TRACE(TRACE_ERR,"no source configured in [bulk] section");
+        return(-1);
+    }
+
+    workers = smf_settings_group_get_integer(settings, "bulk", "workers");
+    if (workers <= 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0)
+        workers = 1;
+
+    interval = smf_settings_group_get_integer(settings, "bulk", "progress_interval");
+    if (interval <= 0)
+        interval = 10;
+
+    q = smf_modules_pqueue_init(
+        smf_bulk_handle_q_error,
+        smf_bulk_handle_q_processing_error,
+        smf_bulk_handle_nexthop_error
+    );
+
+    if(q == NULL) {
+        TRACE(TRACE_ERR,"failed to initialize module queue");
+        return(-1);
+    }
+
+    sources = smf_core_strsplit(source, ";", NULL);
+    for (p = sources; *p != NULL; p++) {
+        smf_core_strstrip(*p);
+        if ((**p != '\0') && (smf_bulk_scan(*p) != 0))
+            ret = -1;
+        free(*p);
+    }
+    free(sources);
+
+    if (ret != 0) {
+        free(q);
+        return(-1);
+    }
+
+    if (num_items == 0) {
+        TRACE(TRACE_WARNING,"no messages found in %s",source);
+        free(q);
+        return(0);
+    }
+
+    stats = mmap(NULL, sizeof(SMFBulkStats_T), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        TRACE(TRACE_ERR,"failed to map progress counters: %s (%d)",strerror(errno),errno);
+        stats = NULL;
+        free(q);
+        return(-1);
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = smf_bulk_sig_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGALRM, &action, NULL);
+
+    if (workers > num_items)
+        workers = num_items;
+
+    TRACE(TRACE_INFO,"processing %ld messages with %d workers",num_items,workers);
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < workers; i++) {
+        switch(pid = fork()) {
+            case -1:
+                TRACE(TRACE_ERR,"fork() failed: %s (%d)",strerror(errno),errno);
+                break;
+            case 0:
+                signal(SIGALRM, SIG_DFL);
+                smf_bulk_worker(settings, q);
+                exit(0);
+            default:
+                running++;
+                break;
+        }
+    }
+
+    /* SIGALRM interrupts waitpid() for the progress report */
+    alarm(interval);
+    while (running > 0) {
+        if ((pid = waitpid(-1, &status, 0)) > 0) {
+            running--;
+            if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+                TRACE(TRACE_ERR,"worker [%d] terminated abnormally",pid);
+        } else if (errno == ECHILD) {
+            break;
+        } else if (report) {
+            report = 0;
+            smf_bulk_report(&start, 0);
+            alarm(interval);
+        }
+    }
+    alarm(0);
+
+    smf_bulk_report(&start, 1);
+
+    if ((stats->failed > 0) || (stats->done < num_items))
+        ret = -1;
+
+    munmap(stats, sizeof(SMFBulkStats_T));
+    stats = NULL;
+    free(q);
+
+    return ret;
+}
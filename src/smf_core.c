@@ -128,6 +128,133 @@ int smf_core_gen_queue_file(const char *queue_dir, char **tempname, const char *
     return 0;   
 }
 
+int smf_core_spool_open(const char *queue_dir, const char *sid, char **path) {
+    int fd;
+
+    assert(queue_dir);
+    assert(sid);
+    assert(path);
+
+    *path = NULL;
+#ifdef O_TMPFILE
+    /* unnamed file, it gets a name only if someone requires a path */
+    if ((fd = open(queue_dir, O_TMPFILE | O_RDWR, 0600)) != -1)
+        return fd;
+
+    /* filesystem without O_TMPFILE support, use a named file */
+    if ((errno != EOPNOTSUPP) && (errno != EISDIR) && (errno != EINVAL))
+        return -1;
+#endif
+
+    asprintf(path,"%s/%s.XXXXXX",queue_dir,sid);
+    if ((fd = mkstemp(*path)) == -1) {
+        free(*path);
+        *path = NULL;
+    }
+
+    return fd;
+}
+
+int smf_core_spool_link(int fd, const char *queue_dir, const char *sid, char **path) {
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    char proc[64];
+    char *name = NULL;
+    size_t len;
+    int tries, i;
+
+    assert(queue_dir);
+    assert(sid);
+    assert(path);
+
+    /* already linked or created by the named fallback */
+    if (*path != NULL)
+        return 0;
+
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    asprintf(&name,"%s/%s.XXXXXX",queue_dir,sid);
+    len = strlen(name);
+
+    for (tries = 0; tries < 100; tries++) {
+        for (i = 6; i > 0; i--)
+            name[len - i] = chars[random() % (sizeof(chars) - 1)];
+
+        if (linkat(AT_FDCWD, proc, AT_FDCWD, name, AT_SYMLINK_FOLLOW) == 0) {
+            *path = name;
+            return 0;
+        }
+
+        if (errno != EEXIST)
+            break;
+    }
+
+    free(name);
+    return -1;
+}
+
+int smf_core_spool_sync(int fd, const char *path, int full) {
+    char *dir = NULL;
+    char *p = NULL;
+    int dfd;
+    int ret;
+
+    if (!full)
+        return fdatasync(fd);
+
+    if (fsync(fd) != 0)
+        return -1;
+
+    /* an unnamed spool file has no directory entry yet */
+    if (path == NULL)
+        return 0;
+
+    dir = strdup(path);
+    if ((p = strrchr(dir, '/')) != NULL)
+        *p = '\0';
+    else
+        strcpy(dir, ".");
+
+    if ((dfd = open(p == dir ? "/" : dir, O_RDONLY | O_DIRECTORY)) == -1) {
+        free(dir);
+        return -1;
+    }
+
+    ret = fsync(dfd);
+    close(dfd);
+    free(dir);
+
+    return ret;
+}
+
+char *smf_core_queue_dir(const char *queue_dir, const char *sid, int depth) {
+    char *path = NULL;
+    size_t len;
+    int i;
+
+    assert(queue_dir);
+    assert(sid);
+
+    len = strlen(queue_dir);
+    path = (char *)calloc(len + (depth * 2) + 1, sizeof(char));
+    if (path == NULL)
+        return NULL;
+
+    strcpy(path, queue_dir);
+    
+    /* one level per leading character of the session id */
+    for (i = 0; i < depth && sid[i] != '\0'; i++) {
+        path[len++] = '/';
+        path[len++] = sid[i];
+        path[len] = '\0';
+
+        if ((mkdir(path, 0750) != 0) && (errno != EEXIST)) {
+            free(path);
+            return NULL;
+        }
+    }
+
+    return path;
+}
+
 char *smf_core_md5sum(const char *data) {
     md5_state_t state;
     md5_byte_t digest[16];
@@ -74,6 +74,56 @@ char **smf_core_strsplit(const char *s, char *sep, int *nelems);
  */
 int smf_core_gen_queue_file(const char *queue_dir, char **tempname, const char *sid);
 
+/*!
+ * @fn int smf_core_spool_open(const char *queue_dir, const char *sid, char **path)
+ * @brief Create a new spool file. If supported, the file is created 
+ *        without a name (O_TMPFILE) and vanishes on close unless it gets
+ *        linked into the queue with smf_core_spool_link(). Otherwise a named
+ *        queue file is created.
+ * @param queue_dir path to queue directory
+ * @param sid current session id
+ * @param path set to the newly allocated filename of a named spool file,
+ *        NULL for an unnamed one
+ * @return file descriptor opened for reading and writing or -1 in case of error
+ */
+int smf_core_spool_open(const char *queue_dir, const char *sid, char **path);
+
+/*!
+ * @fn int smf_core_spool_link(int fd, const char *queue_dir, const char *sid, char **path)
+ * @brief Give a spool file created by smf_core_spool_open() a name in 
+ *        queue_dir. Nothing is done if path already holds a filename.
+ * @param fd spool file descriptor
+ * @param queue_dir path to queue directory
+ * @param sid current session id
+ * @param path pointer to the filename of the spool file, set to the newly 
+ *        allocated filename on success
+ * @return 0 on success or -1 in case of error
+ */
+int smf_core_spool_link(int fd, const char *queue_dir, const char *sid, char **path);
+
+/*!
+ * @fn int smf_core_spool_sync(int fd, const char *path, int full)
+ * @brief Flush a spool file to stable storage
+ * @param fd spool file descriptor
+ * @param path filename of the spool file, NULL for an unnamed one
+ * @param full if 0 only the file data is flushed, otherwise the file 
+ *        metadata and the directory entry are flushed as well
+ * @return 0 on success or -1 in case of error
+ */
+int smf_core_spool_sync(int fd, const char *path, int full);
+
+/*!
+ * @fn char *smf_core_queue_dir(const char *queue_dir, const char *sid, int depth)
+ * @brief Build the hashed queue directory for a session and create missing
+ *        levels. Every level is named after one leading character of the
+ *        session id, e.g. queue_dir/A/B with a depth of 2.
+ * @param queue_dir path to queue directory
+ * @param sid current session id
+ * @param depth number of subdirectory levels, 0 returns a copy of queue_dir
+ * @return newly allocated path or NULL in case of error
+ */
+char *smf_core_queue_dir(const char *queue_dir, const char *sid, int depth);
+
 /*!
  * @fn char *smf_core_md5sum(const char *data)
  * @brief Generate md5 hexdigest for string
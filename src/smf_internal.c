@@ -24,8 +24,13 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/times.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
+#include "spmfilter_config.h"
 #include "smf_internal.h"
 #include "smf_trace.h"
 #include "smf_dict.h"
@@ -128,9 +133,10 @@ ssize_t smf_internal_writen(int fd, const void *buf, size_t nbyte) {
 }
 
 ssize_t smf_internal_readline(int fd, void *buf, size_t nbyte, void **help) {
-    size_t n;
-    ssize_t br;
-    char c, *ptr = buf;
+    size_t n = 0;
+    size_t len;
+    char *ptr = buf;
+    char *nl = NULL;
     readline_t *rl = *help;
 
     if (rl == NULL) {
@@ -142,19 +148,34 @@ ssize_t smf_internal_readline(int fd, void *buf, size_t nbyte, void **help) {
         *help = rl;
     }   
 
-    for (n = 1; n < nbyte; n++) {
-        if ((br = smf_internal_readcbuf(fd,&c,rl)) < 0)
-            return -1;
+    /* copy whole chunks out of the read buffer instead of single chars */
+    while ((nl == NULL) && (n < nbyte - 1)) {
+        if (rl->count < 1) {
+            if ((rl->count = read(fd, rl->buf, sizeof(rl->buf))) < 0) {
+                rl->count = 0;
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            } else if (rl->count == 0)
+                break;
 
-        *ptr++ = c;
-        if ((br == 0) || ( c == '\n'))
-            break;
+            rl->current = rl->buf;
+        }
+
+        len = (size_t)rl->count < (nbyte - 1 - n) ? (size_t)rl->count : (nbyte - 1 - n);
+        if ((nl = memchr(rl->current, '\n', len)) != NULL)
+            len = nl - rl->current + 1;
+
+        memcpy(ptr + n, rl->current, len);
+        rl->current += len;
+        rl->count -= len;
+        n += len;
     }
 
-    if ((br == 0) && (n == 1))
+    if (n == 0)
         return 0;
 
-    *ptr = 0;
+    ptr[n] = 0;
     return n;
 }
 
@@ -177,6 +198,116 @@ ssize_t smf_internal_readcbuf(int fd, char *buf, readline_t *rl) {
     return 1;
 }
 
+ssize_t smf_internal_copy_fd(int in, off_t offset, int out) {
+    ssize_t n;
+    ssize_t total = 0;
+    char *buf = NULL;
+
+#ifdef __linux__
+#ifdef HAVE_COPY_FILE_RANGE
+    /* in-kernel copy, file to file */
+    while ((n = copy_file_range(in, &offset, out, NULL, IOBUFSIZE * 16, 0)) > 0)
+        total += n;
+    
+    if (n == 0)
+        return total;
+
+    /* sendfile() works on more combinations of file descriptors */
+    if ((errno != EXDEV) && (errno != EINVAL) && (errno != ENOSYS) && 
+            (errno != EOPNOTSUPP) && (errno != EBADF))
+        return -1;
+#endif
+
+    while ((n = sendfile(out, in, &offset, IOBUFSIZE * 16)) > 0)
+        total += n;
+
+    if (n == 0)
+        return total;
+
+    if ((errno != EINVAL) && (errno != ENOSYS) && (errno != EOPNOTSUPP) && (errno != EBADF))
+        return -1;
+#endif
+
+    if ((buf = malloc(IOBUFSIZE)) == NULL)
+        return -1;
+
+    while ((n = pread(in, buf, IOBUFSIZE, offset)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            return -1;
+        }
+
+        if (smf_internal_writen(out, buf, n) != n) {
+            free(buf);
+            return -1;
+        }
+
+        offset += n;
+        total += n;
+    }
+
+    free(buf);
+    return total;
+}
+
+ssize_t smf_internal_copy_stream(int in, int out) {
+    ssize_t n;
+    ssize_t total = 0;
+    char *buf = NULL;
+
+#ifdef __linux__
+    /* pipe to file, the pages are moved without a copy to user space */
+    while ((n = splice(in, NULL, out, NULL, IOBUFSIZE * 16, SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        total += n;
+    }
+
+    if (n == 0)
+        return total;
+
+    if (errno != EINVAL)
+        return -1;
+
+    /* not a pipe, try sendfile() for a redirected regular file */
+    while ((n = sendfile(out, in, NULL, IOBUFSIZE * 16)) > 0)
+        total += n;
+
+    if (n == 0)
+        return total;
+
+    if ((errno != EINVAL) && (errno != ENOSYS))
+        return -1;
+#endif
+
+    if ((buf = malloc(IOBUFSIZE)) == NULL)
+        return -1;
+
+    while ((n = read(in, buf, IOBUFSIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            return -1;
+        }
+
+        if (smf_internal_writen(out, buf, n) != n) {
+            free(buf);
+            return -1;
+        }
+
+        total += n;
+    }
+
+    free(buf);
+    return total;
+}
+
 struct tms smf_internal_init_runtime_stats(void) {
     struct tms start_acct;
     times(&start_acct);
@@ -32,6 +32,7 @@ extern "C" {
 
 #define MAXLINE 512
 #define BUFSIZE 512
+#define IOBUFSIZE 65536 /* socket read buffer, spool file buffer */
 
 #define CRLF "\r\n"
 #define LF "\n"
@@ -40,7 +41,7 @@ extern "C" {
 typedef struct {
     int count;
     char *current;
-    char buf[BUFSIZE];
+    char buf[IOBUFSIZE];
 } readline_t;
 
 void smf_internal_string_list_destroy(void *data);
@@ -56,6 +57,16 @@ ssize_t smf_internal_writen(int fd, const void *buf, size_t nbyte);
 ssize_t smf_internal_readline(int fd, void *buf, size_t nbyte, void **help);
 ssize_t smf_internal_readcbuf(int fd, char *buf, readline_t *rl);
 
+/* copy everything behind offset in fd in to the current position of fd 
+ * out, the data stays in the kernel whenever possible. Returns the 
+ * number of bytes copied or -1 */
+ssize_t smf_internal_copy_fd(int in, off_t offset, int out);
+
+/* copy everything up to EOF from the stream in (e.g. a pipe or socket) 
+ * to the current position of fd out. Returns the number of bytes 
+ * copied or -1 */
+ssize_t smf_internal_copy_stream(int in, int out);
+
 struct tms smf_internal_init_runtime_stats(void);
 void smf_internal_print_runtime_stats(struct tms start_acct, const char *sid);
 char *smf_internal_determine_linebreak(const char *s);
@@ -380,55 +380,36 @@ SMFPart_T *smf_message_part_last(SMFMessage_T *message) {
 }
 
 int smf_message_write_skip_header(FILE *src, FILE *dest) {
-    int found = 0;
     char *buf = NULL;
-    size_t len;
-    size_t nwritten = 0;
+    size_t len = 0;
+    ssize_t nwritten;
+    off_t offset;
     
-    while (!feof(src)) {
-        ssize_t nbytes;
-        size_t nbytes_dest;
-
-        if (found == 0) {
-            if ((nbytes = getline(&buf, &len, src)) == -1) {
-                TRACE(TRACE_ERR, "failed to read queue_file");
-                free(buf);
-                return -1;
-            }
-
-            if ((strcmp(buf, LF) == 0) || (strcmp(buf, CRLF) == 0)) {
-                found = 1;
-                
-                // Prepare "buf" for the following body-read
-                free(buf);
-                buf = malloc(BUFSIZE);
-            }
-            
-            continue;
-        }
-        
-        if ((nbytes = fread(buf, 1, BUFSIZE, src)) == 0) {
-            TRACE(TRACE_ERR, "failed to read queue file: %s (%d)", strerror(errno), errno);
+    /* skip the header, it ends with the first empty line */
+    do {
+        if (getline(&buf, &len, src) == -1) {
+            TRACE(TRACE_ERR, "failed to read queue_file");
             free(buf);
             return -1;
         }
+    } while ((strcmp(buf, LF) != 0) && (strcmp(buf, CRLF) != 0));
+    free(buf);
 
-        nbytes_dest = 0;
-        while (nbytes > 0) {
-            size_t n;
-            if ((n = fwrite(buf + nbytes_dest, 1, nbytes, dest)) == 0) {
-                TRACE(TRACE_ERR, "failed to write queue file: %s (%d)", strerror(errno), errno);
-                free(buf);
-                return -1;
-            }
-            
-            nbytes -= n;
-            nbytes_dest += n;
-            nwritten += n;
-        }
+    /* let the kernel copy the body */
+    offset = ftello(src);
+    if (fflush(dest) != 0) {
+        TRACE(TRACE_ERR, "failed to write queue file: %s (%d)", strerror(errno), errno);
+        return -1;
     }
-    
-    free(buf);
+
+    if ((nwritten = smf_internal_copy_fd(fileno(src), offset, fileno(dest))) == -1) {
+        TRACE(TRACE_ERR, "failed to copy queue file: %s (%d)", strerror(errno), errno);
+        return -1;
+    }
+
+    /* both streams have been bypassed, sync them with their descriptors */
+    fseeko(src, 0, SEEK_END);
+    fseeko(dest, lseek(fileno(dest), 0, SEEK_CUR), SEEK_SET);
 
     return nwritten;
 }
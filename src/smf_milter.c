@@ -0,0 +1,848 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner, Werner Detter and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/times.h>
+#include <arpa/inet.h>
+
+#include "spmfilter_config.h"
+#include "smf_milter.h"
+#include "smf_trace.h"
+#include "smf_settings.h"
+#include "smf_settings_private.h"
+#include "smf_modules.h"
+#include "smf_session.h"
+#include "smf_core.h"
+#include "smf_header.h"
+#include "smf_message.h"
+#include "smf_message_private.h"
+#include "smf_internal.h"
+#include "smf_dict.h"
+#include "smf_server.h"
+
+#define THIS_MODULE "milter"
+
+/* actions and protocol steps negotiated with the MTA */
+static uint32_t milter_actions = 0;
+static uint32_t milter_noreply = 0;
+
+/* the modules have mail/rcpt or data hooks, see smf_modules.h */
+static int milter_envelope_hooks = 0;
+static int milter_data_hooks = 0;
+
+/* final response for the current message, set by the queue handlers */
+static char milter_verdict = SMFIR_ACCEPT;
+static char *milter_reply = NULL;
+
+/* the current message has been refused by a data hook */
+static int milter_refused = 0;
+
+/* spool file of the current message, opened with the first header */
+static FILE *spool_file = NULL;
+static char *spool_dir = NULL;
+static int spool_error = 0;
+
+static void smf_milter_sig_handler(int sig) {
+    if (sig == SIGALRM)
+        TRACE(TRACE_DEBUG,"session timeout exceeded");
+
+    TRACE(TRACE_NOTICE, "terminating child %i", getpid());
+    exit(0);
+}
+
+/* remember the reply for a module or processing failure */
+static void smf_milter_set_reply(SMFSettings_T *settings, int code, char *msg) {
+    char *code_str = NULL;
+
+    free(milter_reply);
+    milter_reply = NULL;
+
+    /* the smtpd engine accepts and drops the message for other codes */
+    if ((code < 400) || (code > 599)) {
+        milter_verdict = SMFIR_DISCARD;
+        return;
+    }
+
+    milter_verdict = (code < 500) ? SMFIR_TEMPFAIL : SMFIR_REJECT;
+    if (msg == NULL) {
+        asprintf(&code_str,"%d",code);
+        msg = smf_dict_get(settings->smtp_codes,code_str);
+        free(code_str);
+    }
+
+    if (msg != NULL)
+        asprintf(&milter_reply,"%d %s",code,msg);
+    else
+        asprintf(&milter_reply,"%d %d.3.0 %s",code,code / 100,MILTER_REPLY_TEXT);
+}
+
+/* map the result of the module hooks like the smtpd engine, returns the
+ * code, which refuses the protocol step, or 0 */
+static int smf_milter_hook_code(SMFSettings_T *settings, int ret) {
+    if (ret != -1)
+        return ret;
+
+    switch (settings->module_fail) {
+        case 1: return 0;
+        case 2: return 552;
+        default: return 451;
+    }
+}
+
+/* remember the reply for a step refused by a module hook */
+static void smf_milter_hook_reply(SMFSettings_T *settings, SMFSession_T *session, int code) {
+    smf_milter_set_reply(settings, code, session->response_msg);
+
+    /* the text belongs to this reply only */
+    free(session->response_msg);
+    session->response_msg = NULL;
+}
+
+static int smf_milter_handle_q_error(SMFSettings_T *settings, SMFSession_T *session) {
+    switch (settings->module_fail) {
+        case 1: return(2);
+        case 2: smf_milter_set_reply(settings,552,NULL);
+                return(0);
+        case 3: smf_milter_set_reply(settings,451,NULL);
+                return(0);
+    }
+
+    return 0;
+}
+
+static int smf_milter_handle_q_processing_error(SMFSettings_T *settings, SMFSession_T *session, int retval) {
+    if (retval == -1) {
+        /* "ignore" accepts the message like a module, which turned to 
+         * nexthop processing */
+        switch (settings->module_fail) {
+            case 1: return(2);
+            case 2: smf_milter_set_reply(settings,552,NULL);
+                    return(0);
+            case 3: smf_milter_set_reply(settings,451,NULL);
+                    return(0);
+        }
+    } else if(retval == 1) {
+        milter_verdict = SMFIR_DISCARD;
+        return(1);
+    } else if(retval == 2) {
+        return(2);
+    } else {
+        smf_milter_set_reply(settings,retval,session->response_msg);
+        return(1);
+    }
+
+    STRACE(TRACE_DEBUG, session->id, "no conditional matched, will stop queue processing!");
+    return(0);
+}
+
+/* the MTA delivers the message itself, there is no nexthop */
+static int smf_milter_handle_nexthop_error(SMFSettings_T *settings, SMFSession_T *session) {
+    return 0;
+}
+
+/* read one packet: 4 byte length in network byte order, the command and
+ * its data. The data is always terminated with \0 */
+static int smf_milter_read_packet(int sock, char *cmd, char **data, size_t *len) {
+    uint32_t nlen;
+
+    *data = NULL;
+    if (smf_internal_readn(sock, &nlen, sizeof(nlen)) != sizeof(nlen))
+        return -1;
+
+    *len = ntohl(nlen);
+    if ((*len < 1) || (*len > MILTER_MAX_PACKET)) {
+        TRACE(TRACE_ERR,"invalid milter packet length %zu",*len);
+        return -1;
+    }
+
+    if (smf_internal_readn(sock, cmd, 1) != 1)
+        return -1;
+
+    *len -= 1;
+    if ((*data = malloc(*len + 1)) == NULL)
+        return -1;
+
+    if ((*len > 0) && (smf_internal_readn(sock, *data, *len) != (ssize_t)*len)) {
+        free(*data);
+        *data = NULL;
+        return -1;
+    }
+    (*data)[*len] = '\0';
+
+    return 0;
+}
+
+static int smf_milter_write_packet(int sock, char cmd, const char *data, size_t len) {
+    char *buf = NULL;
+    uint32_t nlen = htonl(len + 1);
+    ssize_t size = sizeof(nlen) + 1 + len;
+    int ret = 0;
+
+    if ((buf = malloc(size)) == NULL)
+        return -1;
+
+    memcpy(buf, &nlen, sizeof(nlen));
+    buf[sizeof(nlen)] = cmd;
+    if (len > 0)
+        memcpy(buf + sizeof(nlen) + 1, data, len);
+
+    if (smf_internal_writen(sock, buf, size) != size) {
+        TRACE(TRACE_ERR,"failed to write milter response: %s (%d)",strerror(errno),errno);
+        ret = -1;
+    }
+
+    free(buf);
+    return ret;
+}
+
+/* reply to a protocol step, unless the MTA doesn't wait for it */
+static int smf_milter_continue(int sock, uint32_t step) {
+    if (milter_noreply & step)
+        return 0;
+
+    return smf_milter_write_packet(sock, SMFIR_CONTINUE, NULL, 0);
+}
+
+/* send the remembered reply or verdict */
+static int smf_milter_reply(int sock) {
+    if (milter_reply != NULL)
+        return smf_milter_write_packet(sock, SMFIR_REPLYCODE, milter_reply, strlen(milter_reply) + 1);
+
+    return smf_milter_write_packet(sock, milter_verdict, NULL, 0);
+}
+
+static int smf_milter_optneg(int sock, char *data, size_t len) {
+    uint32_t v[3];
+
+    if (len < sizeof(v)) {
+        TRACE(TRACE_ERR,"option negotiation too short");
+        return -1;
+    }
+
+    memcpy(v, data, sizeof(v));
+    v[0] = ntohl(v[0]);
+    v[1] = ntohl(v[1]);
+    v[2] = ntohl(v[2]);
+
+    if (v[0] < 2) {
+        TRACE(TRACE_ERR,"unsupported milter protocol version %u",v[0]);
+        return -1;
+    }
+
+    /* the protocol flags are a mask of steps the MTA may skip, ask it 
+     * not to wait for replies to steps we always continue */
+    milter_actions = v[1] & MILTER_ACTIONS;
+    milter_noreply = (v[0] >= 6) ? (v[2] & MILTER_NO_REPLY) : 0;
+
+    /* steps, which a module hook may refuse, have to be answered */
+    if (milter_envelope_hooks > 0)
+        milter_noreply &= ~(SMFIP_NR_MAIL | SMFIP_NR_RCPT);
+    if (milter_data_hooks > 0)
+        milter_noreply &= ~(SMFIP_NR_HDR | SMFIP_NR_EOH | SMFIP_NR_BODY);
+    TRACE(TRACE_DEBUG,"milter version %u, actions 0x%x, protocol 0x%x",v[0],milter_actions,milter_noreply);
+
+    v[0] = htonl((v[0] < SMFI_VERSION) ? v[0] : SMFI_VERSION);
+    v[1] = htonl(milter_actions);
+    v[2] = htonl(milter_noreply);
+
+    return smf_milter_write_packet(sock, SMFIC_OPTNEG, (char *)v, sizeof(v));
+}
+
+/* create a new session for the next message, the client data of the
+ * connection is carried over */
+static SMFSession_T *smf_milter_session_new(SMFSettings_T *settings, int client, SMFSession_T *prev) {
+    SMFSession_T *session = smf_session_new();
+
+    session->sock = client;
+    if (settings->timing_log != NULL)
+        smf_session_enable_timing(session);
+
+    if (prev != NULL) {
+        if (prev->helo != NULL)
+            smf_session_set_helo(session, prev->helo);
+        if (prev->xforward_addr != NULL)
+            smf_session_set_xforward_addr(session, prev->xforward_addr);
+    }
+
+    return session;
+}
+
+/* drop the spool file of the current message */
+static void smf_milter_spool_discard(SMFSession_T *session) {
+    if (spool_file != NULL) {
+        fclose(spool_file);
+        spool_file = NULL;
+    }
+
+    if (session->message_file != NULL) {
+        STRACE(TRACE_DEBUG,session->id,"removing spool file %s",session->message_file);
+        if (remove(session->message_file) != 0)
+            STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+
+        free(session->message_file);
+        session->message_file = NULL;
+    }
+
+    free(spool_dir);
+    spool_dir = NULL;
+    spool_error = 0;
+}
+
+/* finish the current message and start a new session */
+static SMFSession_T *smf_milter_session_reset(SMFSettings_T *settings, SMFSession_T *session, int keep) {
+    SMFSession_T *next = NULL;
+
+    smf_milter_spool_discard(session);
+    milter_refused = 0;
+    next = smf_milter_session_new(settings, session->sock, keep ? session : NULL);
+
+    if (settings->timing_log != NULL)
+        smf_session_timing_write(session, settings->timing_log);
+    smf_session_free(session);
+
+    return next;
+}
+
+/* append message data to the spool file, which is opened on demand */
+static void smf_milter_spool_write(SMFSettings_T *settings, SMFSession_T *session, const char *buf, size_t len) {
+    int fd;
+
+    if (spool_error)
+        return;
+
+    if (spool_file == NULL) {
+        if ((spool_dir = smf_core_queue_dir(settings->queue_dir, session->id, settings->queue_hash_depth)) == NULL) {
+            STRACE(TRACE_ERR,session->id,"failed to create queue directory: %s (%d)",strerror(errno),errno);
+            spool_error = 1;
+            return;
+        }
+
+        if ((fd = smf_core_spool_open(spool_dir, session->id, &session->message_file)) == -1) {
+            STRACE(TRACE_ERR,session->id,"unable to create spool file: %s (%d)",strerror(errno), errno);
+            spool_error = 1;
+            return;
+        }
+
+        if ((spool_file = fdopen(fd, "w")) == NULL) {
+            STRACE(TRACE_ERR,session->id,"unable to open spool file: %s (%d)",strerror(errno), errno);
+            close(fd);
+            spool_error = 1;
+            return;
+        }
+        setvbuf(spool_file, NULL, _IOFBF, IOBUFSIZE);
+    }
+
+    if ((len > 0) && (fwrite(buf, 1, len, spool_file) != len)) {
+        STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
+        spool_error = 1;
+    }
+    session->message_size += len;
+}
+
+/* spool message data and feed it to the data hooks, a length of 0 ends
+ * the message. Returns the code, which refused the message, or 0 */
+static int smf_milter_data(SMFSettings_T *settings, SMFSession_T *session, const char *buf, size_t len) {
+    int ret = 0;
+
+    if (len > 0)
+        smf_milter_spool_write(settings, session, buf, len);
+
+    if (milter_data_hooks > 0)
+        ret = smf_milter_hook_code(settings, smf_modules_process_data(settings, session, buf, len));
+
+    if (ret != 0) {
+        STRACE(TRACE_INFO,session->id,"message refused with %d",ret);
+        /* refused messages are neither spooled nor processed */
+        smf_milter_spool_discard(session);
+        smf_milter_hook_reply(settings, session, ret);
+        milter_refused = 1;
+    }
+
+    return ret;
+}
+
+/* answer a step of the message data, the MTA should skip the rest of a
+ * refused message, otherwise it gets the refusal again */
+static int smf_milter_data_step(SMFSettings_T *settings, SMFSession_T *session, const char *buf, size_t len, uint32_t step) {
+    if (!milter_refused && (smf_milter_data(settings, session, buf, len) == 0))
+        return smf_milter_continue(session->sock, step);
+
+    return smf_milter_reply(session->sock);
+}
+
+static SMFHeader_T *smf_milter_find_header(SMFList_T *headers, const char *name) {
+    SMFListElem_T *elem = smf_list_head(headers);
+    SMFHeader_T *h = NULL;
+
+    while (elem != NULL) {
+        h = (SMFHeader_T *)smf_list_data(elem);
+        if (strcasecmp(smf_header_get_name(h), name) == 0)
+            return h;
+        elem = elem->next;
+    }
+
+    return NULL;
+}
+
+/* send SMFIR_ADDHEADER or, with an index, SMFIR_CHGHEADER */
+static int smf_milter_header_mod(int sock, char cmd, int index, char *name, char *value) {
+    char *buf = NULL;
+    size_t nlen = strlen(name) + 1;
+    size_t vlen;
+    size_t len = 0;
+    uint32_t nindex = htonl(index);
+    int ret;
+
+    /* the MTA inserts the space after the colon itself */
+    while ((*value == ' ') || (*value == '\t'))
+        value++;
+    vlen = strlen(value) + 1;
+
+    if ((buf = malloc(sizeof(nindex) + nlen + vlen)) == NULL)
+        return -1;
+
+    if (cmd == SMFIR_CHGHEADER) {
+        memcpy(buf, &nindex, sizeof(nindex));
+        len += sizeof(nindex);
+    }
+    memcpy(buf + len, name, nlen);
+    len += nlen;
+    memcpy(buf + len, value, vlen);
+    len += vlen;
+
+    ret = smf_milter_write_packet(sock, cmd, buf, len);
+    free(buf);
+    return ret;
+}
+
+/* turn the header changes of the modules into milter modifications. The
+ * index of SMFIR_CHGHEADER counts the occurrences of a header name, 
+ * surplus occurrences are deleted from the last one down */
+static int smf_milter_send_headers(SMFSession_T *session, SMFList_T *initial, SMFMessage_T *msg) {
+    SMFListElem_T *elem = NULL;
+    SMFHeader_T *h_init = NULL;
+    SMFHeader_T *h_msg = NULL;
+    int n_init, n_msg, i;
+
+    elem = smf_list_head(initial);
+    while (elem != NULL) {
+        h_init = (SMFHeader_T *)smf_list_data(elem);
+        h_msg = smf_milter_find_header(msg->headers, smf_header_get_name(h_init));
+        n_init = smf_header_get_count(h_init);
+        n_msg = (h_msg != NULL) ? smf_header_get_count(h_msg) : 0;
+
+        for (i = 0; (i < n_init) && (i < n_msg); i++) {
+            if (strcmp(smf_header_get_value(h_init, i), smf_header_get_value(h_msg, i)) != 0) {
+                if (smf_milter_header_mod(session->sock, SMFIR_CHGHEADER, i + 1,
+                        smf_header_get_name(h_init), smf_header_get_value(h_msg, i)) != 0)
+                    return -1;
+            }
+        }
+
+        for (i = n_init - 1; i >= n_msg; i--) {
+            if (smf_milter_header_mod(session->sock, SMFIR_CHGHEADER, i + 1, 
+                    smf_header_get_name(h_init), "") != 0)
+                return -1;
+        }
+        elem = elem->next;
+    }
+
+    elem = smf_list_head(msg->headers);
+    while (elem != NULL) {
+        h_msg = (SMFHeader_T *)smf_list_data(elem);
+        h_init = smf_milter_find_header(initial, smf_header_get_name(h_msg));
+        n_init = (h_init != NULL) ? smf_header_get_count(h_init) : 0;
+
+        for (i = n_init; i < smf_header_get_count(h_msg); i++) {
+            STRACE(TRACE_DEBUG,session->id,"adding header %s",smf_header_get_name(h_msg));
+            if (smf_milter_header_mod(session->sock, SMFIR_ADDHEADER, 0, 
+                    smf_header_get_name(h_msg), smf_header_get_value(h_msg, i)) != 0)
+                return -1;
+        }
+        elem = elem->next;
+    }
+
+    return 0;
+}
+
+static int smf_milter_find_rcpt(SMFList_T *rcpts, const char *rcpt) {
+    SMFListElem_T *elem = (rcpts != NULL) ? smf_list_head(rcpts) : NULL;
+
+    while (elem != NULL) {
+        if (strcasecmp((char *)smf_list_data(elem), rcpt) == 0)
+            return 1;
+        elem = elem->next;
+    }
+
+    return 0;
+}
+
+/* send an envelope address in angle brackets */
+static int smf_milter_addr_mod(int sock, char cmd, const char *addr) {
+    char *buf = NULL;
+    int ret;
+
+    asprintf(&buf, "<%s>", addr != NULL ? addr : "");
+    ret = smf_milter_write_packet(sock, cmd, buf, strlen(buf) + 1);
+    free(buf);
+
+    return ret;
+}
+
+/* turn envelope changes of the modules into milter modifications */
+static int smf_milter_send_envelope(SMFSession_T *session, char *sender, SMFList_T *initial) {
+    SMFEnvelope_T *env = session->envelope;
+    SMFListElem_T *elem = NULL;
+    char *rcpt = NULL;
+
+    if ((milter_actions & SMFIF_CHGFROM) && (env->sender != NULL) && 
+            ((sender == NULL) || (strcmp(sender, env->sender) != 0))) {
+        STRACE(TRACE_DEBUG,session->id,"changing sender to %s",env->sender);
+        if (smf_milter_addr_mod(session->sock, SMFIR_CHGFROM, env->sender) != 0)
+            return -1;
+    }
+
+    if (milter_actions & SMFIF_DELRCPT) {
+        for (elem = smf_list_head(initial); elem != NULL; elem = elem->next) {
+            rcpt = (char *)smf_list_data(elem);
+            if (!smf_milter_find_rcpt(env->recipients, rcpt) &&
+                    (smf_milter_addr_mod(session->sock, SMFIR_DELRCPT, rcpt) != 0))
+                return -1;
+        }
+    }
+
+    if ((milter_actions & SMFIF_ADDRCPT) && (env->recipients != NULL)) {
+        for (elem = smf_list_head(env->recipients); elem != NULL; elem = elem->next) {
+            rcpt = (char *)smf_list_data(elem);
+            if (!smf_milter_find_rcpt(initial, rcpt) &&
+                    (smf_milter_addr_mod(session->sock, SMFIR_ADDRCPT, rcpt) != 0))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void smf_milter_header_destroy(void *data) {
+    smf_header_free((SMFHeader_T *)data);
+}
+
+/* copy the headers and recipients the MTA knows about, to find the 
+ * changes of the modules afterwards */
+static void smf_milter_snapshot(SMFSession_T *session, SMFList_T **headers, SMFList_T **rcpts) {
+    SMFMessage_T *msg = smf_envelope_get_message(session->envelope);
+    SMFListElem_T *elem = NULL;
+    SMFHeader_T *o = NULL;
+    SMFHeader_T *n = NULL;
+    int i;
+
+    smf_list_new(headers, smf_milter_header_destroy);
+    for (elem = smf_list_head(msg->headers); elem != NULL; elem = elem->next) {
+        o = (SMFHeader_T *)smf_list_data(elem);
+        n = smf_header_new();
+        smf_header_set_name(n, smf_header_get_name(o));
+        for (i = 0; i < smf_header_get_count(o); i++)
+            smf_header_set_value(n, smf_header_get_value(o, i), 0);
+        smf_list_append(*headers, n);
+    }
+
+    smf_list_new(rcpts, smf_internal_string_list_destroy);
+    if (session->envelope->recipients != NULL) {
+        for (elem = smf_list_head(session->envelope->recipients); elem != NULL; elem = elem->next)
+            smf_list_append(*rcpts, strdup((char *)smf_list_data(elem)));
+    }
+}
+
+/* the message is complete: run the modules and send the modifications
+ * and the final response to the MTA */
+static int smf_milter_process_message(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q) {
+    SMFMessage_T *message = smf_message_new();
+    SMFSessionSpan_T *span = NULL;
+    SMFList_T *headers = NULL;
+    SMFList_T *rcpts = NULL;
+    char *sender = NULL;
+    int ret;
+
+    free(milter_reply);
+    milter_reply = NULL;
+    milter_verdict = SMFIR_ACCEPT;
+
+    /* a message without headers and body */
+    smf_milter_spool_write(settings, session, NULL, 0);
+
+    if (!spool_error && ((fflush(spool_file) != 0) || 
+            (smf_core_spool_link(fileno(spool_file), spool_dir, session->id, &session->message_file) != 0))) {
+        STRACE(TRACE_ERR,session->id,"failed to link spool file: %s (%d)",strerror(errno),errno);
+        spool_error = 1;
+    }
+
+    if (!spool_error) {
+        span = smf_session_span_begin(session, "sync");
+        if (smf_server_spool_sync(settings, fileno(spool_file), session->message_file) != 0) {
+            STRACE(TRACE_ERR,session->id,"failed to sync spool file: %s (%d)",strerror(errno),errno);
+            spool_error = 1;
+        }
+        smf_session_span_end(span);
+    }
+
+    if (!spool_error) {
+        span = smf_session_span_begin(session, "parse");
+        if (smf_message_from_file(&message, session->message_file, 1) != 0) {
+            STRACE(TRACE_ERR,session->id,"smf_message_from_file() failed");
+            spool_error = 1;
+        }
+        smf_session_span_end(span);
+    }
+
+    if (spool_error) {
+        smf_message_free(message);
+        smf_milter_set_reply(settings, 451, NULL);
+        return smf_milter_reply(session->sock);
+    }
+
+    session->envelope->message = message;
+    STRACE(TRACE_INFO,session->id,"processing message, size %zu",session->message_size);
+
+    smf_milter_snapshot(session, &headers, &rcpts);
+    if (session->envelope->sender != NULL)
+        sender = strdup(session->envelope->sender);
+
+    ret = smf_modules_process(q, session, settings);
+
+    if ((ret == -1) && (milter_verdict == SMFIR_ACCEPT)) {
+        STRACE(TRACE_DEBUG,session->id,"milter engine failed!");
+        smf_milter_set_reply(settings, 451, NULL);
+    }
+
+    ret = 0;
+    if (milter_verdict == SMFIR_ACCEPT) {
+        if ((milter_actions & (SMFIF_ADDHDRS | SMFIF_CHGHDRS)) == (SMFIF_ADDHDRS | SMFIF_CHGHDRS))
+            ret = smf_milter_send_headers(session, headers, smf_envelope_get_message(session->envelope));
+        if (ret == 0)
+            ret = smf_milter_send_envelope(session, sender, rcpts);
+    }
+
+    if (ret == 0)
+        ret = smf_milter_reply(session->sock);
+
+    smf_list_free(headers);
+    smf_list_free(rcpts);
+    free(sender);
+
+    return ret;
+}
+
+void smf_milter_handle_client(SMFSettings_T *settings, int client, SMFProcessQueue_T *q) {
+    SMFSession_T *session = NULL;
+    SMFSessionSpan_T *span = NULL;
+    struct tms start_acct;
+    struct sigaction action;
+    char cmd;
+    char *data = NULL;
+    char *p = NULL;
+    char *line = NULL;
+    size_t len;
+    int quit = 0;
+    int rc, ret;
+
+    start_acct = smf_internal_init_runtime_stats();
+    session = smf_milter_session_new(settings, client, NULL);
+    milter_envelope_hooks = smf_modules_envelope_hooks(settings);
+    milter_data_hooks = smf_modules_data_hooks(settings);
+
+    /* set timeout */
+    action.sa_handler = smf_milter_sig_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+
+    if (sigaction(SIGALRM, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGALRM) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (sigaction(SIGTERM, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGTERM) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    alarm(settings->smtpd_timeout);
+
+    while (!quit && (smf_milter_read_packet(client, &cmd, &data, &len) == 0)) {
+        alarm(settings->smtpd_timeout);
+        rc = 0;
+
+        switch (cmd) {
+            case SMFIC_OPTNEG:
+                rc = smf_milter_optneg(client, data, len);
+                break;
+            case SMFIC_CONNECT:
+                /* hostname, family, port and address */
+                p = data + strlen(data) + 1;
+                if ((p + 3 < data + len) && ((*p == '4') || (*p == '6'))) {
+                    smf_session_set_xforward_addr(session, p + 3);
+                    STRACE(TRACE_DEBUG,session->id,"client address: [%s]",session->xforward_addr);
+                }
+                rc = smf_milter_continue(client, SMFIP_NR_CONN);
+                break;
+            case SMFIC_HELO:
+                smf_session_set_helo(session, data);
+                rc = smf_milter_continue(client, SMFIP_NR_HELO);
+                break;
+            case SMFIC_MAIL:
+                /* the first argument is the address, ESMTP parameters follow */
+                span = smf_session_span_begin(session, "mail");
+                smf_envelope_set_sender(session->envelope, data);
+                STRACE(TRACE_DEBUG,session->id,"session->envelope->sender: [%s]",session->envelope->sender);
+                if ((ret = smf_milter_hook_code(settings, smf_modules_process_mail(settings, session))) != 0) {
+                    smf_milter_hook_reply(settings, session, ret);
+                    rc = smf_milter_reply(client);
+                } else
+                    rc = smf_milter_continue(client, SMFIP_NR_MAIL);
+                smf_session_span_end(span);
+                break;
+            case SMFIC_RCPT:
+                /* refused recipients never make it into the envelope */
+                span = smf_session_span_begin(session, "rcpt");
+                p = smf_internal_strip_email_addr(data);
+                if ((ret = smf_milter_hook_code(settings, smf_modules_process_rcpt(settings, session, p))) != 0) {
+                    smf_milter_hook_reply(settings, session, ret);
+                    rc = smf_milter_reply(client);
+                } else {
+                    smf_envelope_add_rcpt(session->envelope, data);
+                    STRACE(TRACE_DEBUG,session->id,"adding recipient: [%s]",data);
+                    rc = smf_milter_continue(client, SMFIP_NR_RCPT);
+                }
+                free(p);
+                smf_session_span_end(span);
+                break;
+            case SMFIC_DATA:
+                rc = smf_milter_continue(client, SMFIP_NR_DATA);
+                break;
+            case SMFIC_HEADER:
+                /* name and value, stored with CRLF like SMTP data */
+                p = data + strlen(data) + 1;
+                if (p > data + len)
+                    p = data + len;
+                if (asprintf(&line, "%s: %s\r\n", data, p) == -1) {
+                    rc = -1;
+                    break;
+                }
+                rc = smf_milter_data_step(settings, session, line, strlen(line), SMFIP_NR_HDR);
+                free(line);
+                line = NULL;
+                break;
+            case SMFIC_EOH:
+                rc = smf_milter_data_step(settings, session, "\r\n", 2, SMFIP_NR_EOH);
+                break;
+            case SMFIC_BODY:
+                rc = smf_milter_data_step(settings, session, data, len, SMFIP_NR_BODY);
+                break;
+            case SMFIC_BODYEOB:
+                /* the last chunk, if any, and the end of the message */
+                if (!milter_refused && ((len == 0) || (smf_milter_data(settings, session, data, len) == 0)))
+                    smf_milter_data(settings, session, NULL, 0);
+
+                if (milter_refused)
+                    rc = smf_milter_reply(client);
+                else
+                    rc = smf_milter_process_message(session, settings, q);
+                session = smf_milter_session_reset(settings, session, 1);
+                break;
+            case SMFIC_ABORT:
+                STRACE(TRACE_DEBUG,session->id,"message aborted");
+                session = smf_milter_session_reset(settings, session, 1);
+                break;
+            case SMFIC_QUIT_NC:
+                /* the connection is reused for the next client */
+                session = smf_milter_session_reset(settings, session, 0);
+                break;
+            case SMFIC_QUIT:
+                quit = 1;
+                break;
+            case SMFIC_MACRO:
+                break;
+            case SMFIC_UNKNOWN:
+                rc = smf_milter_continue(client, SMFIP_NR_UNKN);
+                break;
+            default:
+                STRACE(TRACE_ERR,session->id,"unknown milter command [%c]",cmd);
+                rc = -1;
+                break;
+        }
+
+        free(data);
+        data = NULL;
+        if (rc != 0)
+            break;
+    }
+
+    smf_milter_spool_discard(session);
+    free(milter_reply);
+    smf_internal_print_runtime_stats(start_acct,session->id);
+
+    if (settings->timing_log != NULL)
+        smf_session_timing_write(session, settings->timing_log);
+    smf_session_free(session);
+
+    smf_settings_free(settings);
+    exit(0);
+}
+
+int load(SMFSettings_T *settings) {
+    int *sds = NULL;
+    int num_sds;
+    SMFProcessQueue_T *q;
+
+    TRACE(TRACE_INFO,"starting milter engine");
+
+    /* the MTA keeps the message, modifications are sent back to it */
+    if (settings->nexthop != NULL) {
+        TRACE(TRACE_WARNING,"nexthop is ignored by the milter engine");
+        free(settings->nexthop);
+        settings->nexthop = NULL;
+    }
+
+    /* initialize the modules queue handler */
+    q = smf_modules_pqueue_init(
+        smf_milter_handle_q_error,
+        smf_milter_handle_q_processing_error,
+        smf_milter_handle_nexthop_error
+    );
+
+    if(q == NULL) {
+        TRACE(TRACE_ERR,"failed to initialize module queue");
+        return(-1);
+    }
+
+    if ((num_sds = smf_server_listen(settings,&sds)) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    smf_server_init(settings);
+    smf_server_loop(settings,sds,num_sds,q,smf_milter_handle_client);
+
+    free(sds);
+    free(q);
+    
+    return 0;
+}
@@ -0,0 +1,88 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SMF_MILTER_H
+#define _SMF_MILTER_H
+
+#include "smf_settings.h"
+#include "smf_session.h"
+#include "smf_modules.h"
+
+/* milter protocol version, see libmilter/mfdef.h */
+#define SMFI_VERSION 6
+
+/* largest packet accepted from the MTA, body chunks are up to 64k */
+#define MILTER_MAX_PACKET (1024 * 1024)
+
+/* commands sent by the MTA */
+#define SMFIC_ABORT 'A'
+#define SMFIC_BODY 'B'
+#define SMFIC_CONNECT 'C'
+#define SMFIC_MACRO 'D'
+#define SMFIC_BODYEOB 'E'
+#define SMFIC_HELO 'H'
+#define SMFIC_QUIT_NC 'K'
+#define SMFIC_HEADER 'L'
+#define SMFIC_MAIL 'M'
+#define SMFIC_EOH 'N'
+#define SMFIC_OPTNEG 'O'
+#define SMFIC_QUIT 'Q'
+#define SMFIC_RCPT 'R'
+#define SMFIC_DATA 'T'
+#define SMFIC_UNKNOWN 'U'
+
+/* responses and modifications sent to the MTA */
+#define SMFIR_ADDRCPT '+'
+#define SMFIR_DELRCPT '-'
+#define SMFIR_ACCEPT 'a'
+#define SMFIR_CONTINUE 'c'
+#define SMFIR_DISCARD 'd'
+#define SMFIR_CHGFROM 'e'
+#define SMFIR_ADDHEADER 'h'
+#define SMFIR_CHGHEADER 'm'
+#define SMFIR_REJECT 'r'
+#define SMFIR_TEMPFAIL 't'
+#define SMFIR_REPLYCODE 'y'
+
+/* actions the filter may perform */
+#define SMFIF_ADDHDRS 0x01
+#define SMFIF_ADDRCPT 0x04
+#define SMFIF_DELRCPT 0x08
+#define SMFIF_CHGHDRS 0x10
+#define SMFIF_CHGFROM 0x40
+
+/* protocol steps the MTA doesn't wait a reply for */
+#define SMFIP_NR_HDR 0x80
+#define SMFIP_NOUNKNOWN 0x100
+#define SMFIP_NR_CONN 0x1000
+#define SMFIP_NR_HELO 0x2000
+#define SMFIP_NR_MAIL 0x4000
+#define SMFIP_NR_RCPT 0x8000
+#define SMFIP_NR_DATA 0x10000
+#define SMFIP_NR_UNKN 0x20000
+#define SMFIP_NR_EOH 0x40000
+#define SMFIP_NR_BODY 0x80000
+
+#define MILTER_ACTIONS (SMFIF_ADDHDRS | SMFIF_CHGHDRS | SMFIF_ADDRCPT | SMFIF_DELRCPT | SMFIF_CHGFROM)
+#define MILTER_NO_REPLY (SMFIP_NR_CONN | SMFIP_NR_HELO | SMFIP_NR_MAIL | SMFIP_NR_RCPT | \
+    SMFIP_NR_DATA | SMFIP_NR_UNKN | SMFIP_NR_EOH | SMFIP_NR_HDR | SMFIP_NR_BODY | SMFIP_NOUNKNOWN)
+
+#define MILTER_REPLY_TEXT "Requested action aborted: local error in processing"
+
+void smf_milter_handle_client(SMFSettings_T *settings, int client, SMFProcessQueue_T *q);
+
+#endif  /* _SMF_MILTER_H */
@@ -19,13 +19,19 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <dlfcn.h>
+#include <poll.h>
+#include <time.h>
+#include <libgen.h>
 
 #include "smf_modules.h"
 #include "smf_header.h"
@@ -130,53 +136,341 @@ SMFProcessQueue_T *smf_modules_pqueue_init(
     return q;
 }
 
-/* build full filename to modules states dir */
-static char *smf_modules_stf_path(SMFSettings_T *settings, SMFSession_T *session) {
-    char *hex = NULL;
-    char *mid = NULL;
-    char *buf = NULL;
+/* Modules, which have already processed a message, only need to be
+ * remembered, if the processing of the message has been halted and may be
+ * resumed. They are kept in memory and in an append-only journal of the
+ * process, queue_dir/journal.<pid>.<n>, with one line "<key> ;mod1;mod2;" per
+ * halted message and "<key> -" once it's done. The last line of a message
+ * wins. With queue_recovery every message gets a journal entry, the
+ * envelope "<key> +<spool file>\t<sender>\t<rcpt>..." when processing
+ * starts and its modules as they finish, so the queue runner can complete
+ * the messages of a process, which died, and counts its attempts with 
+ * "<key> #<n>". A process holds a lock on its journal as long as it lives. */
+static SMFDict_T *journal_state = NULL;
+static char *journal_path = NULL;
+static int journal_fd = -1;
+static pid_t journal_pid = 0;
+static int journal_atexit = 0;
+
+/* key of a message in the journal */
+static char *smf_modules_journal_key(SMFSession_T *session) {
     SMFMessage_T *msg = NULL;
-    msg = smf_envelope_get_message(session->envelope);
+    char *hex = NULL;
+    char *key = NULL;
 
-    mid = smf_message_get_message_id(msg);
-    hex = smf_core_md5sum(mid);
-    asprintf(&buf,"%s/%s.%s.modules", settings->queue_dir, session->id, hex);
+    msg = smf_envelope_get_message(session->envelope);
+    hex = smf_core_md5sum(smf_message_get_message_id(msg));
+    asprintf(&key, "%s.%s", session->id, hex);
     free(hex);
 
-    return(buf);
+    return key;
+}
+
+/* a forked process starts with an empty state and a journal of its own */
+static void smf_modules_journal_init(void) {
+    if (journal_pid == getpid())
+        return;
+
+    if (journal_fd != -1)
+        close(journal_fd);
+    journal_fd = -1;
+    free(journal_path);
+    journal_path = NULL;
+
+    if (journal_state != NULL)
+        smf_dict_free(journal_state);
+    journal_state = smf_dict_new();
+    journal_pid = getpid();
+}
+
+/* remove the journal of this process at exit, if there's no halted 
+ * message left */
+static void smf_modules_journal_cleanup(void) {
+    if ((journal_pid != getpid()) || (journal_fd == -1))
+        return;
+
+    /* the lock is released with the descriptor, so the journal has to 
+     * be gone first */
+    if ((journal_state->n == 0) && (unlink(journal_path) != 0))
+        TRACE(TRACE_ERR, "failed to unlink module journal [%s]: %s (%d)", journal_path, strerror(errno), errno);
+
+    close(journal_fd);
+    journal_fd = -1;
+}
+
+/* create a new journal under a temporary name, which the queue runner 
+ * ignores, returns the descriptor or -1 */
+static int smf_modules_journal_create(SMFSettings_T *settings, char **tmp) {
+    int fd;
+
+    asprintf(tmp, "%s/.journal.%d", settings->queue_dir, (int)getpid());
+    if ((fd = open(*tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600)) == -1) {
+        TRACE(TRACE_ERR, "failed to open module journal [%s]: %s (%d)", *tmp, strerror(errno), errno);
+        free(*tmp);
+        *tmp = NULL;
+    }
+
+    return fd;
+}
+
+/* link a journal from smf_modules_journal_create() to a name of its own, 
+ * journal.<pid>.<n>, and return it. The journal of a process, which died, 
+ * is never taken over, even if its pid is reused */
+static char *smf_modules_journal_publish(SMFSettings_T *settings, char *tmp) {
+    char *path = NULL;
+    long n;
+    int ret;
+
+    n = (long)time(NULL);
+    do {
+        free(path);
+        asprintf(&path, "%s/journal.%d.%ld", settings->queue_dir, (int)getpid(), n++);
+    } while (((ret = link(tmp, path)) == -1) && (errno == EEXIST));
+
+    if (ret == -1) {
+        TRACE(TRACE_ERR, "failed to link module journal [%s]: %s (%d)", path, strerror(errno), errno);
+        free(path);
+        path = NULL;
+    }
+
+    unlink(tmp);
+    free(tmp);
+
+    return path;
+}
+
+/* append a line to the journal of this process */
+static void smf_modules_journal_put(SMFSettings_T *settings, SMFSession_T *session, 
+        const char *key, const char *value) {
+    char *line = NULL;
+    char *tmp = NULL;
+    int len;
+
+    if (journal_fd == -1) {
+        if ((journal_fd = smf_modules_journal_create(settings, &tmp)) == -1)
+            return;
+
+        /* the journal is locked, before the queue runner can see it */
+        if (flock(journal_fd, LOCK_EX) != 0) {
+            STRACE(TRACE_ERR, session->id, "failed to lock module journal [%s]: %s (%d)", tmp, strerror(errno), errno);
+            unlink(tmp);
+            free(tmp);
+            close(journal_fd);
+            journal_fd = -1;
+            return;
+        }
+
+        if ((journal_path = smf_modules_journal_publish(settings, tmp)) == NULL) {
+            close(journal_fd);
+            journal_fd = -1;
+            return;
+        }
+
+        /* registrations are inherited by forked processes */
+        if (!journal_atexit && (atexit(smf_modules_journal_cleanup) == 0))
+            journal_atexit = 1;
+    }
+
+    if ((len = asprintf(&line, "%s %s\n", key, value)) == -1)
+        return;
+
+    if (write(journal_fd, line, len) != len)
+        STRACE(TRACE_ERR, session->id, "failed to write module journal [%s]: %s (%d)", journal_path, strerror(errno), errno);
+
+    free(line);
 }
 
-/* load the list of processed modules from file */
-static SMFDict_T *smf_modules_stf_processed_modules(FILE *fh) {
-    SMFDict_T *d;
+/* remember the processed modules of a message or forget them, if modules 
+ * is "-" */
+static void smf_modules_journal_write(SMFSettings_T *settings, SMFSession_T *session, 
+        const char *key, const char *modules) {
+    if (strcmp(modules, "-") == 0)
+        smf_dict_remove(journal_state, key);
+    else
+        smf_dict_set(journal_state, key, modules);
+
+    smf_modules_journal_put(settings, session, key, modules);
+}
+
+/* record spool file and envelope of a message for the queue runner */
+static void smf_modules_journal_envelope(SMFSettings_T *settings, SMFSession_T *session, const char *key) {
+    SMFListElem_T *elem = NULL;
+    char *value = NULL;
+
+    asprintf(&value, "+%s\t%s", session->message_file, 
+        (session->envelope->sender != NULL) ? session->envelope->sender : "");
+
+    elem = smf_list_head(session->envelope->recipients);
+    while (elem != NULL) {
+        smf_core_strcat_printf(&value, "\t%s", (char *)smf_list_data(elem));
+        elem = elem->next;
+    }
+
+    smf_modules_journal_put(settings, session, key, value);
+    free(value);
+}
+
+/* a halted or recorded message has been processed completely or stopped,
+ * frees key */
+static void smf_modules_journal_forget(SMFSettings_T *settings, SMFSession_T *session, char *key) {
+    if (key == NULL)
+        return;
+
+    if (settings->queue_recovery || (smf_dict_get(journal_state, key) != NULL))
+        smf_modules_journal_write(settings, session, key, "-");
+
+    free(key);
+}
+
+static void smf_modules_journal_append(char *key, char *value, void *args) {
+    smf_core_strcat_printf((char **)args, "%s;", key);
+}
+
+/* remember the modules, which have processed a message so far */
+static void smf_modules_journal_progress(SMFSettings_T *settings, SMFSession_T *session, 
+        const char *key, SMFDict_T *modlist) {
+    char *done = strdup(";");
+
+    smf_dict_map(modlist, smf_modules_journal_append, &done);
+    smf_modules_journal_write(settings, session, key, done);
+    free(done);
+}
+
+/* read the next line of a journal, returns the key and sets value or
+ * returns NULL at the end of the journal */
+static char *smf_modules_journal_next(FILE *fh, char **buf, size_t *n, char **value) {
+    ssize_t len;
+    char *p;
+
+    while ((len = getline(buf, n, fh)) > 0) {
+        if ((*buf)[len - 1] == '\n')
+            (*buf)[len - 1] = '\0';
+        if ((p = strchr(*buf, ' ')) == NULL)
+            continue;
+        *p++ = '\0';
+        *value = p;
+        return *buf;
+    }
+
+    return NULL;
+}
+
+int smf_modules_journal_read(const char *path, SMFDict_T *modules, SMFDict_T *envelopes, 
+        SMFDict_T *finished, SMFDict_T *attempts) {
+    FILE *fh;
     char *buf = NULL;
-    size_t n;
-    char **parts = NULL;
-    int nparts;
+    char *key, *value, *prev;
+    size_t n = 0;
+    int recorded = 0;
 
-    d = smf_dict_new();
-    fseek(fh, 0, SEEK_SET); /* rewind the file */
+    if ((fh = fopen(path, "r")) == NULL) {
+        TRACE(TRACE_ERR, "failed to open module journal [%s]: %s (%d)", path, strerror(errno), errno);
+        return -1;
+    }
 
-    while(getline(&buf,&n,fh) >= 0) {
-        parts = smf_core_strsplit(buf, ":", &nparts);
-        assert(nparts == 2);
-        smf_dict_set(d, parts[0], parts[1]);
+    while ((key = smf_modules_journal_next(fh, &buf, &n, &value)) != NULL) {
+        if (strcmp(value, "-") == 0) {
+            smf_dict_remove(modules, key);
+            smf_dict_remove(envelopes, key);
+            smf_dict_set(finished, key, value);
+        } else if (*value == '+') {
+            /* a message, which is done, stays done, even if an older 
+             * record of it is read later */
+            smf_dict_set(envelopes, key, value + 1);
+            recorded++;
+        } else if (*value == '#') {
+            /* the highest number of attempts wins */
+            if ((attempts != NULL) && (((prev = smf_dict_get(attempts, key)) == NULL) ||
+                    (atoi(prev) < atoi(value + 1))))
+                smf_dict_set(attempts, key, value + 1);
+            recorded++;
+        } else
+            smf_dict_set(modules, key, value);
     }
 
     free(buf);
-    if (parts != NULL) {
-        free(parts[0]);
-        free(parts[1]);
-        free(parts[2]);
-        free(parts);
+    fclose(fh);
+
+    return recorded;
+}
+
+int smf_modules_journal_carry(SMFSettings_T *settings, SMFDict_T *modules, SMFDict_T *envelopes, 
+        SMFDict_T *attempts) {
+    SMFList_T *keys = NULL;
+    SMFListElem_T *elem = NULL;
+    FILE *fh;
+    char *tmp = NULL;
+    char *path = NULL;
+    char *key, *value;
+    int fd;
+    int ret = 0;
+
+    if ((envelopes->n == 0) && ((attempts == NULL) || (attempts->n == 0)))
+        return 0;
+
+    if ((fd = smf_modules_journal_create(settings, &tmp)) == -1)
+        return -1;
+
+    if (((fh = fdopen(fd, "a")) == NULL) || ((keys = smf_dict_get_keys(envelopes)) == NULL)) {
+        TRACE(TRACE_ERR, "failed to write module journal [%s]", tmp);
+        if (fh != NULL)
+            fclose(fh);
+        else
+            close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
     }
-    return d;
+
+    elem = smf_list_head(keys);
+    while (elem != NULL) {
+        key = (char *)smf_list_data(elem);
+        fprintf(fh, "%s +%s\n", key, smf_dict_get(envelopes, key));
+        if ((value = smf_dict_get(modules, key)) != NULL)
+            fprintf(fh, "%s %s\n", key, value);
+        elem = elem->next;
+    }
+    smf_list_free(keys);
+
+    /* messages, which have been halted again, are recorded in the journal
+     * of their worker, only the number of attempts is kept here */
+    if ((attempts != NULL) && ((keys = smf_dict_get_keys(attempts)) != NULL)) {
+        elem = smf_list_head(keys);
+        while (elem != NULL) {
+            key = (char *)smf_list_data(elem);
+            fprintf(fh, "%s #%s\n", key, smf_dict_get(attempts, key));
+            elem = elem->next;
+        }
+        smf_list_free(keys);
+    }
+
+    /* the records have to be on disk, before the caller removes the 
+     * journals they came from */
+    if ((fflush(fh) != 0) || (fsync(fd) != 0))
+        ret = -1;
+    if ((fclose(fh) != 0) || (ret != 0)) {
+        TRACE(TRACE_ERR, "failed to write module journal [%s]: %s (%d)", tmp, strerror(errno), errno);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    if ((path = smf_modules_journal_publish(settings, tmp)) == NULL)
+        return -1;
+
+    TRACE(TRACE_INFO, "carried %d messages over to module journal [%s]", envelopes->n, path);
+    free(path);
+
+    return 0;
 }
 
-/* write an entry to the state file */
-static int smf_modules_stf_write_entry(FILE *fh, char *mod) {
-    fprintf(fh, "%s:ok\n", mod);
-    return(0);
+void smf_modules_journal_restore(SMFSession_T *session, const char *modules) {
+    char *key = NULL;
+
+    smf_modules_journal_init();
+    key = smf_modules_journal_key(session);
+    smf_dict_set(journal_state, key, modules);
+    free(key);
 }
 
 SMFModule_T *smf_module_create(const char *name) {
@@ -208,6 +502,7 @@ static void *smf_module_create_handle(const char *name) {
 
 SMFModule_T *smf_module_create_callback(const char *name, ModuleLoadFunction callback) {
     SMFModule_T *module;
+    unsigned int *flags;
 
     assert(name);
 
@@ -216,10 +511,15 @@ SMFModule_T *smf_module_create_callback(const char *name, ModuleLoadFunction cal
     }
     
     module->name = strdup(name);
+    module->flags = 0;
+    module->timeouts = 0;
 
     if (callback == NULL) {
         module->type = 0;
         module->u.handle = smf_module_create_handle(name);
+        if ((module->u.handle != NULL) && 
+                ((flags = dlsym(module->u.handle, "module_flags")) != NULL))
+            module->flags = *flags;
     } else {
         module->type = 1;
         module->u.callback = callback;
@@ -248,34 +548,494 @@ int smf_module_destroy(SMFModule_T *module) {
     return result;
 }
 
-int smf_module_invoke(SMFSettings_T *settings, SMFModule_T *module, SMFSession_T *session) {
+/* look up an optional symbol of a module like the envelope hooks, modules 
+ * created with a callback don't have any */
+static void *smf_module_hook(SMFModule_T *module, const char *hook) {
+    if ((module->type != 0) || (module->u.handle == NULL))
+        return NULL;
+
+    dlerror(); // Clear any errors
+    return dlsym(module->u.handle, hook);
+}
+
+/* a module, which returns SMF_MODULE_PENDING, must tell what to wait for */
+static int smf_module_check_wait(SMFSession_T *session, SMFModule_T *module, SMFModuleWait_T *wait, int ret) {
+    if ((ret == SMF_MODULE_PENDING) && ((wait->fd < 0) || (wait->resume == NULL))) {
+        STRACE(TRACE_ERR, session->id, "module [%s] is pending without descriptor or continuation", module->name);
+        return -1;
+    }
+
+    return ret;
+}
+
+/* locate the load function of a module */
+static ModuleLoadFunction smf_module_runner(SMFModule_T *module) {
     ModuleLoadFunction runner;
-    time_t mtime_before, mtime_after;
-    int result;
-    
-    assert(module);
-    assert(session);
-    
+
     if (module->type == 0) {
         dlerror(); // Clear any errors
         if ((runner = dlsym(module->u.handle, "load")) == NULL) {
             TRACE(TRACE_ERR, "failed to locate 'load'-symbol in module '%s': %s",
                   module->name, dlerror());
-              return -1;
-          }
+            return NULL;
+        }
     } else {
         runner = module->u.callback;
     }
+
+    return runner;
+}
+
+/* a module invocation, which is watched for its deadline. Asynchronous
+ * modules are polled by the calling process. Synchronous modules, which 
+ * run in parallel or have a deadline, are forked off to a worker process,
+ * which reports its result through a pipe and is killed, if it exceeds 
+ * its deadline. Other synchronous modules are called directly. A parallel
+ * job collects the response in copy, the jobs of this process don't run 
+ * concurrently. */
+typedef struct {
+    SMFSettings_T *settings;
+    SMFModule_T *module;
+    SMFSession_T *session;
+    SMFSession_T copy;
+    ModuleLoadFunction runner;
+    SMFModuleWait_T wait;
+    SMFSessionSpan_T *span;
+    int timeout; /* seconds, 0 if unlimited */
+    struct timespec deadline;
+    pid_t pid; /* worker process, 0 if none */
+    char *report; /* output of the worker */
+    size_t report_len;
+    int async;
+    int done;
+    int flushed; /* the worker has written the message to the spool file */
+    int ret;
+} SMFModuleJob_T;
+
+/* time budget of a module in seconds, [<module>]timeout overrides 
+ * module_timeout */
+static int smf_module_timeout(SMFSettings_T *settings, SMFModule_T *module) {
+    if (smf_settings_group_get(settings, module->name, "timeout") != NULL)
+        return smf_settings_group_get_integer(settings, module->name, "timeout");
+
+    return settings->module_timeout;
+}
+
+/* milliseconds left until the deadline of a job, -1 if there is none */
+static int smf_module_job_remaining(SMFModuleJob_T *job) {
+    struct timespec now;
+    long ms;
+
+    if (job->timeout <= 0)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (job->deadline.tv_sec - now.tv_sec) * 1000 + (job->deadline.tv_nsec - now.tv_nsec) / 1000000;
+
+    return (ms > 0) ? (int)ms : 0;
+}
+
+/* a module has exceeded its deadline, returns 1 if it has to be abandoned 
+ * or 0, if module_timeout_action tells to keep waiting */
+static int smf_module_timed_out(SMFModuleJob_T *job) {
+    job->module->timeouts++;
+    STRACE(TRACE_WARNING, job->session->id, "module [%s] exceeded its deadline of %d seconds (%u timeouts)",
+        job->module->name, job->timeout, job->module->timeouts);
+
+    /* the deadline is only reported once */
+    job->timeout = 0;
+
+    return (job->settings->module_timeout_action != SMF_MODULE_TIMEOUT_CONTINUE);
+}
+
+/* result of an abandoned module */
+static int smf_module_abandoned(SMFModuleJob_T *job) {
+    if (job->settings->module_timeout_action == SMF_MODULE_TIMEOUT_SKIP) {
+        STRACE(TRACE_WARNING, job->session->id, "skipping module [%s]", job->module->name);
+        return 0;
+    }
+
+    return 451;
+}
+
+/* append a NUL terminated field to the report of a worker, a string, which
+ * may be NULL, is reported as "+<string>" or "-" */
+static void smf_module_report_add(char **report, size_t *len, const char *prefix, const char *value) {
+    size_t n;
+
+    if (value == NULL) {
+        prefix = "-";
+        value = "";
+    }
+
+    n = strlen(prefix) + strlen(value) + 1;
+    if ((*report = realloc(*report, *len + n)) == NULL)
+        _exit(EXIT_FAILURE);
+
+    sprintf(*report + *len, "%s%s", prefix, value);
+    *len += n;
+}
+
+/* body of a worker process. The report consists of the return code of the
+ * module and its response, if it has set one. For a module, which may 
+ * modify the message, changed headers are written to the spool file and 
+ * the worker reports whether the spool file has changed and the envelope:
+ * sender, auth user, auth password, nexthop and the recipients. */
+static void smf_module_worker(SMFModuleJob_T *job, int fd) {
+    SMFEnvelope_T *envelope = job->session->envelope;
+    SMFMessage_T *msg = NULL;
+    SMFList_T *initial_headers = NULL;
+    SMFListElem_T *elem = NULL;
+    char *report = NULL;
+    char *response;
+    char num[16];
+    struct stat before, after;
+    size_t len = 0;
+    size_t off = 0;
+    ssize_t n;
+    int writable;
+    int flushed = 0;
+
+    /* the connection of the caller must not be used by two processes, the
+     * worker connects on its own, if the module needs a lookup */
+    job->settings->lookup_connection = NULL;
+
+    writable = !(job->module->flags & SMF_MODULE_READONLY) && (job->session->message_file != NULL) &&
+        ((msg = smf_envelope_get_message(envelope)) != NULL);
+    if (writable && (stat(job->session->message_file, &before) == 0) && 
+            (smf_list_new(&initial_headers, _header_destroy) == 0)) {
+        elem = smf_list_head(msg->headers);
+        while (elem != NULL) {
+            smf_list_append(initial_headers, _copy_header(elem));
+            elem = elem->next;
+        }
+    }
+
+    response = job->session->response_msg;
+    snprintf(num, sizeof(num), "%d", job->runner(job->settings, job->session));
+    smf_module_report_add(&report, &len, "", num);
+    smf_module_report_add(&report, &len, "+", 
+        (job->session->response_msg != response) ? job->session->response_msg : NULL);
+
+    if (!(job->module->flags & SMF_MODULE_READONLY)) {
+        /* the caller has to reload the message, if the spool file has been
+         * replaced or modified, by the module or by the changed headers */
+        if (initial_headers != NULL) {
+            if ((smf_envelope_get_message(envelope) == msg) &&
+                    (smf_modules_flush_dirty(job->settings, job->session, initial_headers) != 0))
+                _exit(EXIT_FAILURE);
+            flushed = (stat(job->session->message_file, &after) != 0) || (after.st_ino != before.st_ino) ||
+                (after.st_mtim.tv_sec != before.st_mtim.tv_sec) || (after.st_mtim.tv_nsec != before.st_mtim.tv_nsec);
+        }
+        smf_module_report_add(&report, &len, "", flushed ? "1" : "0");
+        smf_module_report_add(&report, &len, "+", envelope->sender);
+        smf_module_report_add(&report, &len, "+", envelope->auth_user);
+        smf_module_report_add(&report, &len, "+", envelope->auth_pass);
+        smf_module_report_add(&report, &len, "+", envelope->nexthop);
+
+        elem = smf_list_head(envelope->recipients);
+        while (elem != NULL) {
+            smf_module_report_add(&report, &len, "+", (char *)smf_list_data(elem));
+            elem = elem->next;
+        }
+    }
+
+    while (off < len) {
+        if ((n = write(fd, report + off, len - off)) == -1) {
+            if (errno == EINTR)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
+        off += n;
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+/* fork a worker process for a synchronous module, returns -1 if it can't
+ * be started. The pipe isn't inherited by programs, which the module 
+ * executes, so the end of the report is seen as soon as the worker exits */
+static int smf_module_job_fork(SMFModuleJob_T *job) {
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        STRACE(TRACE_WARNING, job->session->id, "failed to create pipe for module [%s]: %s (%d)",
+            job->module->name, strerror(errno), errno);
+        return -1;
+    }
+
+    switch (job->pid = fork()) {
+        case -1:
+            STRACE(TRACE_WARNING, job->session->id, "failed to fork worker for module [%s]: %s (%d)",
+                job->module->name, strerror(errno), errno);
+            close(fds[0]);
+            close(fds[1]);
+            job->pid = 0;
+            return -1;
+        case 0:
+            close(fds[0]);
+            smf_module_worker(job, fds[1]); /* doesn't return */
+        default:
+            close(fds[1]);
+            job->wait.fd = fds[0];
+            job->wait.events = POLLIN;
+            return 0;
+    }
+}
+
+/* replace a string of the envelope with a reported one */
+static void smf_module_job_string(char **s, const char *field) {
+    free(*s);
+    *s = (*field == '+') ? strdup(field + 1) : NULL;
+}
+
+/* take over the report of a worker */
+static void smf_module_job_report(SMFModuleJob_T *job) {
+    SMFEnvelope_T *envelope = job->session->envelope;
+    char *field;
+    int i = 0;
+
+    for (field = job->report; field < job->report + job->report_len; field += strlen(field) + 1) {
+        switch (i++) {
+            case 0:
+                job->ret = atoi(field);
+                break;
+            case 1:
+                if (*field == '+') {
+                    free(job->session->response_msg);
+                    job->session->response_msg = strdup(field + 1);
+                }
+                break;
+            case 2:
+                job->flushed = (strcmp(field, "1") == 0);
+                smf_list_free(envelope->recipients);
+                smf_list_new(&envelope->recipients, smf_internal_string_list_destroy);
+                break;
+            case 3:
+                smf_module_job_string(&envelope->sender, field);
+                break;
+            case 4:
+                smf_module_job_string(&envelope->auth_user, field);
+                break;
+            case 5:
+                smf_module_job_string(&envelope->auth_pass, field);
+                break;
+            case 6:
+                smf_module_job_string(&envelope->nexthop, field);
+                break;
+            default:
+                smf_list_append(envelope->recipients, strdup(field + 1));
+                break;
+        }
+    }
+}
+
+/* wait for a worker, which has closed its pipe, and take over its 
+ * report */
+static void smf_module_job_finish(SMFModuleJob_T *job) {
+    pid_t pid;
+    int status;
+
+    close(job->wait.fd);
+    job->wait.fd = -1;
+
+    while (((pid = waitpid(job->pid, &status, 0)) == -1) && (errno == EINTR))
+        ;
+    job->pid = 0;
+    job->done = 1;
+
+    /* a worker, which crashed, hasn't finished its report */
+    if ((pid == -1) || !WIFEXITED(status) || (WEXITSTATUS(status) != EXIT_SUCCESS)) {
+        STRACE(TRACE_ERR, job->session->id, "worker of module [%s] failed", job->module->name);
+        job->ret = -1;
+    } else
+        smf_module_job_report(job);
+
+    free(job->report);
+    job->report = NULL;
+    job->report_len = 0;
+}
+
+/* read the report of a worker, until it closes the pipe */
+static void smf_module_job_read(SMFModuleJob_T *job) {
+    char buf[4096];
+    ssize_t n;
+
+    if ((n = read(job->wait.fd, buf, sizeof(buf))) > 0) {
+        if ((job->report = realloc(job->report, job->report_len + n)) == NULL) {
+            STRACE(TRACE_ERR, job->session->id, "failed to allocate memory for module [%s]", job->module->name);
+            job->report_len = 0;
+            kill(job->pid, SIGKILL);
+            return;
+        }
+        memcpy(job->report + job->report_len, buf, n);
+        job->report_len += n;
+    } else if ((n == 0) || (errno != EINTR)) 
+        smf_module_job_finish(job);
+}
+
+/* give up a job, a worker is killed */
+static void smf_module_job_abort(SMFModuleJob_T *job) {
+    if (job->pid > 0) {
+        kill(job->pid, SIGKILL);
+        while ((waitpid(job->pid, NULL, 0) == -1) && (errno == EINTR))
+            ;
+        job->pid = 0;
+        free(job->report);
+        job->report = NULL;
+    }
+
+    close(job->wait.fd);
+    job->wait.fd = -1;
+}
+
+/* start a job, synchronous modules get a worker process, if they run in 
+ * parallel or have a deadline */
+static void smf_module_job_start(SMFModuleJob_T *job, int parallel) {
+    ModuleAsyncFunction async;
+
+    job->wait.fd = -1;
+    job->timeout = smf_module_timeout(job->settings, job->module);
+    clock_gettime(CLOCK_MONOTONIC, &job->deadline);
+    job->deadline.tv_sec += job->timeout;
+
+    if ((async = (ModuleAsyncFunction)smf_module_hook(job->module, "load_async")) != NULL) {
+        job->async = 1;
+        job->ret = smf_module_check_wait(job->session, job->module, &job->wait,
+            async(job->settings, job->session, &job->wait));
+        job->done = (job->ret != SMF_MODULE_PENDING);
+        return;
+    }
+
+    if ((job->runner = smf_module_runner(job->module)) == NULL) {
+        job->ret = -1;
+        job->done = 1;
+        return;
+    }
+
+    if ((parallel || (job->timeout > 0)) && (smf_module_job_fork(job) == 0))
+        return;
+
+    job->ret = job->runner(job->settings, job->session);
+    job->done = 1;
+}
+
+/* poll the pending asynchronous jobs and workers, until all of them are 
+ * done or have been abandoned after their deadline */
+static void smf_modules_jobs_wait(SMFSession_T *session, SMFModuleJob_T *jobs, int count) {
+    SMFModuleJob_T *job;
+    struct pollfd *pfds;
+    int pending;
+    int remaining;
+    int timeout;
+    int i;
+
+    if ((pfds = calloc(count, sizeof(struct pollfd))) == NULL) {
+        STRACE(TRACE_ERR, session->id, "failed to allocate memory for poll set");
+        for (i = 0; i < count; i++) {
+            if (!jobs[i].done) {
+                smf_module_job_abort(&jobs[i]);
+                jobs[i].ret = -1;
+                jobs[i].done = 1;
+            }
+        }
+        return;
+    }
+
+    while (1) {
+        /* finished jobs have a negative descriptor, which is ignored */
+        pending = 0;
+        timeout = -1;
+        for (i = 0; i < count; i++) {
+            job = &jobs[i];
+            pfds[i].fd = -1;
+            pfds[i].revents = 0;
+            if (job->done) {
+                smf_session_span_end(job->span);
+                job->span = NULL;
+                continue;
+            }
+
+            if ((remaining = smf_module_job_remaining(job)) == 0) {
+                if (smf_module_timed_out(job)) {
+                    smf_module_job_abort(job);
+                    job->ret = smf_module_abandoned(job);
+                    job->done = 1;
+                    smf_session_span_end(job->span);
+                    job->span = NULL;
+                    continue;
+                }
+                remaining = -1;
+            }
+
+            pfds[i].fd = job->wait.fd;
+            pfds[i].events = job->wait.events;
+            if ((remaining >= 0) && ((timeout < 0) || (remaining < timeout)))
+                timeout = remaining;
+            pending++;
+        }
+
+        if (pending == 0)
+            break;
+
+        if (poll(pfds, count, timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            STRACE(TRACE_ERR, session->id, "failed to wait for modules: %s (%d)", strerror(errno), errno);
+            for (i = 0; i < count; i++) {
+                if (!jobs[i].done) {
+                    smf_module_job_abort(&jobs[i]);
+                    jobs[i].ret = -1;
+                    jobs[i].done = 1;
+                }
+            }
+            continue;
+        }
+
+        for (i = 0; i < count; i++) {
+            job = &jobs[i];
+            if ((pfds[i].fd < 0) || (pfds[i].revents == 0))
+                continue;
+
+            if (job->pid > 0) {
+                smf_module_job_read(job);
+                continue;
+            }
+
+            job->wait.revents = pfds[i].revents;
+            job->ret = smf_module_check_wait(job->session, job->module, &job->wait,
+                job->wait.resume(job->settings, job->session, &job->wait));
+            job->done = (job->ret != SMF_MODULE_PENDING);
+        }
+    }
+
+    free(pfds);
+}
+
+int smf_module_invoke(SMFSettings_T *settings, SMFModule_T *module, SMFSession_T *session) {
+    SMFModuleJob_T job;
+    time_t mtime_before, mtime_after;
+    int result;
+    
+    assert(module);
+    assert(session);
     
     if (session->message_file != NULL)
       mtime_before = message_file_mtime(session);
     
-    result = runner(settings,session);
+    memset(&job, 0, sizeof(job));
+    job.settings = settings;
+    job.module = module;
+    job.session = session;
+    smf_module_job_start(&job, 0);
+    smf_modules_jobs_wait(session, &job, 1);
+    result = job.ret;
 
     if (result == 0 && session->message_file != NULL) {
       mtime_after = message_file_mtime(session);
       
-      if (mtime_after > mtime_before) {
+      if (job.flushed || (mtime_after > mtime_before)) {
         // Spoolfile has change. Reload the message inside the session
         SMFMessage_T *message_new = smf_message_new();
         result = smf_message_from_file(&message_new, session->message_file, 0);
@@ -290,37 +1050,89 @@ int smf_module_invoke(SMFSettings_T *settings, SMFModule_T *module, SMFSession_T
     return result;
 }
 
+/* modules, which have been processed in a former run, are skipped */
+#define MODULE_UNPROCESSED(mod, modlist) (smf_dict_get((modlist), (mod)->name) == NULL)
+
+/* run the read-only modules starting at elem in parallel, returns the 
+ * number of jobs or 0 if there are less than two of them */
+static int smf_modules_run_parallel(SMFSettings_T *settings, SMFSession_T *session,
+        SMFListElem_T *elem, SMFDict_T *modlist, SMFModuleJob_T **jobs) {
+    SMFListElem_T *e;
+    SMFModule_T *mod;
+    SMFModuleJob_T *job;
+    int count = 0;
+    int i;
+
+    for (e = elem; e != NULL; e = e->next) {
+        mod = (SMFModule_T *)smf_list_data(e);
+        if (!MODULE_UNPROCESSED(mod, modlist))
+            continue;
+        if (!(mod->flags & SMF_MODULE_READONLY))
+            break;
+        count++;
+    }
+
+    if ((count < 2) || ((*jobs = calloc(count, sizeof(SMFModuleJob_T))) == NULL))
+        return 0;
+
+    STRACE(TRACE_DEBUG, session->id, "running %d read-only modules in parallel", count);
+
+    for (e = elem, i = 0; i < count; e = e->next) {
+        mod = (SMFModule_T *)smf_list_data(e);
+        if (!MODULE_UNPROCESSED(mod, modlist))
+            continue;
+
+        job = &(*jobs)[i++];
+        job->settings = settings;
+        job->module = mod;
+        job->copy = *session;
+        job->copy.response_msg = NULL;
+        job->copy.spans = NULL;
+        job->session = &job->copy;
+        job->span = smf_session_span_begin(session, "module:%s", mod->name);
+        smf_module_job_start(job, 1);
+    }
+
+    smf_modules_jobs_wait(session, *jobs, count);
+
+    return count;
+}
+
+/* free the jobs of a parallel run, including the response messages, which 
+ * haven't been taken over */
+static void smf_modules_jobs_free(SMFModuleJob_T *jobs, int count) {
+    int i;
+
+    for (i = 0; i < count; i++)
+        free(jobs[i].copy.response_msg);
+
+    free(jobs);
+}
+
 int smf_modules_process(
         SMFProcessQueue_T *q, SMFSession_T *session, SMFSettings_T *settings) {
-    FILE *stfh = NULL;
-    char *stf_filename = NULL;
     SMFDict_T *modlist;
+    char *key = NULL;
+    char *done = NULL;
+    char **p;
     SMFMessage_T *msg = NULL;
     SMFList_T *initial_headers = NULL;
     SMFListElem_T *elem = NULL;
+    SMFListElem_T *modelem = NULL;
     SMFModule_T *curmod;
     int ret = 0;
     int mod_count;
     char *header = NULL;
     NexthopFunction nexthop;
-
-    /* initialize message file  and load processed modules */
-    stf_filename = smf_modules_stf_path(settings,session);
-
-    stfh = fopen(stf_filename, "a+");
-    if(stfh == NULL) {
-        STRACE(TRACE_ERR, session->id, "failed to open message state file %s: %s (%d)", stf_filename, strerror(errno),errno);
-
-        if(stf_filename != NULL)
-            free(stf_filename);
-
-        return -1;
-    }
+    SMFSessionSpan_T *span = NULL;
+    SMFModuleJob_T *jobs = NULL;
+    SMFModuleJob_T *job;
+    int num_jobs = 0;
+    int next_job = 0;
+    int i;
 
     if (smf_list_new(&initial_headers,_header_destroy) != 0) {
         STRACE(TRACE_ERR,session->id, "failed to create header list");
-        free(stf_filename);
-        fclose(stfh);
         return -1;
     }
 
@@ -334,40 +1146,91 @@ int smf_modules_process(
     if (settings->add_header == 1)
         asprintf(&header,"X-Spmfilter: ");
 
+    /* load the modules, which have already processed a halted message */
+    smf_modules_journal_init();
+    modlist = smf_dict_new();
+    if (journal_state->n > 0) {
+        key = smf_modules_journal_key(session);
+        if ((done = smf_dict_get(journal_state, key)) != NULL) {
+            p = smf_core_strsplit(done, ";", NULL);
+            for (i = 0; p[i] != NULL; i++) {
+                if (*p[i] != '\0')
+                    smf_dict_set(modlist, p[i], "ok");
+                free(p[i]);
+            }
+            free(p);
+        }
+    }
+
+    if (settings->queue_recovery) {
+        if (key == NULL)
+            key = smf_modules_journal_key(session);
+        smf_modules_journal_envelope(settings, session, key);
+        smf_modules_journal_progress(settings, session, key, modlist);
+    }
+
     mod_count = 0;
-    modlist = smf_modules_stf_processed_modules(stfh);
     elem = smf_list_head(settings->modules);
     while(elem != NULL) {
         curmod = (SMFModule_T *)smf_list_data(elem);
+        modelem = elem;
         elem = elem->next;
 
         /* check if the module is in our modlist, if yes, the module has
          * already been processed and can be skipped */
-        if(smf_dict_get(modlist, curmod->name) != NULL) {
+        if(!MODULE_UNPROCESSED(curmod, modlist)) {
             STRACE(TRACE_INFO, session->id, "skipping module [%s]", curmod->name);
             continue;
         }
 
-        ret = smf_module_invoke(settings, curmod, session);
+        /* read-only modules are run in batches, their results are
+         * picked up in the configured order */
+        if ((next_job == num_jobs) && (curmod->flags & SMF_MODULE_READONLY)) {
+            smf_modules_jobs_free(jobs, num_jobs);
+            jobs = NULL;
+            next_job = 0;
+            num_jobs = smf_modules_run_parallel(settings, session, modelem, modlist, &jobs);
+        }
+
+        if (next_job < num_jobs) {
+            job = &jobs[next_job++];
+            ret = job->ret;
+
+            /* a successful module may set the response as well, a later
+             * one replaces it like in a sequential run */
+            if (job->copy.response_msg != NULL) {
+                free(session->response_msg);
+                session->response_msg = job->copy.response_msg;
+                job->copy.response_msg = NULL;
+            }
+        } else {
+            span = smf_session_span_begin(session, "module:%s", curmod->name);
+            ret = smf_module_invoke(settings, curmod, session);
+            smf_session_span_end(span);
+        }
 
         if(ret != 0) {
             ret = q->processing_error(settings,session,ret);
             
             if(ret == 0) {
                 STRACE(TRACE_ERR, session->id, "module [%s] failed, stopping processing!", curmod->name);
+                smf_modules_jobs_free(jobs, num_jobs);
+
+                /* processing can be resumed later */
+                if (key == NULL)
+                    key = smf_modules_journal_key(session);
+                smf_modules_journal_progress(settings, session, key, modlist);
+                free(key);
+
                 smf_dict_free(modlist);
-                fclose(stfh);
-                free(stf_filename);
                 free(header);
                 smf_list_free(initial_headers);
                 return -1;
             } else if(ret == 1) {
                 STRACE(TRACE_WARNING, session->id, "module [%s] stopped processing!", curmod->name);
+                smf_modules_jobs_free(jobs, num_jobs);
+                smf_modules_journal_forget(settings, session, key);
                 smf_dict_free(modlist);
-                fclose(stfh);
-                if(unlink(stf_filename) != 0)
-                    STRACE(TRACE_ERR,session->id,"Failed to unlink state file [%s]", stf_filename);
-                free(stf_filename);
                 free(header);
                 smf_list_free(initial_headers);
                 return 1;
@@ -377,7 +1240,9 @@ int smf_modules_process(
             }
         } else {
             STRACE(TRACE_DEBUG, session->id, "module [%s] finished successfully", curmod->name);
-            smf_modules_stf_write_entry(stfh, curmod->name);
+            smf_dict_set(modlist, curmod->name, "ok");
+            if (settings->queue_recovery)
+                smf_modules_journal_progress(settings, session, key, modlist);
         }
 
         mod_count++;
@@ -389,15 +1254,9 @@ int smf_modules_process(
         }
     }
 
-    /* close file, cleanup modlist and remove state file */
     STRACE(TRACE_DEBUG, session->id,"module processing finished successfully.");
-    fclose(stfh);
+    smf_modules_jobs_free(jobs, num_jobs);
     smf_dict_free(modlist);
-
-    if(unlink(stf_filename) != 0) {
-        STRACE(TRACE_ERR,session->id,"failed to unlink state file [%s]: %s (%d)", stf_filename,strerror(errno),errno);
-    }
-    free(stf_filename);
    
     if ((ret == 0) || (ret == 2)) {
         if (settings->add_header == 1) {
@@ -405,22 +1264,138 @@ int smf_modules_process(
             free(header); 
         }
         
+        span = smf_session_span_begin(session, "flush");
         if ((ret = smf_modules_flush_dirty(settings,session,initial_headers)) != 0)
             STRACE(TRACE_ERR,session->id,"message flush failed");
+        smf_session_span_end(span);
 
         /* queue is done, if we're still here check for next hop and
          * deliver
          */
         if (ret == 0 && (nexthop = smf_nexthop_find(settings)) != NULL) {
-            if ((ret = nexthop(settings, session)) != 0)
+            span = smf_session_span_begin(session, "nexthop");
+            ret = nexthop(settings, session);
+            smf_session_span_end(span);
+
+            if (ret != 0)
                 q->nexthop_error(settings, session);
         }
     }
     smf_list_free(initial_headers);
 
+    /* forget a formerly halted message, a recorded message is kept until
+     * it has been delivered */
+    if ((ret == 0) || !settings->queue_recovery)
+        smf_modules_journal_forget(settings, session, key);
+    else
+        free(key);
+
     return ret;
 }
 
+/* a hook refuses with -1 or a 4xx/5xx reply code */
+#define HOOK_REFUSED(ret) (((ret) == -1) || ((ret) >= 400))
+
+int smf_modules_process_mail(SMFSettings_T *settings, SMFSession_T *session) {
+    SMFListElem_T *elem = NULL;
+    SMFModule_T *curmod;
+    ModuleMailFunction hook;
+    int ret;
+
+    elem = smf_list_head(settings->modules);
+    while(elem != NULL) {
+        curmod = (SMFModule_T *)smf_list_data(elem);
+        elem = elem->next;
+
+        if ((hook = (ModuleMailFunction)smf_module_hook(curmod, "mail")) == NULL)
+            continue;
+
+        ret = hook(settings, session);
+        if (HOOK_REFUSED(ret)) {
+            STRACE(TRACE_INFO, session->id, "module [%s] refused sender [%s] with %d",
+                curmod->name, session->envelope->sender, ret);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+int smf_modules_process_rcpt(SMFSettings_T *settings, SMFSession_T *session, char *rcpt) {
+    SMFListElem_T *elem = NULL;
+    SMFModule_T *curmod;
+    ModuleRcptFunction hook;
+    int ret;
+
+    elem = smf_list_head(settings->modules);
+    while(elem != NULL) {
+        curmod = (SMFModule_T *)smf_list_data(elem);
+        elem = elem->next;
+
+        if ((hook = (ModuleRcptFunction)smf_module_hook(curmod, "rcpt")) == NULL)
+            continue;
+
+        ret = hook(settings, session, rcpt);
+        if (HOOK_REFUSED(ret)) {
+            STRACE(TRACE_INFO, session->id, "module [%s] refused recipient [%s] with %d",
+                curmod->name, rcpt, ret);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+int smf_modules_envelope_hooks(SMFSettings_T *settings) {
+    SMFListElem_T *elem = NULL;
+    SMFModule_T *curmod;
+    int count = 0;
+
+    for (elem = smf_list_head(settings->modules); elem != NULL; elem = elem->next) {
+        curmod = (SMFModule_T *)smf_list_data(elem);
+        if ((smf_module_hook(curmod, "mail") != NULL) || (smf_module_hook(curmod, "rcpt") != NULL))
+            count++;
+    }
+
+    return count;
+}
+
+int smf_modules_data_hooks(SMFSettings_T *settings) {
+    SMFListElem_T *elem = NULL;
+    int count = 0;
+
+    for (elem = smf_list_head(settings->modules); elem != NULL; elem = elem->next) {
+        if (smf_module_hook((SMFModule_T *)smf_list_data(elem), "data") != NULL)
+            count++;
+    }
+
+    return count;
+}
+
+int smf_modules_process_data(SMFSettings_T *settings, SMFSession_T *session, const char *buf, size_t len) {
+    SMFListElem_T *elem = NULL;
+    SMFModule_T *curmod;
+    ModuleDataFunction hook;
+    int ret;
+
+    elem = smf_list_head(settings->modules);
+    while(elem != NULL) {
+        curmod = (SMFModule_T *)smf_list_data(elem);
+        elem = elem->next;
+
+        if ((hook = (ModuleDataFunction)smf_module_hook(curmod, "data")) == NULL)
+            continue;
+
+        ret = hook(settings, session, buf, len);
+        if (HOOK_REFUSED(ret)) {
+            STRACE(TRACE_INFO, session->id, "module [%s] refused message data with %d", curmod->name, ret);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 
 /** Flush modified message headers to queue file */
 int smf_modules_flush_dirty(SMFSettings_T *settings, SMFSession_T *session, SMFList_T *initial_headers) {
@@ -482,7 +1457,13 @@ int smf_modules_flush_dirty(SMFSettings_T *settings, SMFSession_T *session, SMFL
         FILE *new = NULL;
         FILE *old = NULL;
         
-        snprintf(tmpname, sizeof(tmpname), "%s/XXXXXX", settings->queue_dir);
+        char *path = NULL;
+        
+        /* keep the temporary file next to the queue file, rename() below 
+         * must not cross filesystems */
+        path = strdup(session->message_file);
+        snprintf(tmpname, sizeof(tmpname), "%s/XXXXXX", dirname(path));
+        free(path);
 
         if ((fd = mkstemp(tmpname)) == -1) {
             STRACE(TRACE_ERR,session->id,"failed to create temporary file: %s (%d)",strerror(errno),errno);
@@ -516,11 +1497,8 @@ int smf_modules_flush_dirty(SMFSettings_T *settings, SMFSession_T *session, SMFL
         fclose(old); 
         fclose(new);
 
-        if (unlink(session->message_file)!=0) {
-            STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
-            return -1;
-        }
-
+        /* the queue file is replaced at once, a worker, which is killed
+         * meanwhile, leaves the previous one */
         if (rename(tmpname,session->message_file)!=0) {
             STRACE(TRACE_ERR,session->id,"failed to rename queue file: %s (%d)",strerror(errno),errno);
             return -1;
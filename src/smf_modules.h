@@ -40,11 +40,68 @@ extern "C" {
  *          be marked as "dirty" - that means the header will be flushed to disk 
  *          before the final delivery is initialized, to keep the message in sync 
  *          with the modified data.
+ * @details Besides <code>load</code>, a module may export the envelope hooks 
+ *          <code>mail</code> (a ModuleMailFunction) and <code>rcpt</code> (a 
+ *          ModuleRcptFunction). The smtpd and milter engines run them on 
+ *          MAIL FROM and RCPT TO, before the message is received. A hook returns 0 to accept,
+ *          a 4xx/5xx SMTP code to refuse the sender or recipient (with an 
+ *          optional text in the session's response_msg) or -1 on failure.
+ * @details The hook <code>data</code> (a ModuleDataFunction) is fed with the
+ *          message data in chunks, while the smtpd or milter engine receives
+ *          it, and once with a length of 0 after the final dot. It returns like the 
+ *          envelope hooks, a refused message is neither spooled nor processed 
+ *          by load().
+ * @details A module, which exports <code>const unsigned int module_flags = 
+ *          SMF_MODULE_READONLY</code>, promises not to modify the session or 
+ *          the message. Consecutive read-only modules are run in parallel 
+ *          worker processes, each on its own copy of the session, message
+ *          and lookup connection. Their results are evaluated in the 
+ *          configured order afterwards, so the outcome is the same as if they
+ *          had been run one after another.
+ * @details Instead of <code>load</code>, a module may export 
+ *          <code>load_async</code> (a ModuleAsyncFunction). It starts a 
+ *          request, e.g. to a scanning daemon, fills in the SMFModuleWait_T 
+ *          and returns SMF_MODULE_PENDING. As soon as the descriptor is ready,
+ *          the continuation is called, which returns the final result or 
+ *          SMF_MODULE_PENDING again. The asynchronous modules of a run of 
+ *          read-only modules wait concurrently in the processing thread.
+ * @details If a module has a deadline (module_timeout or [module]timeout),
+ *          a synchronous module is run in a worker process, which is killed
+ *          when the deadline has passed. The worker reports the result, the
+ *          envelope and whether the spool file has changed, changed headers
+ *          are written to the spool file by the worker. The descriptor of an
+ *          abandoned asynchronous module is closed, its continuation isn't 
+ *          called anymore.
  */
 
 typedef int (*ModuleLoadFunction)(SMFSettings_T *settings, SMFSession_T *session);
+typedef int (*ModuleMailFunction)(SMFSettings_T *settings, SMFSession_T *session);
+typedef int (*ModuleRcptFunction)(SMFSettings_T *settings, SMFSession_T *session, char *rcpt);
+typedef int (*ModuleDataFunction)(SMFSettings_T *settings, SMFSession_T *session, const char *buf, size_t len);
 typedef int (*LoadEngine)(SMFSettings_T *settings);
 
+/** returned by an asynchronous module, which waits for a file descriptor */
+#define SMF_MODULE_PENDING -2
+
+/*!
+ * @struct SMFModuleWait_T
+ * @brief What an asynchronous module is waiting for
+ */
+typedef struct _SMFModuleWait_T SMFModuleWait_T;
+typedef int (*ModuleAsyncFunction)(SMFSettings_T *settings, SMFSession_T *session, SMFModuleWait_T *wait);
+
+struct _SMFModuleWait_T {
+    int fd; /**< file descriptor to wait for */
+    short events; /**< poll events to wait for, e.g. POLLIN */
+    short revents; /**< poll events, which occurred */
+    ModuleAsyncFunction resume; /**< continuation, called when fd is ready */
+    void *data; /**< private data of the module */
+};
+
+/** the module only reads the session and the message and does not depend
+ * on other modules, so it may run in parallel to other read-only modules */
+#define SMF_MODULE_READONLY 0x01
+
 
 /*!
  * @struct SMFModule_T
@@ -59,6 +116,10 @@ typedef struct {
         void *handle; /**< module handle, value for typp 0 */
         ModuleLoadFunction callback; /**< Callback, used for type != 0 */
     } u;
+    unsigned int flags; /**< SMF_MODULE_* flags, a shared-object declares
+                             them in the variable <code>module_flags</code> */
+    unsigned int timeouts; /**< number of invocations, which exceeded the 
+                                deadline of the module */
 } SMFModule_T;
 
 typedef struct {
@@ -131,6 +192,44 @@ int smf_module_invoke(SMFSettings_T *settings, SMFModule_T *module, SMFSession_T
 /** load all modules and run them */
 int smf_modules_process(SMFProcessQueue_T *q, SMFSession_T *session, SMFSettings_T *settings);
 
+/** read a single module journal, modules and envelopes are filled with 
+ * the processed modules and the recorded envelopes of all messages, which
+ * haven't been finished, finished with the messages, which are done, and
+ * attempts, if not NULL, with the number of recovery attempts of a message.
+ * A finished message is never recorded again. Returns the number of 
+ * recorded envelopes and attempts or -1 on error */
+int smf_modules_journal_read(const char *path, SMFDict_T *modules, SMFDict_T *envelopes, 
+    SMFDict_T *finished, SMFDict_T *attempts);
+
+/** write the envelopes and processed modules of messages from 
+ * smf_modules_journal_read() and the number of attempts, if not NULL, to a
+ * new journal in queue_dir, which isn't owned by any process, so the next 
+ * queue run picks them up again. Returns 0 on success or -1 */
+int smf_modules_journal_carry(SMFSettings_T *settings, SMFDict_T *modules, SMFDict_T *envelopes, 
+    SMFDict_T *attempts);
+
+/** continue the processing of a message with the modules, which have
+ * already processed it, e.g. ";mod1;mod2;" from smf_modules_journal_read() */
+void smf_modules_journal_restore(SMFSession_T *session, const char *modules);
+
+/** run the mail hooks of all modules, returns 0 if the sender is accepted
+ * or the code of the first hook, which refused it */
+int smf_modules_process_mail(SMFSettings_T *settings, SMFSession_T *session);
+
+/** run the rcpt hooks of all modules, returns 0 if the recipient is 
+ * accepted or the code of the first hook, which refused it */
+int smf_modules_process_rcpt(SMFSettings_T *settings, SMFSession_T *session, char *rcpt);
+
+/** number of modules with a mail or rcpt hook */
+int smf_modules_envelope_hooks(SMFSettings_T *settings);
+
+/** number of modules with a data hook */
+int smf_modules_data_hooks(SMFSettings_T *settings);
+
+/** feed a chunk of message data to the data hooks of all modules, returns
+ * 0 to continue or the code of the first hook, which refused the message */
+int smf_modules_process_data(SMFSettings_T *settings, SMFSession_T *session, const char *buf, size_t len);
+
 /** deliver a message to the nexthop */
 int smf_modules_deliver_nexthop(SMFSettings_T *settings, SMFProcessQueue_T *q, SMFSession_T *session);
 
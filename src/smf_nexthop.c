@@ -18,10 +18,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
 
 #include "smf_nexthop.h"
 #include "smf_smtp.h"
 #include "smf_trace.h"
+#include "smf_internal.h"
 
 #define THIS_MODULE "nexthop"
 
@@ -81,40 +85,30 @@ static int file_delivery_nexthop(SMFSettings_T *settings, SMFSession_T *session)
     STRACE(TRACE_DEBUG, session->id, "will now deliver to nexthop-file [%s]", settings->nexthop);
     
     if (session->message_file != NULL) {
-        FILE *src, *dest;
-        char block[512];
-        size_t nbytes;
+        int src, dest;
         
-        if ((src = fopen(session->message_file, "r")) == NULL) {
+        if ((src = open(session->message_file, O_RDONLY)) == -1) {
             STRACE(TRACE_ERR, session->id, "Failed to open %s for reading: %s",
                 session->message_file, strerror(errno));
             return -1;
         }
         
-        if ((dest = fopen(settings->nexthop, "w")) == NULL) {
+        if ((dest = open(settings->nexthop, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
             STRACE(TRACE_ERR, session->id, "Failed to open %s for writing: %s",
                 settings->nexthop, strerror(errno));
-            fclose(src);
+            close(src);
             return -1;
         }
 
-        while (!feof(src)) {
-            if ((nbytes = fread(block, 1, sizeof(block), src)) == 0 && ferror(src)) {
-                STRACE(TRACE_ERR, "Failed to read from %s: %s",
-                    session->message_file, strerror(ferror(src)));
-                result = -1;
-                break;
-            }
-            if ((nbytes = fwrite(block, 1, nbytes, dest)) == 0 && ferror(dest)) {
-                STRACE(TRACE_ERR, "Failed to write to %s: %s",
-                    settings->nexthop, strerror(ferror(dest)));
-                result = -1;
-                break;
-            }
+        if (smf_internal_copy_fd(src, 0, dest) == -1) {
+            STRACE(TRACE_ERR, session->id, "Failed to copy %s to %s: %s",
+                session->message_file, settings->nexthop, strerror(errno));
+            result = -1;
         }
 
-        fclose(src);
-        fclose(dest);
+        close(src);
+        if (close(dest) != 0)
+            result = -1;
     } else if (session->envelope->message != NULL) {
         int nitems;
         
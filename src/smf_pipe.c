@@ -16,7 +16,6 @@
  */
 
 #define _GNU_SOURCE
-#define BUFF_SIZE 1024
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,7 +38,6 @@
 #include "smf_smtp.h"
 
 #define THIS_MODULE "pipe"
-#define BUF_SIZE 1024
 
 static int smf_pipe_handle_q_error(SMFSettings_T *settings, SMFSession_T *session) {
     switch (settings->module_fail) {
@@ -82,14 +80,18 @@ static int smf_pipe_handle_nexthop_error(SMFSettings_T *settings, SMFSession_T *
 
 int load(SMFSettings_T *settings) {
     struct tms start_acct;
-    char buffer[BUF_SIZE];
-    FILE *spool_file;
     SMFMessage_T *message = smf_message_new();
     SMFSession_T *session = smf_session_new();
     SMFProcessQueue_T *q;
+    SMFSessionSpan_T *span = NULL;
+    char *qdir = NULL;
+    ssize_t nread;
+    int fd;
     int ret = -1;
 
     start_acct = smf_internal_init_runtime_stats();
+    if (settings->timing_log != NULL)
+        smf_session_enable_timing(session);
 
     /* initialize the modules queue handler */
     q = smf_modules_pqueue_init(
@@ -104,40 +106,57 @@ int load(SMFSettings_T *settings) {
 
     
     /* generate the queue file */
-    smf_core_gen_queue_file(settings->queue_dir, &session->message_file, session->id);
-    STRACE(TRACE_DEBUG,session->id,"using spool file: '%s'", session->message_file);
+    if ((qdir = smf_core_queue_dir(settings->queue_dir, session->id, settings->queue_hash_depth)) == NULL) {
+        STRACE(TRACE_ERR,session->id,"failed to create queue directory: %s (%d)",strerror(errno),errno);
+        return(-1);
+    }
 
-    /* open the spool file */
-    spool_file = fopen(session->message_file, "w");
-    if(spool_file == NULL) {
-        STRACE(TRACE_ERR,session->id,"unable to open spool file: %s (%d)",strerror(errno), errno);
+    /* open the spool file, it stays unnamed until the message is complete */
+    if ((fd = smf_core_spool_open(qdir, session->id, &session->message_file)) == -1) {
+        STRACE(TRACE_ERR,session->id,"unable to create spool file: %s (%d)",strerror(errno), errno);
+        free(qdir);
         return(-1);
     }
 
-    /* write stream directly to spool_file */
-    while(!feof(stdin)) {
-        size_t nread, nwritten;
+    /* move stdin straight into the spool file, without a copy through 
+     * user space whenever stdin is a pipe */
+    span = smf_session_span_begin(session, "data");
+    if ((nread = smf_internal_copy_stream(STDIN_FILENO, fd)) < 0) {
+        STRACE(TRACE_ERR, session->id, "Failed to write the spoolfile: %s", strerror(errno));
+        close(fd);
+        free(qdir);
+        return -1;
+    }
+    session->message_size = nread;
 
-        nread = fread(&buffer, 1, BUF_SIZE-1, stdin);
-        if (nread == 0 && ferror(stdin)) {
-          STRACE(TRACE_ERR, session->id, "Failed to read from stdin: %s", strerror(errno));
-          fclose(spool_file);
-          return -1;
-        }
-        
-        nwritten = fwrite(buffer, 1, nread, spool_file);
-        if (nread != nwritten) {
-          STRACE(TRACE_ERR, session->id, "Failed to write the spoolfile: %s", strerror(errno));
-          fclose(spool_file);
-          return -1;
-        }
+    if (smf_core_spool_link(fd, qdir, session->id, &session->message_file) != 0) {
+        STRACE(TRACE_ERR, session->id, "Failed to link the spoolfile: %s", strerror(errno));
+        close(fd);
+        free(qdir);
+        return -1;
     }
 
-    fclose(spool_file);
+    if ((settings->spool_sync != SMF_SPOOL_SYNC_NONE) && 
+            (smf_core_spool_sync(fd, session->message_file, 
+                settings->spool_sync == SMF_SPOOL_SYNC_FULL) != 0)) {
+        STRACE(TRACE_ERR, session->id, "Failed to sync the spoolfile: %s", strerror(errno));
+        close(fd);
+        remove(session->message_file);
+        free(qdir);
+        return -1;
+    }
+
+    close(fd);
+    free(qdir);
+    smf_session_span_end(span);
+    STRACE(TRACE_DEBUG,session->id,"using spool file: '%s'", session->message_file);
+
+    span = smf_session_span_begin(session, "parse");
     if(smf_message_from_file(&message,session->message_file,1) != 0) {
         STRACE(TRACE_ERR, session->id, "smf_message_from_file() failed");
         return(-1);
     }
+    smf_session_span_end(span);
 
     session->envelope->message = message;
 
@@ -150,6 +169,9 @@ int load(SMFSettings_T *settings) {
     free(q);
     smf_internal_print_runtime_stats(start_acct,session->id);
 
+    if (settings->timing_log != NULL)
+        smf_session_timing_write(session, settings->timing_log);
+
     smf_session_free(session);
     return ret;
 }
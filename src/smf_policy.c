@@ -0,0 +1,307 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner, Werner Detter and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/times.h>
+
+#include "spmfilter_config.h"
+#include "smf_policy.h"
+#include "smf_trace.h"
+#include "smf_settings.h"
+#include "smf_settings_private.h"
+#include "smf_modules.h"
+#include "smf_session.h"
+#include "smf_envelope.h"
+#include "smf_core.h"
+#include "smf_internal.h"
+#include "smf_dict.h"
+#include "smf_list.h"
+#include "smf_server.h"
+
+#define THIS_MODULE "policy"
+
+/* action for the current request, set by the queue handlers */
+static char *policy_action = NULL;
+
+static void smf_policy_sig_handler(int sig) {
+    if (sig == SIGALRM)
+        TRACE(TRACE_DEBUG,"session timeout exceeded");
+
+    TRACE(TRACE_NOTICE, "terminating child %i", getpid());
+    exit(0);
+}
+
+/* remember the action for a module or processing failure */
+static void smf_policy_set_action(SMFSettings_T *settings, int code, char *msg) {
+    char *code_str = NULL;
+
+    free(policy_action);
+    policy_action = NULL;
+
+    /* the smtpd engine accepts and drops the message for other codes */
+    if ((code < 400) || (code > 599)) {
+        policy_action = strdup(POLICY_DISCARD);
+        return;
+    }
+
+    if (msg == NULL) {
+        asprintf(&code_str,"%d",code);
+        msg = smf_dict_get(settings->smtp_codes,code_str);
+        free(code_str);
+    }
+
+    if (msg != NULL)
+        asprintf(&policy_action,"%d %s",code,msg);
+    else
+        asprintf(&policy_action,"%d %d.3.0 %s",code,code / 100,POLICY_REPLY_TEXT);
+}
+
+static int smf_policy_handle_q_error(SMFSettings_T *settings, SMFSession_T *session) {
+    switch (settings->module_fail) {
+        case 1: return(2);
+        case 2: smf_policy_set_action(settings,552,NULL);
+                return(0);
+        case 3: smf_policy_set_action(settings,451,NULL);
+                return(0);
+    }
+
+    return 0;
+}
+
+static int smf_policy_handle_q_processing_error(SMFSettings_T *settings, SMFSession_T *session, int retval) {
+    if (retval == -1) {
+        /* "ignore" leaves the decision to the MTA */
+        switch (settings->module_fail) {
+            case 1: return(2);
+            case 2: smf_policy_set_action(settings,552,NULL);
+                    return(0);
+            case 3: smf_policy_set_action(settings,451,NULL);
+                    return(0);
+        }
+    } else if(retval == 1) {
+        smf_policy_set_action(settings,250,NULL);
+        return(1);
+    } else if(retval == 2) {
+        return(2);
+    } else {
+        smf_policy_set_action(settings,retval,session->response_msg);
+        return(1);
+    }
+
+    STRACE(TRACE_DEBUG, session->id, "no conditional matched, will stop queue processing!");
+    return(0);
+}
+
+/* the MTA delivers the message itself, there is no nexthop */
+static int smf_policy_handle_nexthop_error(SMFSettings_T *settings, SMFSession_T *session) {
+    return 0;
+}
+
+/* map a policy attribute to the session */
+static void smf_policy_set_attribute(SMFSession_T *session, char *name, char *value) {
+    if (*value == '\0')
+        return;
+
+    if (strcmp(name, "helo_name") == 0) {
+        smf_session_set_helo(session, value);
+    } else if (strcmp(name, "client_address") == 0) {
+        smf_session_set_xforward_addr(session, value);
+    } else if (strcmp(name, "sender") == 0) {
+        smf_envelope_set_sender(session->envelope, value);
+    } else if (strcmp(name, "recipient") == 0) {
+        smf_envelope_add_rcpt(session->envelope, value);
+    } else if (strcmp(name, "sasl_username") == 0) {
+        smf_envelope_set_auth_user(session->envelope, value);
+    } else if (strcmp(name, "size") == 0) {
+        session->message_size = strtoul(value, NULL, 10);
+    } else if (strcmp(name, "queue_id") == 0) {
+        STRACE(TRACE_DEBUG,session->id,"policy request for queue id %s",value);
+    }
+}
+
+/* read the attributes of a request up to the empty line. Returns 1 for
+ * a complete request, 0 on EOF and -1 on error */
+static int smf_policy_read_request(SMFSession_T *session, int client, void **rl) {
+    char line[POLICY_MAXLINE];
+    char *value = NULL;
+    ssize_t br;
+    size_t len;
+    int count = 0;
+    int skip = 0;
+
+    while ((br = smf_internal_readline(client, line, sizeof(line), rl)) > 0) {
+        len = strlen(line);
+        if ((len == 0) || (line[len - 1] != '\n')) {
+            /* overlong attribute, drop it up to the next newline */
+            if (!skip)
+                STRACE(TRACE_WARNING,session->id,"skipping overlong policy attribute");
+            skip = 1;
+            continue;
+        }
+
+        if (skip) {
+            skip = 0;
+            continue;
+        }
+
+        line[--len] = '\0';
+        if ((len > 0) && (line[len - 1] == '\r'))
+            line[--len] = '\0';
+
+        /* an empty line terminates the request */
+        if (len == 0)
+            return (count > 0) ? 1 : -1;
+
+        if ((value = strchr(line, '=')) == NULL) {
+            STRACE(TRACE_ERR,session->id,"invalid policy attribute [%s]",line);
+            return -1;
+        }
+        *value++ = '\0';
+
+        smf_policy_set_attribute(session, line, value);
+        count++;
+    }
+
+    return (br == 0) ? 0 : -1;
+}
+
+static int smf_policy_process_request(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q) {
+    SMFListElem_T *elem = NULL;
+    char *out = NULL;
+    ssize_t len;
+    int ret;
+
+    free(policy_action);
+    policy_action = NULL;
+
+    /* there is no message yet, so only the envelope hooks of the modules
+     * are run, a module without them is skipped */
+    ret = smf_modules_process_mail(settings, session);
+    if ((ret == 0) && ((elem = smf_list_tail(session->envelope->recipients)) != NULL))
+        ret = smf_modules_process_rcpt(settings, session, (char *)smf_list_data(elem));
+
+    if (ret != 0)
+        ret = q->processing_error(settings, session, ret) == 0 ? -1 : 0;
+
+    if ((ret == -1) && (policy_action == NULL)) {
+        STRACE(TRACE_DEBUG,session->id,"policy engine failed!");
+        smf_policy_set_action(settings, 451, NULL);
+    }
+
+    len = asprintf(&out, "action=%s\n\n", policy_action != NULL ? policy_action : POLICY_DUNNO);
+    STRACE(TRACE_DEBUG,session->id,"policy action: %s", policy_action != NULL ? policy_action : POLICY_DUNNO);
+
+    ret = (smf_internal_writen(session->sock, out, len) == len) ? 0 : -1;
+    if (ret != 0)
+        STRACE(TRACE_ERR,session->id,"failed to write policy response: %s (%d)",strerror(errno),errno);
+    free(out);
+
+    return ret;
+}
+
+void smf_policy_handle_client(SMFSettings_T *settings, int client, SMFProcessQueue_T *q) {
+    SMFSession_T *session = NULL;
+    struct tms start_acct;
+    struct sigaction action;
+    void *rl = NULL;
+    int ret;
+
+    start_acct = smf_internal_init_runtime_stats();
+
+    /* set timeout */
+    action.sa_handler = smf_policy_sig_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+
+    if (sigaction(SIGALRM, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGALRM) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (sigaction(SIGTERM, &action, NULL) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGTERM) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* the MTA keeps the connection open for further requests, every 
+     * request is a session of its own */
+    for (;;) {
+        alarm(settings->smtpd_timeout);
+        session = smf_session_new();
+        session->sock = client;
+        if (settings->timing_log != NULL)
+            smf_session_enable_timing(session);
+
+        if ((ret = smf_policy_read_request(session, client, &rl)) == 1)
+            ret = smf_policy_process_request(session, settings, q);
+        else
+            ret = -1;
+
+        if (settings->timing_log != NULL)
+            smf_session_timing_write(session, settings->timing_log);
+
+        if (ret != 0)
+            break;
+        smf_session_free(session);
+    }
+
+    free(rl);
+    free(policy_action);
+    smf_internal_print_runtime_stats(start_acct,session->id);
+    smf_session_free(session);
+
+    smf_settings_free(settings);
+    exit(0);
+}
+
+int load(SMFSettings_T *settings) {
+    int *sds = NULL;
+    int num_sds;
+    SMFProcessQueue_T *q;
+
+    TRACE(TRACE_INFO,"starting policy engine");
+
+    /* initialize the modules queue handler */
+    q = smf_modules_pqueue_init(
+        smf_policy_handle_q_error,
+        smf_policy_handle_q_processing_error,
+        smf_policy_handle_nexthop_error
+    );
+
+    if(q == NULL) {
+        TRACE(TRACE_ERR,"failed to initialize module queue");
+        return(-1);
+    }
+
+    if ((num_sds = smf_server_listen(settings,&sds)) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    smf_server_init(settings);
+    smf_server_loop(settings,sds,num_sds,q,smf_policy_handle_client);
+
+    free(sds);
+    free(q);
+    
+    return 0;
+}
@@ -0,0 +1,34 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SMF_POLICY_H
+#define _SMF_POLICY_H
+
+#include "smf_settings.h"
+#include "smf_session.h"
+#include "smf_modules.h"
+
+/* longest attribute line of a policy request, longer ones are skipped */
+#define POLICY_MAXLINE 4096
+
+#define POLICY_DUNNO "DUNNO"
+#define POLICY_DISCARD "DISCARD"
+#define POLICY_REPLY_TEXT "Requested action aborted: local error in processing"
+
+void smf_policy_handle_client(SMFSettings_T *settings, int client, SMFProcessQueue_T *q);
+
+#endif  /* _SMF_POLICY_H */
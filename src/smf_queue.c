@@ -0,0 +1,447 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+
+#include "spmfilter_config.h"
+#include "smf_core.h"
+#include "smf_modules.h"
+#include "smf_trace.h"
+#include "smf_settings.h"
+#include "smf_session.h"
+#include "smf_dict.h"
+#include "smf_list.h"
+#include "smf_message_private.h"
+#include "smf_internal.h"
+
+#define THIS_MODULE "queue"
+
+/* exit codes of a worker, the record of a message, which hasn't been 
+ * processed, has to be kept */
+#define RESUME_DONE 0
+#define RESUME_HALTED 1 /* recorded in the journal of the worker again */
+#define RESUME_FAILED 2
+
+#define DEFAULT_MAX_ATTEMPTS 5
+
+static volatile sig_atomic_t stop = 0;
+
+static void smf_queue_sig_handler(int sig) {
+    stop = 1;
+}
+
+static int smf_queue_handle_q_error(SMFSettings_T *settings, SMFSession_T *session) {
+    switch (settings->module_fail) {
+        case 1:
+            return(1);
+        default:
+            return(0);
+    }
+}
+
+static int smf_queue_handle_q_processing_error(SMFSettings_T *settings, SMFSession_T *session, int retval) {
+    if (retval == -1) {
+        switch (settings->module_fail) {
+            case 1:
+                return(1);
+            default:
+                return(0);
+        }
+    } else if(retval == 2) {
+        return(2);
+    }
+
+    return(1);
+}
+
+static int smf_queue_handle_nexthop_error(SMFSettings_T *settings, SMFSession_T *session) {
+    return(0);
+}
+
+/* a living process holds the lock on its journal, so only the journals of
+ * processes, which don't exist anymore, can be locked */
+static int smf_queue_orphaned(SMFSettings_T *settings, const char *name) {
+    char *path = NULL;
+    int fd;
+    int ret;
+
+    if (strncmp(name, "journal.", 8) != 0)
+        return 0;
+
+    asprintf(&path, "%s/%s", settings->queue_dir, name);
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        if (errno != ENOENT)
+            TRACE(TRACE_ERR,"failed to open module journal [%s]: %s (%d)",path,strerror(errno),errno);
+        free(path);
+        return 0;
+    }
+    free(path);
+
+    ret = (flock(fd, LOCK_EX | LOCK_NB) == 0);
+    close(fd);
+
+    return ret;
+}
+
+static void smf_queue_drop(char *key, char *value, void *args) {
+    smf_dict_remove((SMFDict_T *)args, key);
+}
+
+/* the number of attempts of a message, which isn't recorded anymore, 
+ * is forgotten */
+static void smf_queue_expire(char *key, char *value, void *args) {
+    SMFDict_T **dicts = (SMFDict_T **)args;
+
+    if (smf_dict_get(dicts[0], key) == NULL)
+        smf_dict_remove(dicts[1], key);
+}
+
+/* a message, which has failed max_attempts times, is given up, its spool
+ * file is kept */
+static void smf_queue_give_up(SMFSettings_T *settings, SMFDict_T *envelopes, SMFDict_T *attempts) {
+    SMFList_T *keys = NULL;
+    SMFListElem_T *elem = NULL;
+    char *key, *value;
+    int max_attempts;
+
+    if ((value = smf_settings_group_get(settings, "queue", "max_attempts")) == NULL)
+        max_attempts = DEFAULT_MAX_ATTEMPTS;
+    else
+        max_attempts = smf_settings_group_get_integer(settings, "queue", "max_attempts");
+
+    if ((max_attempts <= 0) || ((keys = smf_dict_get_keys(attempts)) == NULL))
+        return;
+
+    elem = smf_list_head(keys);
+    while (elem != NULL) {
+        key = (char *)smf_list_data(elem);
+        if (atoi(smf_dict_get(attempts, key)) >= max_attempts) {
+            TRACE(TRACE_WARNING,"giving up message [%s] after %d attempts, keeping %s",
+                key, max_attempts, smf_dict_get(envelopes, key));
+            smf_dict_remove(envelopes, key);
+            smf_dict_remove(attempts, key);
+        }
+        elem = elem->next;
+    }
+    smf_list_free(keys);
+}
+
+/* resume a recorded message "<spool file>\t<sender>\t<rcpt>..." in a 
+ * worker process, the session id is the first part of the key */
+static int smf_queue_resume(SMFSettings_T *settings, SMFProcessQueue_T *q, 
+        const char *key, const char *envelope, const char *modules) {
+    SMFSession_T *session = NULL;
+    SMFMessage_T *message = NULL;
+    char **fields = NULL;
+    char *p = NULL;
+    int num, i;
+    int ret;
+
+    if ((p = strchr(key, '.')) == NULL) {
+        TRACE(TRACE_ERR,"invalid journal key [%s]",key);
+        return RESUME_FAILED;
+    }
+
+    session = smf_session_new();
+    free(session->id);
+    session->id = strndup(key, p - key);
+
+    fields = smf_core_strsplit(envelope, "\t", &num);
+    session->message_file = strdup(fields[0]);
+    if ((num > 1) && (*fields[1] != '\0'))
+        smf_envelope_set_sender(session->envelope, fields[1]);
+    for (i = 2; i < num; i++) {
+        if (*fields[i] != '\0')
+            smf_envelope_add_rcpt(session->envelope, fields[i]);
+    }
+    for (i = 0; i < num; i++)
+        free(fields[i]);
+    free(fields);
+
+    if (access(session->message_file, F_OK) != 0) {
+        /* the message has been delivered or rejected, before the journal
+         * was updated */
+        STRACE(TRACE_WARNING,session->id,"spool file %s is gone, skipping message",session->message_file);
+        smf_session_free(session);
+        return RESUME_DONE;
+    }
+
+    STRACE(TRACE_INFO,session->id,"recovering message %s",session->message_file);
+
+    message = smf_message_new();
+    if (smf_message_from_file(&message,session->message_file,1) != 0) {
+        STRACE(TRACE_ERR,session->id,"smf_message_from_file() failed, keeping %s",session->message_file);
+        smf_message_free(message);
+        smf_session_free(session);
+        return RESUME_FAILED;
+    }
+    session->envelope->message = message;
+
+    if (modules != NULL)
+        smf_modules_journal_restore(session, modules);
+
+    /* a message, which is halted again, has been recorded in the journal
+     * of this process and is left for the next run */
+    ret = smf_modules_process(q,session,settings);
+    if ((ret == 0) || (ret == 1))
+        remove(session->message_file);
+
+    smf_session_free(session);
+
+    return (ret == -1) ? RESUME_HALTED : RESUME_DONE;
+}
+
+/* resume the unfinished messages of all orphaned journals */
+static int smf_queue_run(SMFSettings_T *settings, SMFProcessQueue_T *q, int workers) {
+    SMFList_T *journals = NULL;
+    SMFList_T *recovered = NULL;
+    SMFList_T *keys = NULL;
+    SMFListElem_T *elem = NULL;
+    SMFDict_T *modules = NULL;
+    SMFDict_T *envelopes = NULL;
+    SMFDict_T *finished = NULL;
+    SMFDict_T *attempts = NULL;
+    SMFDict_T *pids = NULL;
+    SMFDict_T *dicts[2];
+    DIR *dir = NULL;
+    struct dirent *de = NULL;
+    char *path = NULL;
+    char *key = NULL;
+    char *value = NULL;
+    char *pid_str = NULL;
+    char *n_str = NULL;
+    int running = 0;
+    int failed = 0;
+    int status;
+    pid_t pid;
+
+    if ((dir = opendir(settings->queue_dir)) == NULL) {
+        TRACE(TRACE_ERR,"failed to open queue directory [%s]: %s (%d)",settings->queue_dir,strerror(errno),errno);
+        return -1;
+    }
+
+    /* journals of the workers started below are locked by them */
+    if ((smf_list_new(&journals, smf_internal_string_list_destroy) != 0) ||
+            (smf_list_new(&recovered, smf_internal_string_list_destroy) != 0)) {
+        closedir(dir);
+        if (journals != NULL)
+            smf_list_free(journals);
+        return -1;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        if (smf_queue_orphaned(settings, de->d_name)) {
+            asprintf(&path, "%s/%s", settings->queue_dir, de->d_name);
+            smf_list_append(journals, path);
+        }
+    }
+    closedir(dir);
+
+
+    modules = smf_dict_new();
+    envelopes = smf_dict_new();
+    finished = smf_dict_new();
+    attempts = smf_dict_new();
+    pids = smf_dict_new();
+
+    /* journals without any recorded envelope belong to processes without
+     * queue_recovery, their halted messages are resumed on resubmission */
+    elem = smf_list_head(journals);
+    while (elem != NULL) {
+        path = (char *)smf_list_data(elem);
+        if (smf_modules_journal_read(path, modules, envelopes, finished, attempts) > 0)
+            smf_list_append(recovered, strdup(path));
+        elem = elem->next;
+    }
+
+    /* a message, which is done, doesn't come back, no matter in which 
+     * order the journals are read */
+    smf_dict_map(finished, smf_queue_drop, envelopes);
+    dicts[0] = envelopes;
+    dicts[1] = attempts;
+    smf_dict_map(attempts, smf_queue_expire, dicts);
+    smf_queue_give_up(settings, envelopes, attempts);
+
+    if (envelopes->n > 0)
+        TRACE(TRACE_INFO,"recovering %d messages from %d orphaned journals",
+            envelopes->n, smf_list_size(recovered));
+
+    keys = smf_dict_get_keys(envelopes);
+    elem = smf_list_head(keys);
+    while ((elem != NULL) || (running > 0)) {
+        if ((elem != NULL) && (running < workers) && !stop) {
+            key = (char *)smf_list_data(elem);
+            elem = elem->next;
+
+            value = smf_dict_get(attempts, key);
+            asprintf(&n_str, "%d", (value != NULL) ? atoi(value) + 1 : 1);
+            smf_dict_set(attempts, key, n_str);
+            free(n_str);
+
+            switch(pid = fork()) {
+                case -1:
+                    TRACE(TRACE_ERR,"fork() failed: %s (%d)",strerror(errno),errno);
+                    failed++;
+                    break;
+                case 0:
+                    signal(SIGINT, SIG_DFL);
+                    signal(SIGTERM, SIG_DFL);
+                    exit(smf_queue_resume(settings, q, key, smf_dict_get(envelopes, key), 
+                        smf_dict_get(modules, key)));
+                default:
+                    asprintf(&pid_str, "%d", (int)pid);
+                    smf_dict_set(pids, pid_str, key);
+                    free(pid_str);
+                    running++;
+                    break;
+            }
+            continue;
+        }
+
+        if (stop && (running == 0))
+            break;
+
+        if ((pid = waitpid(-1, &status, 0)) > 0) {
+            running--;
+            asprintf(&pid_str, "%d", (int)pid);
+            key = smf_dict_get(pids, pid_str);
+            free(pid_str);
+
+            if (!WIFEXITED(status) || (WEXITSTATUS(status) != RESUME_DONE)) {
+                TRACE(TRACE_WARNING,"worker [%d] didn't finish its message",pid);
+                failed++;
+            }
+
+            /* the message is done or belongs to the journal of the worker */
+            if ((key != NULL) && WIFEXITED(status) && 
+                    ((WEXITSTATUS(status) == RESUME_DONE) || (WEXITSTATUS(status) == RESUME_HALTED)))
+                smf_dict_remove(envelopes, key);
+            if ((key != NULL) && WIFEXITED(status) && (WEXITSTATUS(status) == RESUME_DONE))
+                smf_dict_remove(attempts, key);
+        } else if (errno == ECHILD) {
+            running = 0;
+        }
+    }
+
+    /* the messages, which haven't been processed, e.g. because the run has
+     * been interrupted, are carried over to a new journal, before the 
+     * journals they came from are removed */
+    if (smf_modules_journal_carry(settings, modules, envelopes, attempts) == 0) {
+        elem = smf_list_head(recovered);
+        while (elem != NULL) {
+            path = (char *)smf_list_data(elem);
+            if (unlink(path) != 0)
+                TRACE(TRACE_ERR,"failed to unlink module journal [%s]: %s (%d)",path,strerror(errno),errno);
+            elem = elem->next;
+        }
+    } else
+        TRACE(TRACE_ERR,"keeping %d orphaned journals",smf_list_size(recovered));
+
+    smf_list_free(keys);
+    smf_dict_free(modules);
+    smf_dict_free(envelopes);
+    smf_dict_free(finished);
+    smf_dict_free(attempts);
+    smf_dict_free(pids);
+    smf_list_free(recovered);
+    smf_list_free(journals);
+
+    return (failed > 0) ? -1 : 0;
+}
+
+int load(SMFSettings_T *settings) {
+    SMFProcessQueue_T *q;
+    struct sigaction action;
+    char *lock_path = NULL;
+    int workers, interval;
+    int lock_fd;
+    int ret = 0;
+
+    TRACE(TRACE_INFO,"starting queue runner");
+
+    workers = smf_settings_group_get_integer(settings, "queue", "workers");
+    if (workers <= 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0)
+        workers = 1;
+
+    interval = smf_settings_group_get_integer(settings, "queue", "interval");
+    if (interval < 0)
+        interval = 0;
+
+    /* only one runner may recover the queue */
+    asprintf(&lock_path, "%s/queue.lock", settings->queue_dir);
+    if ((lock_fd = open(lock_path, O_RDWR | O_CREAT, 0600)) == -1) {
+        TRACE(TRACE_ERR,"failed to open %s: %s (%d)",lock_path,strerror(errno),errno);
+        free(lock_path);
+        return(-1);
+    }
+    free(lock_path);
+
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        TRACE(TRACE_ERR,"queue directory [%s] is locked by another queue runner",settings->queue_dir);
+        close(lock_fd);
+        return(-1);
+    }
+
+    q = smf_modules_pqueue_init(
+        smf_queue_handle_q_error,
+        smf_queue_handle_q_processing_error,
+        smf_queue_handle_nexthop_error
+    );
+
+    if(q == NULL) {
+        TRACE(TRACE_ERR,"failed to initialize module queue");
+        close(lock_fd);
+        return(-1);
+    }
+
+    /* recovered messages, which are halted again, must be recorded */
+    settings->queue_recovery = 1;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = smf_queue_sig_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    /* with an interval the queue is scanned until a signal arrives, the 
+     * signal interrupts sleep() */
+    while (!stop) {
+        ret = smf_queue_run(settings, q, workers);
+        if (interval == 0)
+            break;
+        sleep(interval);
+    }
+
+    free(q);
+    close(lock_fd);
+
+    return ret;
+}
@@ -18,51 +18,121 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #include "smf_settings.h"
 #include "smf_trace.h"
 #include "smf_server.h"
 #include "smf_modules.h"
 #include "smf_settings_private.h"
+#include "smf_core.h"
 
 #define THIS_MODULE "server"
 
+/* state of a scoreboard slot */
+enum {
+    SLOT_FREE = 0,
+    SLOT_IDLE,   /* child waits for a connection */
+    SLOT_BUSY,   /* child handles a client */
+    SLOT_DYING   /* idle child has been asked to terminate */
+};
+
+/* state of a spool file in the group commit */
+enum {
+    SYNC_IDLE = 0,
+    SYNC_PENDING, /* waits for the next batch */
+    SYNC_DONE,
+    SYNC_FAILED,
+    SYNC_SELF     /* the leader couldn't open it, the child flushes itself */
+};
+
+typedef struct {
+    pid_t pid;
+    volatile int state;
+    int generation; /* config generation the child was forked with */
+    volatile int sync_state;
+    int sync_fd; /* spool file, as seen in the child */
+    int sync_ret;
+    int sync_errno;
+    char sync_path[PATH_MAX]; /* empty for an unnamed spool file */
+} SMFServerSlot_T;
+
+/* The scoreboard is shared between the master and all children. Children
+ * switch their own slot from idle to busy after accepting a connection,
+ * the master owns everything else, except the sync fields, which belong
+ * to the child and the current group commit leader. The idle counter is 
+ * only changed together with a successful state transition away from 
+ * SLOT_IDLE, so it can't drift. */
+typedef struct {
+    volatile int idle;
+    volatile int generation; /* bumped on every reload */
+    volatile unsigned int sync_seq; /* futex, bumped after every batch */
+    volatile pid_t sync_leader; /* child which currently flushes */
+    int num_slots;
+    SMFServerSlot_T slots[];
+} SMFServerScoreboard_T;
+
+/* environment of a new master started by a binary upgrade */
+#define LISTEN_FDS_ENV "SPMFILTER_LISTEN_FDS"
+#define UPGRADE_PID_ENV "SPMFILTER_UPGRADE_PID"
+
 int num_procs = 0;
-int num_clients = 0;
-int num_spare = 0;
 int daemon_exit = 0;
-int child[] = {};
+int daemon_reload = 0;
+int daemon_upgrade = 0;
+int daemon_drain = 0;
+
+static SMFServerScoreboard_T *scoreboard = NULL;
+static size_t scoreboard_size = 0;
+static int slot_index = -1; /* own slot in a child process */
+static int notify_pipe[2] = { -1, -1 }; /* children wake up the master */
+static char **saved_argv = NULL; /* command line for a binary upgrade */
+static char *saved_path = NULL;
+static pid_t upgrade_pid = 0; /* new master, which takes over our sockets */
+static pid_t predecessor = 0; /* old master, which handed over its sockets */
 
 void smf_server_sig_handler(int sig) {
-    /**
-     * - SIGUSR1 => child got a new client
-     * - SIGUSR2 => child client closes connections
-     */
     switch(sig) {
         case SIGTERM:
         case SIGINT:
             daemon_exit = 1;
             break;
-        case SIGUSR1:
-            num_clients++;
-            num_spare--;
+        case SIGHUP:
+            daemon_reload = 1;
             break;
         case SIGUSR2:
-            num_clients--;
+            daemon_upgrade = 1;
+            break;
+        case SIGQUIT:
+            daemon_drain = 1;
             break;
         default:
+            /* SIGCHLD only needs to interrupt poll() in the master */
             break;
     }
 
@@ -86,8 +156,8 @@ void smf_server_sig_init(void) {
         exit(EXIT_FAILURE);
     }
 
-    if (sigaction(SIGUSR1, &action, &old_action) < 0) {
-        TRACE(TRACE_ERR,"sigaction (SIGUSR1) failed: %s",strerror(errno));
+    if (sigaction(SIGHUP, &action, &old_action) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGHUP) failed: %s",strerror(errno));
         exit(EXIT_FAILURE);
     }
 
@@ -96,9 +166,275 @@ void smf_server_sig_init(void) {
         exit(EXIT_FAILURE);
     }
 
+    if (sigaction(SIGQUIT, &action, &old_action) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGQUIT) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGCHLD, &action, &old_action) < 0) {
+        TRACE(TRACE_ERR,"sigaction (SIGCHLD) failed: %s",strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 }
 
-void smf_server_init(SMFSettings_T *settings, int sd) {
+static int smf_server_scoreboard_init(int num_slots) {
+    scoreboard_size = sizeof(SMFServerScoreboard_T) + num_slots * sizeof(SMFServerSlot_T);
+    scoreboard = mmap(NULL, scoreboard_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (scoreboard == MAP_FAILED) {
+        TRACE(TRACE_ERR,"failed to map scoreboard: %s (%d)",strerror(errno),errno);
+        scoreboard = NULL;
+        return -1;
+    }
+
+    /* anonymous mappings are zero filled, all slots are SLOT_FREE */
+    scoreboard->num_slots = num_slots;
+
+    return 0;
+}
+
+/* called in the child after accept(), mark the own slot busy and
+ * wake up the master, so it can fork a replacement */
+static void smf_server_slot_busy(void) {
+    SMFServerSlot_T *slot = &scoreboard->slots[slot_index];
+    struct timespec ts = { 0, 0 };
+    sigset_t set;
+    char c = 0;
+
+    if (__sync_bool_compare_and_swap(&slot->state, SLOT_IDLE, SLOT_BUSY)) {
+        __sync_fetch_and_sub(&scoreboard->idle, 1);
+    } else {
+        /* the master retired this child while it accepted a connection,
+         * the idle counter has already been adjusted. Drop the pending
+         * SIGTERM and serve the client anyway. */
+        sigemptyset(&set);
+        sigaddset(&set, SIGTERM);
+        sigtimedwait(&set, NULL, &ts);
+        daemon_exit = 0;
+        slot->state = SLOT_BUSY;
+    }
+
+    write(notify_pipe[1], &c, 1);
+}
+
+/* called in the child when it is ready for the next connection, returns
+ * -1 if the child belongs to an outdated config generation and has to exit */
+static int smf_server_slot_idle(void) {
+    SMFServerSlot_T *slot = &scoreboard->slots[slot_index];
+
+    if (slot->generation != scoreboard->generation)
+        return -1;
+
+    __sync_fetch_and_add(&scoreboard->idle, 1);
+    slot->state = SLOT_IDLE;
+
+    return 0;
+}
+
+/* called in the master when a child has terminated */
+static void smf_server_slot_release(pid_t pid) {
+    int i;
+
+    for (i = 0; i < scoreboard->num_slots; i++) {
+        if (scoreboard->slots[i].pid == pid) {
+            /* the child died without ever handling a client */
+            if (__sync_bool_compare_and_swap(&scoreboard->slots[i].state, SLOT_IDLE, SLOT_FREE))
+                __sync_fetch_and_sub(&scoreboard->idle, 1);
+
+            scoreboard->slots[i].state = SLOT_FREE;
+            scoreboard->slots[i].sync_state = SYNC_IDLE;
+            scoreboard->slots[i].pid = 0;
+            num_procs--;
+            break;
+        }
+    }
+}
+
+/* terminate idle children, all == 0 retires one child, otherwise all
+ * idle children of an outdated config generation are retired */
+static void smf_server_retire(int all) {
+    SMFServerSlot_T *slot;
+    int i;
+
+    for (i = 0; i < scoreboard->num_slots; i++) {
+        slot = &scoreboard->slots[i];
+        if (all && slot->generation == scoreboard->generation)
+            continue;
+
+        if (slot->pid > 0 && __sync_bool_compare_and_swap(&slot->state, SLOT_IDLE, SLOT_DYING)) {
+            __sync_fetch_and_sub(&scoreboard->idle, 1);
+            TRACE(TRACE_DEBUG,"retiring idle child [%d]",slot->pid);
+            kill(slot->pid, SIGTERM);
+            if (!all)
+                break;
+        }
+    }
+}
+
+#ifdef __linux__
+/* length of the directory part of a path, including the slash */
+static size_t smf_server_dir_len(const char *path) {
+    const char *p = strrchr(path, '/');
+
+    return (p != NULL) ? p - path + 1 : 0;
+}
+
+static int smf_server_sync_dir(const char *path) {
+    char *dir = NULL;
+    size_t len = smf_server_dir_len(path);
+    int dfd;
+    int ret;
+
+    dir = (len > 0) ? strndup(path, len) : strdup(".");
+    if ((dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        free(dir);
+        return -1;
+    }
+
+    ret = fsync(dfd);
+    close(dfd);
+    free(dir);
+
+    return ret;
+}
+
+/* flush the spool files of all waiting children. The leader reopens 
+ * them through /proc, flushes each file and every directory once for
+ * the whole batch */
+static void smf_server_sync_batch(int full) {
+    SMFServerSlot_T *slot = NULL;
+    SMFServerSlot_T *prev = NULL;
+    char proc[64];
+    int *batch = NULL;
+    int *dirs = NULL;
+    int num = 0;
+    int i, j, fd;
+
+    if ((batch = malloc(2 * scoreboard->num_slots * sizeof(int))) != NULL)
+        dirs = batch + scoreboard->num_slots;
+
+    for (i = 0; i < scoreboard->num_slots; i++) {
+        slot = &scoreboard->slots[i];
+        if (slot->sync_state != SYNC_PENDING)
+            continue;
+
+        fd = slot->sync_fd;
+        if ((batch != NULL) && (i != slot_index)) {
+            snprintf(proc, sizeof(proc), "/proc/%d/fd/%d", slot->pid, slot->sync_fd);
+            fd = open(proc, O_RDONLY | O_CLOEXEC);
+        }
+
+        if ((batch == NULL) || (fd == -1)) {
+            __sync_bool_compare_and_swap(&slot->sync_state, SYNC_PENDING, SYNC_SELF);
+            continue;
+        }
+
+        slot->sync_ret = full ? fsync(fd) : fdatasync(fd);
+        slot->sync_errno = errno;
+        if (i != slot_index)
+            close(fd);
+
+        dirs[num] = 0;
+        batch[num++] = i;
+    }
+
+    /* the directory entries, which are shared by most of the files */
+    for (i = 0; full && (i < num); i++) {
+        slot = &scoreboard->slots[batch[i]];
+        if ((slot->sync_ret != 0) || (slot->sync_path[0] == '\0'))
+            continue;
+
+        for (j = 0; j < i; j++) {
+            prev = &scoreboard->slots[batch[j]];
+            if (dirs[j] && (smf_server_dir_len(prev->sync_path) == smf_server_dir_len(slot->sync_path)) &&
+                    (strncmp(prev->sync_path, slot->sync_path, smf_server_dir_len(slot->sync_path)) == 0))
+                break;
+        }
+
+        if (j < i) {
+            slot->sync_ret = prev->sync_ret;
+            slot->sync_errno = prev->sync_errno;
+        } else {
+            slot->sync_ret = smf_server_sync_dir(slot->sync_path);
+            slot->sync_errno = errno;
+            dirs[i] = 1;
+        }
+    }
+
+    for (i = 0; i < num; i++) {
+        slot = &scoreboard->slots[batch[i]];
+        __sync_bool_compare_and_swap(&slot->sync_state, SYNC_PENDING, 
+            (slot->sync_ret == 0) ? SYNC_DONE : SYNC_FAILED);
+    }
+
+    free(batch);
+}
+#endif
+
+/* Flush a spool file according to the configured policy. Concurrent 
+ * children share the flush: every child publishes its spool file in its
+ * scoreboard slot, one of them becomes the leader and flushes the files
+ * of all waiting children with fdatasync() (or fsync() and the 
+ * directories for "full"). The others sleep on a futex until the batch 
+ * is complete. */
+int smf_server_spool_sync(SMFSettings_T *settings, int fd, const char *path) {
+#ifdef __linux__
+    SMFServerSlot_T *slot = NULL;
+    struct timespec ts = { 1, 0 };
+    unsigned int seq;
+    pid_t leader;
+#endif
+    int full = (settings->spool_sync == SMF_SPOOL_SYNC_FULL);
+
+    if (settings->spool_sync == SMF_SPOOL_SYNC_NONE)
+        return 0;
+
+#ifdef __linux__
+    if ((scoreboard == NULL) || (slot_index < 0) || 
+            ((path != NULL) && (strlen(path) >= sizeof(slot->sync_path))))
+        return smf_core_spool_sync(fd, path, full);
+
+    slot = &scoreboard->slots[slot_index];
+    slot->sync_fd = fd;
+    strcpy(slot->sync_path, (path != NULL) ? path : "");
+    __sync_synchronize();
+    slot->sync_state = SYNC_PENDING;
+
+    for (;;) {
+        seq = scoreboard->sync_seq;
+        if (slot->sync_state != SYNC_PENDING)
+            break;
+
+        if (__sync_bool_compare_and_swap(&scoreboard->sync_leader, 0, getpid())) {
+            smf_server_sync_batch(full);
+            __sync_synchronize();
+            scoreboard->sync_leader = 0;
+            __sync_fetch_and_add(&scoreboard->sync_seq, 1);
+            syscall(SYS_futex, &scoreboard->sync_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+            continue;
+        }
+
+        /* take over if the leader died while flushing, the timeout 
+         * catches a leader, which died before waking us up */
+        leader = scoreboard->sync_leader;
+        if ((leader != 0) && (kill(leader, 0) == -1) && (errno == ESRCH))
+            __sync_bool_compare_and_swap(&scoreboard->sync_leader, leader, 0);
+        else
+            syscall(SYS_futex, &scoreboard->sync_seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+    }
+
+    switch (slot->sync_state) {
+        case SYNC_DONE:
+            return 0;
+        case SYNC_FAILED:
+            errno = slot->sync_errno;
+            return -1;
+    }
+#endif
+
+    return smf_core_spool_sync(fd, path, full);
+}
+
+void smf_server_init(SMFSettings_T *settings) {
     pid_t pid;
     FILE *pidfile;
     
@@ -107,8 +443,9 @@ void smf_server_init(SMFSettings_T *settings, int sd) {
    
     smf_server_sig_init();
 
-    /* switch to background */
-    if (settings->foreground == 0) {        
+    /* switch to background, a new master of a binary upgrade
+     * already runs detached */
+    if ((settings->foreground == 0) && (predecessor == 0)) {        
         switch( pid = fork()) {
             case -1:
                 TRACE(TRACE_ERR,"fork failed: %s",strerror(errno));
@@ -155,8 +492,8 @@ void smf_server_init(SMFSettings_T *settings, int sd) {
         }
     }
 
-    /* switch user */
-    if ((settings->user != NULL) && (settings->group != NULL)) {
+    /* switch user, unless an unprivileged master has been upgraded */
+    if ((settings->user != NULL) && (settings->group != NULL) && ((predecessor == 0) || (geteuid() == 0))) {
         TRACE(TRACE_DEBUG,"switching to user %s:%s",settings->user,settings->group);
         grp = getgrnam(settings->group);
 
@@ -183,162 +520,597 @@ void smf_server_init(SMFSettings_T *settings, int sd) {
     }
 }
 
-int smf_server_listen(SMFSettings_T *settings) {
-    int sd, reuseaddr;
-    int status = -1;
+/* prepare a freshly created listening socket */
+static int smf_server_listen_socket(SMFSettings_T *settings, int sd, struct sockaddr *addr, socklen_t addrlen) {
+    int reuseaddr = 1;
+    int v6only = 1;
+
+    if (addr->sa_family != AF_UNIX)
+        setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(int));
+
+    /* wildcard binds return :: and 0.0.0.0, don't let the IPv6 socket
+     * take the IPv4 port */
+    if (addr->sa_family == AF_INET6)
+        setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int));
+
+    /* children wait for the socket to become readable before
+     * accept(), another child may be faster */
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+    fcntl(sd, F_SETFD, FD_CLOEXEC);
+
+    if (bind(sd, addr, addrlen) != 0)
+        return -1;
+
+    return listen(sd, settings->listen_backlog);
+}
+
+static int smf_server_listen_inet(SMFSettings_T *settings, const char *host, int **sds, int *num_sds) {
+    int sd, status;
+    int bound = 0;
     struct addrinfo hints, *ai, *aptr;
     char *srvname = NULL;
 
-    assert(settings);
-
     memset(&hints,0,sizeof(hints));
     hints.ai_flags = AI_PASSIVE;
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    TRACE(TRACE_INFO,"binding to %s:%d",settings->bind_ip,settings->bind_port);
+    TRACE(TRACE_INFO,"binding to %s:%d",(host != NULL) ? host : "*",settings->bind_port);
 
     asprintf(&srvname,"%d",settings->bind_port);
-    if ((status == getaddrinfo(settings->bind_ip,srvname,&hints,&ai)) == 0) {
-        for (aptr = ai; aptr != NULL; aptr = aptr->ai_next) {
-            if ((sd = socket(aptr->ai_family,aptr->ai_socktype, aptr->ai_protocol)) < 0)
-                continue;
+    if ((status = getaddrinfo(host,srvname,&hints,&ai)) != 0) {
+        TRACE(TRACE_ERR,"getaddrinfo failed: %s",gai_strerror(status));
+        free(srvname);
+        return -1;
+    }
 
-            reuseaddr = 1;
-            setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(int));
+    for (aptr = ai; aptr != NULL; aptr = aptr->ai_next) {
+        if ((sd = socket(aptr->ai_family,aptr->ai_socktype, aptr->ai_protocol)) < 0)
+            continue;
 
-            if (bind(sd,aptr->ai_addr,aptr->ai_addrlen) == 0) {
-                if (listen(sd, settings->listen_backlog) >= 0)
-                    break;
-            }
+        if (smf_server_listen_socket(settings, sd, aptr->ai_addr, aptr->ai_addrlen) != 0) {
+            TRACE(TRACE_ERR,"can't listen on %s port %s: %s", (host != NULL) ? host : "*", srvname, strerror(errno));
             close(sd);
+            continue;
         }
 
-        freeaddrinfo(ai);
+        *sds = realloc(*sds, (*num_sds + 1) * sizeof(int));
+        (*sds)[(*num_sds)++] = sd;
+        bound++;
+    }
 
-        if (aptr == NULL) {
-            TRACE(TRACE_ERR,"can't listen on port %s: %s", srvname, strerror(errno));
-            return -1;
+    freeaddrinfo(ai);
+    free(srvname);
+
+    return (bound > 0) ? 0 : -1;
+}
+
+static int smf_server_listen_unix(SMFSettings_T *settings, int **sds, int *num_sds) {
+    struct sockaddr_un sun;
+    struct stat st;
+    int sd;
+
+    TRACE(TRACE_INFO,"binding to unix socket %s",settings->bind_unix);
+
+    if (strlen(settings->bind_unix) >= sizeof(sun.sun_path)) {
+        TRACE(TRACE_ERR,"unix socket path too long: %s",settings->bind_unix);
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, settings->bind_unix);
+
+    /* remove a stale socket of a previous run, but nothing else */
+    if ((lstat(settings->bind_unix, &st) == 0) && S_ISSOCK(st.st_mode))
+        unlink(settings->bind_unix);
+
+    if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        TRACE(TRACE_ERR,"failed to create unix socket: %s (%d)",strerror(errno),errno);
+        return -1;
+    }
+
+    if (smf_server_listen_socket(settings, sd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        TRACE(TRACE_ERR,"can't listen on %s: %s (%d)",settings->bind_unix,strerror(errno),errno);
+        close(sd);
+        return -1;
+    }
+
+    /* access is controlled by the permissions of the parent directory */
+    chmod(settings->bind_unix, 0666);
+
+    *sds = realloc(*sds, (*num_sds + 1) * sizeof(int));
+    (*sds)[(*num_sds)++] = sd;
+
+    return 0;
+}
+
+/* take over the listening sockets of the master, which started us
+ * for a binary upgrade */
+static int smf_server_listen_inherited(int **sds) {
+    char **fds = NULL;
+    char *env = NULL;
+    struct stat st;
+    int num_fds, sd, i;
+    int num_sds = 0;
+
+    env = getenv(LISTEN_FDS_ENV);
+    TRACE(TRACE_INFO,"taking over listening sockets %s",env);
+
+    fds = smf_core_strsplit(env, ",", &num_fds);
+    for (i = 0; i < num_fds; i++) {
+        sd = atoi(fds[i]);
+        free(fds[i]);
+
+        if ((fstat(sd, &st) != 0) || !S_ISSOCK(st.st_mode)) {
+            TRACE(TRACE_ERR,"inherited descriptor %d is not a socket",sd);
+            continue;
         }
-    } else {
-        TRACE(TRACE_ERR,"getaddrinfo failed: %s",gai_strerror(status));
+
+        fcntl(sd, F_SETFD, FD_CLOEXEC);
+        *sds = realloc(*sds, (num_sds + 1) * sizeof(int));
+        (*sds)[num_sds++] = sd;
+    }
+    free(fds);
+
+    if ((env = getenv(UPGRADE_PID_ENV)) != NULL)
+        predecessor = atoi(env);
+
+    unsetenv(LISTEN_FDS_ENV);
+    unsetenv(UPGRADE_PID_ENV);
+
+    if (num_sds == 0) {
+        free(*sds);
+        *sds = NULL;
         return -1;
     }
 
-    free(srvname);
+    return num_sds;
+}
+
+int smf_server_listen(SMFSettings_T *settings, int **sds) {
+    int num_sds = 0;
+    char **hosts = NULL;
+    char **p = NULL;
+    char *host = NULL;
+    int rc = 0;
 
-    return sd;
+    assert(settings);
+    assert(sds);
+
+    *sds = NULL;
+
+    if (getenv(LISTEN_FDS_ENV) != NULL)
+        return smf_server_listen_inherited(sds);
+
+    if (settings->bind_ip != NULL) {
+        hosts = smf_core_strsplit(settings->bind_ip, ";", NULL);
+        for (p = hosts; *p != NULL; p++) {
+            host = smf_core_strstrip(*p);
+            if ((strlen(host) > 0) && (smf_server_listen_inet(settings, host, sds, &num_sds) != 0))
+                rc = -1;
+            free(*p);
+        }
+        free(hosts);
+    } else if (settings->bind_unix == NULL) {
+        /* listen on all addresses */
+        rc = smf_server_listen_inet(settings, NULL, sds, &num_sds);
+    }
+
+    if ((rc == 0) && (settings->bind_unix != NULL))
+        rc = smf_server_listen_unix(settings, sds, &num_sds);
+
+    if ((rc != 0) || (num_sds == 0)) {
+        while (num_sds > 0)
+            close((*sds)[--num_sds]);
+        free(*sds);
+        *sds = NULL;
+        return -1;
+    }
+
+    return num_sds;
 }
 
-void smf_server_fork(SMFSettings_T *settings,int sd, SMFProcessQueue_T *q,
+void smf_server_fork(SMFSettings_T *settings,int *sds,int num_sds, SMFProcessQueue_T *q,
         void (*handle_client_func)(SMFSettings_T *settings,int client,SMFProcessQueue_T *q)) {
+    SMFServerSlot_T *slot = NULL;
     int pos = 0;
+    pid_t pid;
 
-    for (pos=0; pos < settings->max_childs; pos++) {
-        if (child[pos] == 0) {
+    for (pos=0; pos < scoreboard->num_slots; pos++) {
+        if (scoreboard->slots[pos].state == SLOT_FREE) {
+            slot = &scoreboard->slots[pos];
             break;
         }
     }
 
-    switch(child[pos] = fork()) {
+    if (slot == NULL) {
+        TRACE(TRACE_ERR,"no free scoreboard slot left");
+        return;
+    }
+
+    /* count the child as idle right away, otherwise the master would
+     * fork again before the child is up */
+    slot->generation = scoreboard->generation;
+    slot->state = SLOT_IDLE;
+    __sync_fetch_and_add(&scoreboard->idle, 1);
+
+    switch(pid = fork()) {
         case -1:
             TRACE(TRACE_ERR,"fork() failed: %s",strerror(errno));
-            break;
+            __sync_fetch_and_sub(&scoreboard->idle, 1);
+            slot->state = SLOT_FREE;
+            return;
         case 0:
+            slot_index = pos;
+            close(notify_pipe[0]);
+            signal(SIGCHLD, SIG_DFL);
+            signal(SIGHUP, SIG_IGN);
+            signal(SIGUSR2, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
 
-            smf_server_accept_handler(settings,sd,q,handle_client_func);
+            smf_server_accept_handler(settings,sds,num_sds,q,handle_client_func);
             
             exit(EXIT_SUCCESS); /* quit child process */
             break;
         default: /* parent process: go on with accept */
-            TRACE(TRACE_DEBUG,"forked child [%d]",child[pos]);
+            slot->pid = pid;
+            TRACE(TRACE_DEBUG,"forked child [%d]",pid);
             break;
     }
     num_procs++;
 }
 
-void smf_server_loop(SMFSettings_T *settings,int sd, SMFProcessQueue_T *q,
+void smf_server_set_argv(char **argv) {
+    saved_argv = argv;
+
+    /* the daemon changes its working directory */
+    if (strchr(argv[0], '/') != NULL)
+        saved_path = realpath(argv[0], NULL);
+    else
+        saved_path = strdup(argv[0]);
+}
+
+/* Start a new master from the binary on disk, which inherits the
+ * listening sockets. Once its children are running, the new master sends
+ * SIGQUIT and we drain. */
+static void smf_server_upgrade(int *sds, int num_sds) {
+    char *fds = NULL;
+    char *tmp = NULL;
+    char *ppid = NULL;
+    sigset_t empty;
+    pid_t pid;
+    int i;
+
+    if (upgrade_pid > 0) {
+        TRACE(TRACE_WARNING,"binary upgrade already in progress");
+        return;
+    }
+
+    if ((saved_argv == NULL) || (saved_path == NULL)) {
+        TRACE(TRACE_ERR,"binary upgrade not possible, command line unknown");
+        return;
+    }
+
+    switch (pid = fork()) {
+        case -1:
+            TRACE(TRACE_ERR,"fork() failed: %s",strerror(errno));
+            return;
+        case 0:
+            for (i = 0; i < num_sds; i++) {
+                fcntl(sds[i], F_SETFD, 0);
+                asprintf(&tmp, "%s%s%d", (fds != NULL) ? fds : "", (fds != NULL) ? "," : "", sds[i]);
+                free(fds);
+                fds = tmp;
+            }
+            asprintf(&ppid, "%d", getppid());
+            setenv(LISTEN_FDS_ENV, fds, 1);
+            setenv(UPGRADE_PID_ENV, ppid, 1);
+
+            sigemptyset(&empty);
+            sigprocmask(SIG_SETMASK, &empty, NULL);
+
+            execvp(saved_path, saved_argv);
+            TRACE(TRACE_ERR,"failed to execute %s: %s (%d)",saved_path,strerror(errno),errno);
+            _exit(EXIT_FAILURE);
+        default:
+            upgrade_pid = pid;
+            TRACE(TRACE_NOTICE,"binary upgrade, started new master [%d]",pid);
+            break;
+    }
+}
+
+/* Re-read the config file and roll the children over to it. Children of
+ * the previous generation finish their current session, idle ones are
+ * terminated as soon as replacements are running. */
+static void smf_server_reload(SMFSettings_T *settings,int *sds,int num_sds, SMFProcessQueue_T *q,
         void (*handle_client_func)(SMFSettings_T *settings,int client,SMFProcessQueue_T *q)) {
-    int i, status;
+    int i, n, ret;
+
+    if ((ret = smf_settings_reload(settings)) == -2) {
+        TRACE(TRACE_ERR, "no modules loaded after failed reload, shutting down");
+        daemon_exit = 1;
+    }
+    if (ret != 0)
+        return;
+
+    __sync_fetch_and_add(&scoreboard->generation, 1);
+
+    n = (settings->spare_childs > 0) ? settings->spare_childs : 1;
+    if (n > settings->max_childs - num_procs)
+        n = settings->max_childs - num_procs;
+
+    for (i = 0; i < n; i++)
+        smf_server_fork(settings,sds,num_sds,q,handle_client_func);
+
+    smf_server_retire(1);
+
+    TRACE(TRACE_NOTICE, "configuration reloaded, generation %d", scoreboard->generation);
+}
+
+void smf_server_loop(SMFSettings_T *settings,int *sds,int num_sds, SMFProcessQueue_T *q,
+        void (*handle_client_func)(SMFSettings_T *settings,int client,SMFProcessQueue_T *q)) {
+    int i, status, idle, n;
+    int min_spare, max_spare;
+    int spawn_rate = 1;
+    int at_limit = 0;
+    int draining = 0;
+    struct pollfd pfd;
+    char buf[64];
     pid_t pid;
 
     TRACE(TRACE_NOTICE, "smf_server is starting");
 
-    for(i=0; i<settings->max_childs; i++)
-        child[i] = 0;
+    if (smf_server_scoreboard_init(settings->max_childs) != 0)
+        exit(EXIT_FAILURE);
 
-    /* prefork min. 1 child(s) */
-    if(settings->spare_childs == 0) {
-        smf_server_fork(settings,sd,q,handle_client_func);
-    } else {
-        for (i = 0; i < settings->spare_childs; i++) {
-            num_spare++;
-            smf_server_fork(settings,sd,q,handle_client_func);
-        }
+    if (pipe(notify_pipe) != 0) {
+        TRACE(TRACE_ERR,"failed to create notify pipe: %s (%d)",strerror(errno),errno);
+        exit(EXIT_FAILURE);
     }
+    fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(notify_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(notify_pipe[1], F_SETFD, FD_CLOEXEC);
 
-    for (;;) {
-        pid = waitpid(-1, &status, 0);
+    pfd.fd = notify_pipe[0];
+    pfd.events = POLLIN;
 
+    for (;;) {
         if (daemon_exit)
             break;
-        
-        if (pid > 0) {
 
-            for (i=0; i < settings->max_childs; i++) {
-                if (pid == child[i]) {
-                    child[i] = 0; /* remove process id */
-                    num_procs--;
-                    break;
-                }
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            if ((upgrade_pid > 0) && (pid == upgrade_pid)) {
+                TRACE(TRACE_ERR,"new master [%d] exited before taking over, binary upgrade failed",pid);
+                upgrade_pid = 0;
+            } else
+                smf_server_slot_release(pid);
+        }
+
+        if (daemon_drain) {
+            /* stop accepting and wait until the remaining sessions are
+             * finished, children of an outdated generation exit as soon
+             * as they are idle */
+            if (!draining) {
+                TRACE(TRACE_NOTICE,"draining %d child processes",num_procs);
+                for (i = 0; i < num_sds; i++)
+                    close(sds[i]);
+                __sync_fetch_and_add(&scoreboard->generation, 1);
+                draining = 1;
+            }
+
+            smf_server_retire(1);
+            if (num_procs == 0)
+                break;
+
+            poll(&pfd, 1, 1000);
+            continue;
+        }
+
+        if (daemon_upgrade) {
+            daemon_upgrade = 0;
+            smf_server_upgrade(sds,num_sds);
+        }
+
+        if (daemon_reload) {
+            daemon_reload = 0;
+            smf_server_reload(settings,sds,num_sds,q,handle_client_func);
+            if (daemon_exit)
+                break;
+        }
+
+        /* keep min. 1 idle child */
+        min_spare = (settings->spare_childs > 0) ? settings->spare_childs : 1;
+        max_spare = (settings->max_spare_childs > min_spare) ? settings->max_spare_childs : min_spare;
+
+        idle = scoreboard->idle;
+        if (idle < min_spare) {
+            /* fork spawn_rate children per round and double the rate as
+             * long as there are too few idle children */
+            n = spawn_rate;
+            if (n > max_spare - idle)
+                n = max_spare - idle;
+            if (n > settings->max_childs - num_procs)
+                n = settings->max_childs - num_procs;
+
+            if (n <= 0) {
+                if (!at_limit)
+                    TRACE(TRACE_WARNING,"max_childs limit of %d processes reached",settings->max_childs);
+                at_limit = 1;
+            } else {
+                at_limit = 0;
+                TRACE(TRACE_DEBUG,"%d idle children, forking %d",idle,n);
+                for (i = 0; i < n; i++)
+                    smf_server_fork(settings,sds,num_sds,q,handle_client_func);
             }
+
+            if (spawn_rate < settings->max_spawn_rate)
+                spawn_rate *= 2;
+            if (spawn_rate > settings->max_spawn_rate)
+                spawn_rate = (settings->max_spawn_rate > 0) ? settings->max_spawn_rate : 1;
+        } else {
+            spawn_rate = 1;
+            at_limit = 0;
+
+            if (idle > max_spare)
+                smf_server_retire(0);
         }
 
-        if (num_procs < settings->max_childs) {
-            /* minimal number of childs is not running */
-            while (num_spare < settings->spare_childs) {
-                smf_server_fork(settings,sd,q,handle_client_func);
-                num_spare++;
-            }      
+        /* tell the old master that we are ready */
+        if ((predecessor > 0) && (num_procs > 0)) {
+            TRACE(TRACE_NOTICE,"taking over from master [%d]",predecessor);
+            kill(predecessor, SIGQUIT);
+            predecessor = 0;
         }
+
+        /* sleep until a child got a client, a child terminated or
+         * a second passed */
+        if (poll(&pfd, 1, 1000) > 0)
+            while (read(notify_pipe[0], buf, sizeof(buf)) > 0)
+                ;
     }
 
     TRACE(TRACE_NOTICE, "smf_server is going down");
 	
-    close(sd);
+    if (!draining)
+        for (i = 0; i < num_sds; i++)
+            close(sds[i]);
+
+    /* the unix socket and pid file belong to the new master now */
+    if ((settings->bind_unix != NULL) && (upgrade_pid == 0))
+        unlink(settings->bind_unix);
+
+    for (i = 0; i < scoreboard->num_slots; i++)
+        if (scoreboard->slots[i].pid > 0)
+            kill(scoreboard->slots[i].pid,SIGTERM);
+
+    /* a new master of a binary upgrade is our child, too */
+    while ((num_procs > 0) && ((pid = wait(NULL)) > 0))
+        if (pid != upgrade_pid)
+            smf_server_slot_release(pid);
+
+    munmap(scoreboard, scoreboard_size);
+    close(notify_pipe[0]);
+    close(notify_pipe[1]);
+
+    if ((settings->pid_file != NULL) && (upgrade_pid == 0))
+        unlink(settings->pid_file);
+}
+
+/* Create an epoll instance which wakes up only this child, among all
+ * children waiting on the listening sockets, when a connection comes in.
+ * Returns -1 if EPOLLEXCLUSIVE is disabled or not supported. */
+static int smf_server_exclusive_wait_init(SMFSettings_T *settings, int *sds, int num_sds) {
+#ifdef EPOLLEXCLUSIVE
+    struct epoll_event ev;
+    int ep, i;
+
+    if (!settings->accept_exclusive)
+        return -1;
+
+    if ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        TRACE(TRACE_ERR,"epoll_create1 failed: %s (%d)",strerror(errno),errno);
+        return -1;
+    }
 
-    for (i = 0; i < settings->max_childs; i++)
-        if (child[i] > 0)
-            kill(child[i],SIGTERM);
-    while(wait(NULL) > 0)
-        ;
+    for (i = 0; i < num_sds; i++) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.fd = sds[i];
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, sds[i], &ev) != 0) {
+            TRACE(TRACE_DEBUG,"EPOLLEXCLUSIVE not supported, using poll(): %s (%d)",strerror(errno),errno);
+            close(ep);
+            return -1;
+        }
+    }
 
-    unlink(settings->pid_file);
+    return ep;
+#else
+    return -1;
+#endif
 }
 
-void smf_server_accept_handler(SMFSettings_T *settings, int sd, SMFProcessQueue_T *q, 
+void smf_server_accept_handler(SMFSettings_T *settings, int *sds, int num_sds, SMFProcessQueue_T *q, 
         void (*handle_client_func)(SMFSettings_T *settings,int client,SMFProcessQueue_T *q)) {
-    int client;
+    int client, rc, i;
+    int ep, sd;
     socklen_t slen;
     struct sockaddr_storage sa;
+    struct pollfd *pfds;
+    struct epoll_event ev;
+    sigset_t block, orig;
+
+    /* SIGTERM is only delivered while waiting for a connection, so an
+     * idle child can't be terminated after it accepted a client */
+    sigemptyset(&block);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGINT);
+    sigprocmask(SIG_BLOCK, &block, &orig);
+
+    pfds = calloc(num_sds, sizeof(struct pollfd));
+    for (i = 0; i < num_sds; i++) {
+        pfds[i].fd = sds[i];
+        pfds[i].events = POLLIN;
+    }
+    ep = smf_server_exclusive_wait_init(settings, sds, num_sds);
 
     /* process incoming connection in an infinite loop */
     for (;;) {
-        slen = sizeof(sa);
+        if (ep >= 0)
+            rc = epoll_pwait(ep, &ev, 1, -1, &orig);
+        else
+            rc = ppoll(pfds, num_sds, NULL, &orig);
 
-        /* accept new connection */
-        if ((client = accept(sd, (struct sockaddr *)&sa, &slen)) < 0) {
+        if (rc < 0) {
             if (daemon_exit)
                 break;
 
             if (errno != EINTR) {
+                TRACE(TRACE_ERR,"poll failed: %s",strerror(errno));
+            }
+            continue;
+        }
+
+        if (daemon_exit)
+            break;
+
+        if (ep >= 0) {
+            sd = ev.data.fd;
+        } else {
+            sd = -1;
+            for (i = 0; i < num_sds; i++) {
+                if (pfds[i].revents & POLLIN) {
+                    sd = pfds[i].fd;
+                    break;
+                }
+            }
+            if (sd < 0)
+                continue;
+        }
+
+        slen = sizeof(sa);
+
+        /* accept new connection */
+        if ((client = accept(sd, (struct sockaddr *)&sa, &slen)) < 0) {
+            if ((errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != ECONNABORTED)) {
                 TRACE(TRACE_ERR,"accept failed: %s",strerror(errno));
             }
             continue;
         }
+
+        smf_server_slot_busy();
+        sigprocmask(SIG_SETMASK, &orig, NULL);
+
         handle_client_func(settings,client,q);
         close(client);
+
+        sigprocmask(SIG_BLOCK, &block, NULL);
+        if (smf_server_slot_idle() != 0)
+            break;
     }
 
+    if (ep >= 0)
+        close(ep);
+    free(pfds);
 }
-
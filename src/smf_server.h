@@ -25,15 +25,18 @@ typedef void (*handle_client_func)(SMFSettings_T *settings,int client,SMFProcess
 
 void smf_server_sig_init(void);
 void smf_server_sig_handler(int sig);
-void smf_server_init(SMFSettings_T *settings, int sd);
-int smf_server_listen(SMFSettings_T *settings);
-void smf_server_fork(SMFSettings_T *settings,int sd,SMFProcessQueue_T *q,
+void smf_server_set_argv(char **argv);
+void smf_server_init(SMFSettings_T *settings);
+int smf_server_listen(SMFSettings_T *settings, int **sds);
+void smf_server_fork(SMFSettings_T *settings,int *sds,int num_sds,SMFProcessQueue_T *q,
     void (*handle_client_func)(SMFSettings_T *settings,int client,SMFProcessQueue_T *q));
-void smf_server_loop(SMFSettings_T *settings,int sd,SMFProcessQueue_T *q,
+void smf_server_loop(SMFSettings_T *settings,int *sds,int num_sds,SMFProcessQueue_T *q,
     void (*handle_client_func)(SMFSettings_T *settings,int client,SMFProcessQueue_T *q));
+int smf_server_spool_sync(SMFSettings_T *settings, int fd, const char *path);
 void smf_server_accept_handler(
     SMFSettings_T *settings, 
-    int sd, 
+    int *sds, 
+    int num_sds, 
     SMFProcessQueue_T *q,
     void (*handle_client_func)(SMFSettings_T *settings,int client,SMFProcessQueue_T *q));
 
@@ -17,8 +17,15 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/time.h>
 
+#include "smf_core.h"
 #include "smf_envelope.h"
 #include "smf_trace.h"
 #include "smf_session.h"
@@ -39,6 +46,7 @@ SMFSession_T *smf_session_new(void) {
     session->message_file = NULL;
     session->message_size = 0;
     session->response_msg = NULL;
+    session->spans = NULL;
     session->envelope = smf_envelope_new();
 
     /* generate session id */
@@ -75,6 +83,9 @@ void smf_session_free(SMFSession_T *session) {
     if (session->id!=NULL)
         free(session->id);
 
+    if (session->spans != NULL)
+        smf_list_free(session->spans);
+
     free(session);
 }
 
@@ -161,3 +172,133 @@ char *smf_session_get_id(SMFSession_T *session) {
 
     return session->id;
 }
+
+static void _span_destroy(void *data) {
+    SMFSessionSpan_T *span = (SMFSessionSpan_T *)data;
+    free(span->name);
+    free(span);
+}
+
+static double _span_offset(struct timeval *t, struct timeval *base) {
+    return (double)(t->tv_sec - base->tv_sec) + (double)(t->tv_usec - base->tv_usec) / 1000000.0;
+}
+
+/* append s to out and escape it for a JSON string */
+static void _json_escape(char **out, const char *s) {
+    for (; *s != '\0'; s++) {
+        if ((*s == '"') || (*s == '\\'))
+            smf_core_strcat_printf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            smf_core_strcat_printf(out, "\\u%04x", (unsigned char)*s);
+        else
+            smf_core_strcat_printf(out, "%c", *s);
+    }
+}
+
+void smf_session_enable_timing(SMFSession_T *session) {
+    assert(session);
+
+    if (session->spans != NULL)
+        return;
+
+    if (smf_list_new(&session->spans, _span_destroy) != 0) {
+        STRACE(TRACE_ERR, session->id, "failed to create span list");
+        session->spans = NULL;
+        return;
+    }
+
+    smf_session_span_begin(session, "session");
+}
+
+SMFSessionSpan_T *smf_session_span_begin(SMFSession_T *session, const char *fmt, ...) {
+    SMFSessionSpan_T *span = NULL;
+    va_list ap;
+
+    assert(session);
+    assert(fmt);
+
+    if (session->spans == NULL)
+        return NULL;
+
+    if ((span = (SMFSessionSpan_T *)calloc(1, sizeof(SMFSessionSpan_T))) == NULL)
+        return NULL;
+
+    va_start(ap, fmt);
+    if (vasprintf(&span->name, fmt, ap) == -1) {
+        va_end(ap);
+        free(span);
+        return NULL;
+    }
+    va_end(ap);
+
+    gettimeofday(&span->start, NULL);
+    smf_list_append(session->spans, span);
+
+    return span;
+}
+
+void smf_session_span_end(SMFSessionSpan_T *span) {
+    if (span == NULL)
+        return;
+
+    gettimeofday(&span->end, NULL);
+}
+
+int smf_session_timing_write(SMFSession_T *session, const char *path) {
+    SMFListElem_T *elem = NULL;
+    SMFSessionSpan_T *span = NULL;
+    SMFSessionSpan_T *first = NULL;
+    struct timeval now;
+    char *line = NULL;
+    int fd;
+    int ret = 0;
+
+    assert(session);
+    assert(path);
+
+    if ((session->spans == NULL) || (smf_list_size(session->spans) == 0))
+        return 0;
+
+    gettimeofday(&now, NULL);
+    first = (SMFSessionSpan_T *)smf_list_data(smf_list_head(session->spans));
+
+    if (asprintf(&line, "{\"session\":\"%s\",\"start\":%ld.%06ld,\"spans\":[",
+            session->id, (long)first->start.tv_sec, (long)first->start.tv_usec) == -1)
+        return -1;
+
+    elem = smf_list_head(session->spans);
+    while(elem != NULL) {
+        span = (SMFSessionSpan_T *)smf_list_data(elem);
+        if (!timerisset(&span->end))
+            span->end = now;
+
+        smf_core_strcat_printf(&line, "%s{\"name\":\"", (elem == smf_list_head(session->spans)) ? "" : ",");
+        _json_escape(&line, span->name);
+        smf_core_strcat_printf(&line, "\",\"offset\":%.6f,\"duration\":%.6f}",
+            _span_offset(&span->start, &first->start),
+            _span_offset(&span->end, &span->start));
+        elem = elem->next;
+    }
+    smf_core_strcat_printf(&line, "]}\n");
+
+    if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1) {
+        STRACE(TRACE_ERR, session->id, "failed to open timing log %s: %s (%d)", path, strerror(errno), errno);
+        ret = -1;
+    } else {
+        /* a single write to an O_APPEND descriptor keeps concurrent
+         * writers from interleaving their records */
+        if (write(fd, line, strlen(line)) != (ssize_t)strlen(line)) {
+            STRACE(TRACE_ERR, session->id, "failed to write timing log %s: %s (%d)", path, strerror(errno), errno);
+            ret = -1;
+        }
+        close(fd);
+    }
+    free(line);
+
+    /* start over with an empty span list */
+    smf_list_free(session->spans);
+    session->spans = NULL;
+    smf_session_enable_timing(session);
+
+    return ret;
+}
@@ -32,7 +32,21 @@
 #ifndef _SMF_SESSION_H
 #define _SMF_SESSION_H
 
+#include <sys/time.h>
+
 #include "smf_envelope.h"
+#include "smf_list.h"
+
+/*!
+ * @struct SMFSessionSpan_T
+ * @brief A timed phase of a session, e.g. the SMTP dialog for HELO or
+ *        the invocation of a module
+ */
+typedef struct {
+    char *name; /**< name of the span */
+    struct timeval start; /**< time the span was started */
+    struct timeval end; /**< time the span was finished, zero while still open */
+} SMFSessionSpan_T;
 
 /*!
  * @struct SMFSession_T 
@@ -47,6 +61,7 @@ typedef struct {
     char *response_msg; /**< custom response message */
     int sock; /**< socket */
     char *id; /**< session id **/
+    SMFList_T *spans; /**< timing spans, NULL if timing is disabled */
 } SMFSession_T;
 
 /*!
@@ -144,4 +159,40 @@ char *smf_session_get_message_file(SMFSession_T *session);
  */
 char *smf_session_get_id(SMFSession_T *session);
 
+/*!
+ * @fn void smf_session_enable_timing(SMFSession_T *session)
+ * @brief Start recording timing spans for the session. Without this call
+ *        all span functions are no-ops.
+ * @param session SMFSession_T object
+ */
+void smf_session_enable_timing(SMFSession_T *session);
+
+/*!
+ * @fn SMFSessionSpan_T *smf_session_span_begin(SMFSession_T *session, const char *fmt, ...)
+ * @brief Open a new timing span
+ * @param session SMFSession_T object
+ * @param fmt format string for the span name
+ * @param ... format arguments
+ * @returns the opened span or NULL, if timing is disabled for the session
+ */
+SMFSessionSpan_T *smf_session_span_begin(SMFSession_T *session, const char *fmt, ...);
+
+/*!
+ * @fn void smf_session_span_end(SMFSessionSpan_T *span)
+ * @brief Close a timing span
+ * @param span the span returned by smf_session_span_begin(), may be NULL
+ */
+void smf_session_span_end(SMFSessionSpan_T *span);
+
+/*!
+ * @fn int smf_session_timing_write(SMFSession_T *session, const char *path)
+ * @brief Append all recorded spans of the session as one JSON line to the
+ *        given file and reset the span list. Spans, which are still open,
+ *        are closed.
+ * @param session SMFSession_T object
+ * @param path path to the timing log
+ * @returns 0 on success or -1 in case of error
+ */
+int smf_session_timing_write(SMFSession_T *session, const char *path);
+
 #endif  /* _SMF_SESSION_H */
@@ -28,6 +28,7 @@
 #include <sys/stat.h>
 #include <syslog.h>
 
+#include "spmfilter_config.h"
 #include "smf_trace.h"
 #include "smf_settings.h"
 #include "smf_settings_private.h"
@@ -36,6 +37,7 @@
 #include "smf_core.h"
 #include "smf_internal.h"
 #include "smf_modules.h"
+#include "smf_lookup.h"
 
 #define MAX_LINE 200
 
@@ -271,6 +273,64 @@ void _set_config_value(SMFSettings_T **settings, char *section, char *key, char
             (*settings)->lookup_persistent = _get_boolean(val);
         } else if (strcmp(key,"syslog_facility")==0) {
             smf_settings_set_syslog_facility((*settings), val);
+        /** [global]timing_log **/
+        } else if (strcmp(key,"timing_log")==0) {
+            if ((*settings)->timing_log != NULL)
+                free((*settings)->timing_log);
+
+            (*settings)->timing_log = strdup(val);
+        /** [global]max_spare_childs **/
+        } else if (strcmp(key,"max_spare_childs")==0) {
+            (*settings)->max_spare_childs = _get_integer(val);
+        /** [global]max_spawn_rate **/
+        } else if (strcmp(key,"max_spawn_rate")==0) {
+            (*settings)->max_spawn_rate = _get_integer(val);
+        /** [global]accept_exclusive **/
+        } else if (strcmp(key,"accept_exclusive")==0) {
+            (*settings)->accept_exclusive = _get_boolean(val);
+        /** [global]bind_unix **/
+        } else if (strcmp(key,"bind_unix")==0) {
+            if ((*settings)->bind_unix != NULL)
+                free((*settings)->bind_unix);
+
+            (*settings)->bind_unix = strdup(val);
+        /** [global]queue_hash_depth **/
+        } else if (strcmp(key,"queue_hash_depth")==0) {
+            (*settings)->queue_hash_depth = _get_integer(val);
+            if ((*settings)->queue_hash_depth < 0)
+                (*settings)->queue_hash_depth = 0;
+            else if ((*settings)->queue_hash_depth > 4)
+                (*settings)->queue_hash_depth = 4;
+        /** [global]spool_sync **/
+        } else if (strcmp(key,"spool_sync")==0) {
+            /** check allowed values... */
+            if (strcasecmp(val, "none")==0)
+                (*settings)->spool_sync = SMF_SPOOL_SYNC_NONE;
+            else if (strcasecmp(val, "data")==0)
+                (*settings)->spool_sync = SMF_SPOOL_SYNC_DATA;
+            else if (strcasecmp(val, "full")==0)
+                (*settings)->spool_sync = SMF_SPOOL_SYNC_FULL;
+            else
+                TRACE(TRACE_WARNING, "invalid spool_sync value [%s], ignoring", val);
+        /** [global]module_timeout **/
+        } else if (strcmp(key,"module_timeout")==0) {
+            (*settings)->module_timeout = _get_integer(val);
+            if ((*settings)->module_timeout < 0)
+                (*settings)->module_timeout = 0;
+        /** [global]module_timeout_action **/
+        } else if (strcmp(key,"module_timeout_action")==0) {
+            /** check allowed values... */
+            if (strcasecmp(val, "tempfail")==0)
+                (*settings)->module_timeout_action = SMF_MODULE_TIMEOUT_TEMPFAIL;
+            else if (strcasecmp(val, "skip")==0)
+                (*settings)->module_timeout_action = SMF_MODULE_TIMEOUT_SKIP;
+            else if (strcasecmp(val, "continue")==0)
+                (*settings)->module_timeout_action = SMF_MODULE_TIMEOUT_CONTINUE;
+            else
+                TRACE(TRACE_WARNING, "invalid module_timeout_action value [%s], ignoring", val);
+        /** [global]queue_recovery **/
+        } else if (strcmp(key,"queue_recovery")==0) {
+            (*settings)->queue_recovery = _get_boolean(val);
         }
     /** sql section **/
     } else if (strcmp(section,"sql")==0) {
@@ -410,6 +470,12 @@ void _set_config_value(SMFSettings_T **settings, char *section, char *key, char
             (*settings)->nexthop_fail_code = _get_integer(val);
         } else if (strcmp(key, "smtpd_timeout")==0) {
             (*settings)->smtpd_timeout = _get_integer(val);
+        /** [smtpd]capture_dir **/
+        } else if (strcmp(key, "capture_dir")==0) {
+            if ((*settings)->capture_dir != NULL)
+                free((*settings)->capture_dir);
+
+            (*settings)->capture_dir = strdup(val);
         /** smtp code **/
         } else {
             i = _get_integer(key);
@@ -456,9 +522,20 @@ SMFSettings_T *smf_settings_new(void) {
     settings->spare_childs = 2;
     settings->lookup_persistent = 0;
     settings->syslog_facility = LOG_MAIL;
+    settings->timing_log = NULL;
+    settings->max_spare_childs = 10;
+    settings->max_spawn_rate = 32;
+    settings->accept_exclusive = 1;
+    settings->bind_unix = NULL;
+    settings->queue_hash_depth = 0;
+    settings->spool_sync = SMF_SPOOL_SYNC_NONE;
+    settings->module_timeout = 0;
+    settings->module_timeout_action = SMF_MODULE_TIMEOUT_TEMPFAIL;
+    settings->queue_recovery = 0;
 
     settings->smtp_codes = smf_dict_new();
     settings->smtpd_timeout = 300;
+    settings->capture_dir = NULL;
 
     settings->sql_driver = NULL;
     settings->sql_name = NULL;
@@ -520,6 +597,9 @@ void smf_settings_free(SMFSettings_T *settings) {
     if (settings->bind_ip != NULL) free(settings->bind_ip);
     if (settings->user != NULL) free(settings->user);
     if (settings->group != NULL) free(settings->group);
+    if (settings->timing_log != NULL) free(settings->timing_log);
+    if (settings->capture_dir != NULL) free(settings->capture_dir);
+    if (settings->bind_unix != NULL) free(settings->bind_unix);
 
     smf_dict_free(settings->smtp_codes);
     if (settings->sql_driver) free(settings->sql_driver);
@@ -544,6 +624,251 @@ void smf_settings_free(SMFSettings_T *settings) {
     free(settings);
 }
 
+/* restore the previous value of a string setting, which can't be changed
+ * without a restart, after a reload */
+static void _keep_string(char **val, char **prev, const char *name) {
+    char *t;
+
+    if (((*val == NULL) != (*prev == NULL)) || ((*val != NULL) && (strcmp(*val, *prev) != 0)))
+        TRACE(TRACE_WARNING, "config value %s changed, restart required", name);
+
+    t = *val;
+    *val = *prev;
+    *prev = t;
+}
+
+static void _keep_integer(int *val, int *prev, const char *name) {
+    if (*val != *prev) {
+        TRACE(TRACE_WARNING, "config value %s changed, restart required", name);
+        *val = *prev;
+    }
+}
+
+static int _str_changed(const char *val, const char *prev) {
+    return ((val == NULL) != (prev == NULL)) || ((val != NULL) && (strcmp(val, prev) != 0));
+}
+
+static int _list_changed(SMFList_T *val, SMFList_T *prev) {
+    SMFListElem_T *a = smf_list_head(val);
+    SMFListElem_T *b = smf_list_head(prev);
+
+    while ((a != NULL) && (b != NULL)) {
+        if (_str_changed((char *)smf_list_data(a), (char *)smf_list_data(b)))
+            return 1;
+        a = a->next;
+        b = b->next;
+    }
+
+    return (a != b);
+}
+
+/* the lookup connection has to be established again, if one of the 
+ * options it has been made with changed */
+static int _lookup_changed(SMFSettings_T *val, SMFSettings_T *prev) {
+    return _str_changed(val->backend, prev->backend) ||
+        (val->lookup_persistent != prev->lookup_persistent) ||
+        _str_changed(val->sql_driver, prev->sql_driver) ||
+        _str_changed(val->sql_name, prev->sql_name) ||
+        _list_changed(val->sql_host, prev->sql_host) ||
+        (val->sql_port != prev->sql_port) ||
+        _str_changed(val->sql_user, prev->sql_user) ||
+        _str_changed(val->sql_pass, prev->sql_pass) ||
+        _str_changed(val->sql_encoding, prev->sql_encoding) ||
+        (val->sql_max_connections != prev->sql_max_connections) ||
+        _str_changed(val->ldap_uri, prev->ldap_uri) ||
+        _list_changed(val->ldap_host, prev->ldap_host) ||
+        (val->ldap_port != prev->ldap_port) ||
+        _str_changed(val->ldap_binddn, prev->ldap_binddn) ||
+        _str_changed(val->ldap_bindpw, prev->ldap_bindpw) ||
+        (val->ldap_referrals != prev->ldap_referrals);
+}
+
+static void _lookup_disconnect(SMFSettings_T *settings) {
+    if ((settings->backend == NULL) || (settings->lookup_connection == NULL))
+        return;
+
+#ifdef HAVE_LDAP
+    if (strcmp(settings->backend,"ldap") == 0)
+        smf_lookup_ldap_disconnect(settings);
+#endif
+
+#ifdef HAVE_ZDB
+    if (strcmp(settings->backend,"sql") == 0)
+        smf_lookup_sql_disconnect(settings);
+#endif
+}
+
+static void _lookup_connect(SMFSettings_T *settings) {
+    if ((settings->backend == NULL) || (settings->lookup_persistent != 1))
+        return;
+
+#ifdef HAVE_LDAP
+    if ((strcmp(settings->backend,"ldap") == 0) && (smf_lookup_ldap_connect(settings) != 0))
+        TRACE(TRACE_ERR, "unable to establish lookup connection");
+#endif
+
+#ifdef HAVE_ZDB
+    if ((strcmp(settings->backend,"sql") == 0) && (smf_lookup_sql_connect(settings) != 0))
+        TRACE(TRACE_ERR, "unable to establish lookup connection");
+#endif
+}
+
+static char **_module_names(SMFList_T *modules, int *num) {
+    SMFListElem_T *elem = NULL;
+    char **names = NULL;
+    int i = 0;
+
+    *num = smf_list_size(modules);
+    names = calloc(*num + 1, sizeof(char *));
+    elem = smf_list_head(modules);
+    while (elem != NULL) {
+        names[i++] = strdup(((SMFModule_T *)smf_list_data(elem))->name);
+        elem = elem->next;
+    }
+
+    return names;
+}
+
+static void _module_names_free(char **names) {
+    char **p;
+
+    for (p = names; *p != NULL; p++)
+        free(*p);
+    free(names);
+}
+
+/* load all modules into a new list, returns NULL if one of them fails */
+static SMFList_T *_load_modules(char **names, int num) {
+    SMFList_T *modules = NULL;
+    SMFModule_T *mod = NULL;
+    int i;
+
+    if (smf_list_new(&modules,_mod_list_destroy) != 0) {
+        TRACE(TRACE_ERR,"failed to create modules list");
+        return NULL;
+    }
+
+    for (i = 0; i < num; i++) {
+        if ((mod = smf_module_create(names[i])) == NULL) {
+            smf_list_free(modules);
+            return NULL;
+        }
+
+        if (smf_list_append(modules, mod) != 0) {
+            smf_module_destroy(mod);
+            smf_list_free(modules);
+            return NULL;
+        }
+    }
+
+    return modules;
+}
+
+int smf_settings_reload(SMFSettings_T *settings) {
+    SMFSettings_T *other = NULL;
+    SMFSettings_T tmp;
+    SMFListElem_T *elem = NULL;
+    SMFModule_T *mod = NULL;
+    SMFList_T *modules = NULL;
+    char **names = NULL;
+    char **prev_names = NULL;
+    int num_names, num_prev;
+    int ret = -1;
+
+    assert(settings);
+
+    TRACE(TRACE_NOTICE, "reloading %s", settings->config_file);
+
+    if ((other = smf_settings_new()) == NULL)
+        return -1;
+
+    if (smf_settings_parse_config(&other, settings->config_file) != 0) {
+        TRACE(TRACE_ERR, "failed to reload %s, keeping current settings", settings->config_file);
+        smf_settings_free(other);
+        return -1;
+    }
+
+    elem = smf_list_head(other->modules);
+    while (elem != NULL) {
+        mod = (SMFModule_T *)smf_list_data(elem);
+        if ((mod->type == 0) && (mod->u.handle == NULL)) {
+            TRACE(TRACE_ERR, "failed to reload %s, keeping current settings", settings->config_file);
+            smf_settings_free(other);
+            return -1;
+        }
+        elem = elem->next;
+    }
+
+    /* modules which are configured before and after the reload are still
+     * mapped, because dlopen() returns the same handle for a path that is
+     * already loaded. Unload all modules and load them again, so that an
+     * updated module is picked up. If one of them fails now, the previous
+     * modules are loaded again. */
+    names = _module_names(other->modules, &num_names);
+    prev_names = _module_names(settings->modules, &num_prev);
+
+    smf_list_free(other->modules);
+    smf_list_free(settings->modules);
+    other->modules = NULL;
+    settings->modules = NULL;
+
+    if ((modules = _load_modules(names, num_names)) == NULL) {
+        TRACE(TRACE_ERR, "failed to reload %s, keeping current settings", settings->config_file);
+
+        /* without any module the messages would pass unfiltered, the
+         * caller has to give up */
+        if ((settings->modules = _load_modules(prev_names, num_prev)) == NULL) {
+            TRACE(TRACE_ERR, "failed to restore previous modules");
+            smf_list_new(&settings->modules,_mod_list_destroy);
+            ret = -2;
+        }
+
+        smf_list_new(&other->modules,_mod_list_destroy);
+        _module_names_free(names);
+        _module_names_free(prev_names);
+        smf_settings_free(other);
+        return ret;
+    }
+
+    /* the previous modules are already unloaded */
+    other->modules = modules;
+    smf_list_new(&settings->modules,_mod_list_destroy);
+    _module_names_free(names);
+    _module_names_free(prev_names);
+
+    /* swap contents, settings now holds the reloaded values and other
+     * the previous ones, which are freed below */
+    tmp = *settings;
+    *settings = *other;
+    *other = tmp;
+
+    _keep_string(&settings->engine, &other->engine, "engine");
+    _keep_string(&settings->bind_ip, &other->bind_ip, "bind_ip");
+    _keep_string(&settings->bind_unix, &other->bind_unix, "bind_unix");
+    _keep_string(&settings->pid_file, &other->pid_file, "pid_file");
+    _keep_string(&settings->user, &other->user, "user");
+    _keep_string(&settings->group, &other->group, "group");
+    _keep_integer(&settings->bind_port, &other->bind_port, "bind_port");
+    _keep_integer(&settings->listen_backlog, &other->listen_backlog, "listen_backlog");
+    _keep_integer(&settings->max_childs, &other->max_childs, "max_childs");
+    _keep_integer(&settings->foreground, &other->foreground, "foreground");
+
+    /* keep the established lookup connection, unless the backend options
+     * changed */
+    if (_lookup_changed(settings, other)) {
+        TRACE(TRACE_NOTICE, "lookup backend options changed, reconnecting");
+        _lookup_disconnect(other);
+        _lookup_connect(settings);
+    } else {
+        settings->lookup_connection = other->lookup_connection;
+        other->lookup_connection = NULL;
+    }
+
+    smf_settings_free(other);
+
+    return 0;
+}
+
 int smf_settings_parse_config(SMFSettings_T **settings, char *alternate_file) {
     FILE *in = NULL;
     char line[MAX_LINE+1];
@@ -748,6 +1073,16 @@ int smf_settings_parse_config(SMFSettings_T **settings, char *alternate_file) {
     TRACE(TRACE_DEBUG, "settings->spare_childs: [%d]", (*settings)->spare_childs);
     TRACE(TRACE_DEBUG, "settings->lookup_persistent: [%d]", (*settings)->lookup_persistent);
     TRACE(TRACE_DEBUG, "settings->syslog_facility: [%d]", (*settings)->syslog_facility);
+    TRACE(TRACE_DEBUG, "settings->timing_log: [%s]", (*settings)->timing_log);
+    TRACE(TRACE_DEBUG, "settings->max_spare_childs: [%d]", (*settings)->max_spare_childs);
+    TRACE(TRACE_DEBUG, "settings->max_spawn_rate: [%d]", (*settings)->max_spawn_rate);
+    TRACE(TRACE_DEBUG, "settings->accept_exclusive: [%d]", (*settings)->accept_exclusive);
+    TRACE(TRACE_DEBUG, "settings->bind_unix: [%s]", (*settings)->bind_unix);
+    TRACE(TRACE_DEBUG, "settings->queue_hash_depth: [%d]", (*settings)->queue_hash_depth);
+    TRACE(TRACE_DEBUG, "settings->spool_sync: [%d]", (*settings)->spool_sync);
+    TRACE(TRACE_DEBUG, "settings->module_timeout: [%d]", (*settings)->module_timeout);
+    TRACE(TRACE_DEBUG, "settings->module_timeout_action: [%d]", (*settings)->module_timeout_action);
+    TRACE(TRACE_DEBUG, "settings->queue_recovery: [%d]", (*settings)->queue_recovery);
 
     TRACE(TRACE_DEBUG, "settings->sql_driver: [%s]", (*settings)->sql_driver);
     TRACE(TRACE_DEBUG, "settings->sql_name: [%s]", (*settings)->sql_name);
@@ -786,6 +1121,7 @@ int smf_settings_parse_config(SMFSettings_T **settings, char *alternate_file) {
     TRACE(TRACE_DEBUG, "settings->nexthop_fail_code: [%d]", (*settings)->nexthop_fail_code);
     TRACE(TRACE_DEBUG, "settings->nexthop_fail_msg: [%s]", (*settings)->nexthop_fail_msg);
     TRACE(TRACE_DEBUG, "settings->smtpd_timeout: [%d]\n", (*settings)->smtpd_timeout);
+    TRACE(TRACE_DEBUG, "settings->capture_dir: [%s]", (*settings)->capture_dir);
 
     list = smf_dict_get_keys((*settings)->smtp_codes);
     elem = smf_list_head(list);
@@ -1451,6 +1787,128 @@ int smf_settings_get_lookup_persistent(SMFSettings_T *settings) {
     return settings->lookup_persistent;
 }
 
+void smf_settings_set_timing_log(SMFSettings_T *settings, char *path) {
+    assert(settings);
+    assert(path);
+
+    if (settings->timing_log != NULL) free(settings->timing_log);
+
+    settings->timing_log = strdup(path);
+}
+
+char *smf_settings_get_timing_log(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->timing_log;
+}
+
+void smf_settings_set_capture_dir(SMFSettings_T *settings, char *dir) {
+    assert(settings);
+    assert(dir);
+
+    if (settings->capture_dir != NULL) free(settings->capture_dir);
+
+    settings->capture_dir = strdup(dir);
+}
+
+char *smf_settings_get_capture_dir(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->capture_dir;
+}
+
+void smf_settings_set_max_spare_childs(SMFSettings_T *settings, int max_spare_childs) {
+    assert(settings);
+    settings->max_spare_childs = max_spare_childs;
+}
+
+int smf_settings_get_max_spare_childs(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->max_spare_childs;
+}
+
+void smf_settings_set_max_spawn_rate(SMFSettings_T *settings, int max_spawn_rate) {
+    assert(settings);
+    settings->max_spawn_rate = max_spawn_rate;
+}
+
+int smf_settings_get_max_spawn_rate(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->max_spawn_rate;
+}
+
+void smf_settings_set_accept_exclusive(SMFSettings_T *settings, int accept_exclusive) {
+    assert(settings);
+    settings->accept_exclusive = accept_exclusive;
+}
+
+int smf_settings_get_accept_exclusive(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->accept_exclusive;
+}
+
+void smf_settings_set_bind_unix(SMFSettings_T *settings, char *path) {
+    assert(settings);
+    assert(path);
+
+    if (settings->bind_unix != NULL) free(settings->bind_unix);
+
+    settings->bind_unix = strdup(path);
+}
+
+char *smf_settings_get_bind_unix(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->bind_unix;
+}
+
+void smf_settings_set_queue_hash_depth(SMFSettings_T *settings, int depth) {
+    assert(settings);
+    settings->queue_hash_depth = depth;
+}
+
+int smf_settings_get_queue_hash_depth(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->queue_hash_depth;
+}
+
+void smf_settings_set_spool_sync(SMFSettings_T *settings, SMFSpoolSync_T s) {
+    assert(settings);
+    settings->spool_sync = s;
+}
+
+SMFSpoolSync_T smf_settings_get_spool_sync(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->spool_sync;
+}
+
+void smf_settings_set_module_timeout(SMFSettings_T *settings, int timeout) {
+    assert(settings);
+    settings->module_timeout = (timeout > 0) ? timeout : 0;
+}
+
+int smf_settings_get_module_timeout(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->module_timeout;
+}
+
+void smf_settings_set_module_timeout_action(SMFSettings_T *settings, SMFModuleTimeoutAction_T action) {
+    assert(settings);
+    settings->module_timeout_action = action;
+}
+
+SMFModuleTimeoutAction_T smf_settings_get_module_timeout_action(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->module_timeout_action;
+}
+
+void smf_settings_set_queue_recovery(SMFSettings_T *settings, int recovery) {
+    assert(settings);
+    settings->queue_recovery = recovery ? 1 : 0;
+}
+
+int smf_settings_get_queue_recovery(SMFSettings_T *settings) {
+    assert(settings);
+    return settings->queue_recovery;
+}
+
 char *smf_settings_group_get(SMFSettings_T *settings, char *group_name, char *key) {
     char *tmp = NULL;
     char *s = NULL;
@@ -1478,6 +1936,9 @@ int smf_settings_group_get_integer(SMFSettings_T *settings, char *group_name, ch
     s = smf_dict_get(settings->groups,tmp);
     free(tmp);
 
+    if (s == NULL)
+        return 0;
+
     return _get_integer(s);
 }
 
@@ -1493,6 +1954,9 @@ int smf_settings_group_get_boolean(SMFSettings_T *settings, char *group_name, ch
     s = smf_dict_get(settings->groups,tmp);
     free(tmp);
 
+    if (s == NULL)
+        return 0;
+
     return _get_boolean(s);
 }
 
@@ -49,6 +49,26 @@ typedef enum {
     SMF_LDAP_CONN /**< LDAP connection */
 } SMFConnectionType_T;
 
+/*!
+ * @enum SMFSpoolSync_T
+ * @brief Durability policy of spool files
+ */
+typedef enum {
+    SMF_SPOOL_SYNC_NONE, /**< leave flushing to the operating system */
+    SMF_SPOOL_SYNC_DATA, /**< flush message data before the message is accepted */
+    SMF_SPOOL_SYNC_FULL /**< flush message data and directory entry */
+} SMFSpoolSync_T;
+
+/*!
+ * @enum SMFModuleTimeoutAction_T
+ * @brief What to do with a module, which exceeds its deadline
+ */
+typedef enum {
+    SMF_MODULE_TIMEOUT_TEMPFAIL, /**< abandon the module and fail temporarily */
+    SMF_MODULE_TIMEOUT_SKIP, /**< abandon the module and go on with the next one */
+    SMF_MODULE_TIMEOUT_CONTINUE /**< only log the timeout and keep waiting */
+} SMFModuleTimeoutAction_T;
+
 /*!
  * @struct SMFSettings_T smf_settings.h
  * @brief Holds spmfilter runtime configuration 
@@ -79,7 +99,7 @@ typedef struct {
     SMFTlsOption_T tls; /**< enable/disable TLS */
     char *lib_dir; /**< user defined directory path for shared libraries */
     char *pid_file; /**< path to pid file */
-    char *bind_ip; /**< ip to bind daemon */
+    char *bind_ip; /**< ip to bind daemon, multiple addresses are separated by a semicolon */
     int bind_port; /**< port to bind daemon (default 10025) */
     int listen_backlog; /**< listen queue backlog (default 511) */
     int foreground; /**< run daemon in foreground */
@@ -88,9 +108,20 @@ typedef struct {
     int max_childs; /**< maximum number of allowed processes (default 10) */
     int spare_childs; /**< number of spare childs (default 2) */
     int syslog_facility; /**< syslog facility **/
+    char *timing_log; /**< path to the per-session timing log, disabled if NULL */
+    int max_spare_childs; /**< maximum number of idle child processes (default 10) */
+    int max_spawn_rate; /**< maximum number of child processes forked at once (default 32) */
+    int accept_exclusive; /**< wake only one idle child per connection (default true) */
+    char *bind_unix; /**< path of the unix domain socket to listen on, disabled if NULL */
+    int queue_hash_depth; /**< number of hashed subdirectory levels below queue_dir (0-4, default 0) */
+    SMFSpoolSync_T spool_sync; /**< durability of spool files (default none) */
+    int module_timeout; /**< time budget of a module in seconds, 0 = unlimited (default 0) */
+    SMFModuleTimeoutAction_T module_timeout_action; /**< action for a module, which exceeds its time budget (default tempfail) */
+    int queue_recovery; /**< journal the envelope of every message, so the queue runner can recover it (default false) */
 
     SMFDict_T *smtp_codes; /**< user defined smtp return codes */
     int smtpd_timeout; /**< time limit for receiving a remote SMTP client request (default 300s) */
+    char *capture_dir; /**< directory for smtpd session captures, disabled if NULL */
 
     char *sql_driver; /**< sql driver name */
     char *sql_name; /**< sql database name */
@@ -405,7 +436,7 @@ char *smf_settings_get_pid_file(SMFSettings_T *settings);
  * @fn void smf_settings_set_bind_ip(SMFSettings_T *settings, char *ip)
  * @brief Set bind ip 
  * @param settings a SMFSettings_T object
- * @param ip char pointer with ip 
+ * @param ip char pointer with ip, multiple addresses are separated by a semicolon
  */
 void smf_settings_set_bind_ip(SMFSettings_T *settings, char *ip);
 
@@ -894,6 +925,182 @@ void smf_settings_set_lookup_persistent(SMFSettings_T *settings, int persistent)
  */
 int smf_settings_get_lookup_persistent(SMFSettings_T *settings);
 
+/*!
+ * @fn void smf_settings_set_timing_log(SMFSettings_T *settings, char *path)
+ * @brief Set path to the per-session timing log
+ * @param settings a SMFSettings_T object
+ * @param path path to the timing log
+ */
+void smf_settings_set_timing_log(SMFSettings_T *settings, char *path);
+
+/*!
+ * @fn char *smf_settings_get_timing_log(SMFSettings_T *settings)
+ * @brief Get path to the per-session timing log
+ * @param settings a SMFSettings_T object
+ * @returns path to the timing log
+ */
+char *smf_settings_get_timing_log(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_capture_dir(SMFSettings_T *settings, char *dir)
+ * @brief Set the directory where the smtpd engine records the client dialogue of every connection
+ * @param settings a SMFSettings_T object
+ * @param dir path to the capture directory
+ */
+void smf_settings_set_capture_dir(SMFSettings_T *settings, char *dir);
+
+/*!
+ * @fn char *smf_settings_get_capture_dir(SMFSettings_T *settings)
+ * @brief Get the smtpd capture directory
+ * @param settings a SMFSettings_T object
+ * @returns path to the capture directory
+ */
+char *smf_settings_get_capture_dir(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_max_spare_childs(SMFSettings_T *settings, int max_spare_childs)
+ * @brief Set the maximum number of idle child processes
+ * @param settings a SMFSettings_T object
+ * @param max_spare_childs number of idle processes
+ */
+void smf_settings_set_max_spare_childs(SMFSettings_T *settings, int max_spare_childs);
+
+/*!
+ * @fn int smf_settings_get_max_spare_childs(SMFSettings_T *settings)
+ * @brief Get the maximum number of idle child processes
+ * @param settings a SMFSettings_T object
+ * @returns number of idle processes
+ */
+int smf_settings_get_max_spare_childs(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_max_spawn_rate(SMFSettings_T *settings, int max_spawn_rate)
+ * @brief Set the maximum number of child processes forked in one round
+ * @param settings a SMFSettings_T object
+ * @param max_spawn_rate number of processes
+ */
+void smf_settings_set_max_spawn_rate(SMFSettings_T *settings, int max_spawn_rate);
+
+/*!
+ * @fn int smf_settings_get_max_spawn_rate(SMFSettings_T *settings)
+ * @brief Get the maximum number of child processes forked in one round
+ * @param settings a SMFSettings_T object
+ * @returns number of processes
+ */
+int smf_settings_get_max_spawn_rate(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_accept_exclusive(SMFSettings_T *settings, int accept_exclusive)
+ * @brief Define if idle children wait for connections with EPOLLEXCLUSIVE
+ * @param settings a SMFSettings_T object
+ * @param accept_exclusive 1 to enable, 0 to use plain poll()
+ */
+void smf_settings_set_accept_exclusive(SMFSettings_T *settings, int accept_exclusive);
+
+/*!
+ * @fn int smf_settings_get_accept_exclusive(SMFSettings_T *settings)
+ * @brief Check if idle children wait for connections with EPOLLEXCLUSIVE
+ * @param settings a SMFSettings_T object
+ * @returns 1 to enable, 0 to use plain poll()
+ */
+int smf_settings_get_accept_exclusive(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_bind_unix(SMFSettings_T *settings, char *path)
+ * @brief Set the path of the unix domain socket the daemon listens on
+ * @param settings a SMFSettings_T object
+ * @param path path to the unix domain socket
+ */
+void smf_settings_set_bind_unix(SMFSettings_T *settings, char *path);
+
+/*!
+ * @fn char *smf_settings_get_bind_unix(SMFSettings_T *settings)
+ * @brief Get the path of the unix domain socket the daemon listens on
+ * @param settings a SMFSettings_T object
+ * @returns path to the unix domain socket
+ */
+char *smf_settings_get_bind_unix(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_queue_hash_depth(SMFSettings_T *settings, int depth)
+ * @brief Set number of hashed subdirectory levels below queue_dir
+ * @param settings a SMFSettings_T object
+ * @param depth number of subdirectory levels
+ */
+void smf_settings_set_queue_hash_depth(SMFSettings_T *settings, int depth);
+
+/*!
+ * @fn int smf_settings_get_queue_hash_depth(SMFSettings_T *settings)
+ * @brief Get number of hashed subdirectory levels below queue_dir
+ * @param settings a SMFSettings_T object
+ * @returns number of subdirectory levels
+ */
+int smf_settings_get_queue_hash_depth(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_spool_sync(SMFSettings_T *settings, SMFSpoolSync_T s)
+ * @brief Set durability policy of spool files
+ * @param settings a SMFSettings_T object
+ * @param s durability policy
+ */
+void smf_settings_set_spool_sync(SMFSettings_T *settings, SMFSpoolSync_T s);
+
+/*!
+ * @fn SMFSpoolSync_T smf_settings_get_spool_sync(SMFSettings_T *settings)
+ * @brief Get durability policy of spool files
+ * @param settings a SMFSettings_T object
+ * @returns durability policy
+ */
+SMFSpoolSync_T smf_settings_get_spool_sync(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_module_timeout(SMFSettings_T *settings, int timeout)
+ * @brief Set time budget of a module
+ * @param settings a SMFSettings_T object
+ * @param timeout time budget in seconds, 0 means unlimited
+ */
+void smf_settings_set_module_timeout(SMFSettings_T *settings, int timeout);
+
+/*!
+ * @fn int smf_settings_get_module_timeout(SMFSettings_T *settings)
+ * @brief Get time budget of a module
+ * @param settings a SMFSettings_T object
+ * @returns time budget in seconds
+ */
+int smf_settings_get_module_timeout(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_module_timeout_action(SMFSettings_T *settings, SMFModuleTimeoutAction_T action)
+ * @brief Set action for a module, which exceeds its time budget
+ * @param settings a SMFSettings_T object
+ * @param action timeout action
+ */
+void smf_settings_set_module_timeout_action(SMFSettings_T *settings, SMFModuleTimeoutAction_T action);
+
+/*!
+ * @fn SMFModuleTimeoutAction_T smf_settings_get_module_timeout_action(SMFSettings_T *settings)
+ * @brief Get action for a module, which exceeds its time budget
+ * @param settings a SMFSettings_T object
+ * @returns timeout action
+ */
+SMFModuleTimeoutAction_T smf_settings_get_module_timeout_action(SMFSettings_T *settings);
+
+/*!
+ * @fn void smf_settings_set_queue_recovery(SMFSettings_T *settings, int recovery)
+ * @brief Enable recovery of messages, which are left behind by a died process
+ * @param settings a SMFSettings_T object
+ * @param recovery 1 to enable, 0 to disable
+ */
+void smf_settings_set_queue_recovery(SMFSettings_T *settings, int recovery);
+
+/*!
+ * @fn int smf_settings_get_queue_recovery(SMFSettings_T *settings)
+ * @brief Check if messages of a died process are recovered
+ * @param settings a SMFSettings_T object
+ * @returns 1 if enabled, 0 if disabled
+ */
+int smf_settings_get_queue_recovery(SMFSettings_T *settings);
+
 /*!
  * @fn char *smf_settings_group_get(SMFSettings_T *settings, char *group_name, char *key)
  * @brief Returns the raw value associated with key under the selected group.
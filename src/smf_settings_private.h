@@ -35,4 +35,22 @@ void smf_settings_free(SMFSettings_T *settings);
 
 int smf_settings_parse_config(SMFSettings_T **settings, char *alternate_file);
 
+/** re-read the config file of a running daemon
+ *
+ * Parses settings->config_file again and replaces the values of settings
+ * in place. All modules are unloaded and loaded again. Settings bound to
+ * the running process (engine, listeners, pid file, user, group,
+ * max_childs, foreground) and the lookup connection are kept, a changed
+ * value is logged. If the config file can't be parsed or a module can't
+ * be loaded, settings remain untouched. If the previous modules can't be
+ * loaded again either, settings are left without modules and -2 is
+ * returned, the process must not handle any message anymore.
+ *
+ * \param settings SMFSettings_T object
+ *
+ * \returns 0 on success, -1 in case of error or -2 if the previous 
+ *          modules are lost
+ */
+int smf_settings_reload(SMFSettings_T *settings);
+
 #endif	/* _SMF_SETTINGS_PRIVATE_H */
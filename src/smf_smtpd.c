@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/times.h>
+#include <sys/time.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -32,6 +33,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <regex.h>
+#include <limits.h>
 
 #include "spmfilter_config.h"
 #include "smf_smtpd.h"
@@ -52,6 +54,10 @@
 
 int client_sock = 0;
 
+/* capture file of the current connection, see smf_smtpd_capture_open() */
+static FILE *capture_fh = NULL;
+static struct timeval capture_start;
+
 void smf_smtpd_sig_handler(int sig) {
     if (sig == SIGALRM) {
         char *hostname = NULL;
@@ -64,7 +70,6 @@ void smf_smtpd_sig_handler(int sig) {
     }
 
     TRACE(TRACE_NOTICE, "terminating child %i", getpid());
-    kill(getppid(),SIGUSR2);
     exit(0);
 }
 
@@ -127,6 +132,80 @@ static int smf_smtpd_handle_nexthop_error(SMFSettings_T *settings, SMFSession_T
     return 0;
 }
 
+/* create a new session for the connected client */
+static SMFSession_T *smf_smtpd_session_new(SMFSettings_T *settings, int client) {
+    SMFSession_T *session = smf_session_new();
+
+    session->sock = client;
+    if (settings->timing_log != NULL)
+        smf_session_enable_timing(session);
+
+    return session;
+}
+
+/* Start recording the client dialogue to <capture_dir>/<session id>.cap.
+ * The file starts with the line "spmfilter-capture 1 <start>", followed by
+ * one record per client line: "<offset> <length>\n" and the raw line,
+ * where start and offset are seconds with microsecond precision. */
+static void smf_smtpd_capture_open(SMFSettings_T *settings, SMFSession_T *session) {
+    char *path = NULL;
+    int fd;
+
+    if (settings->capture_dir == NULL)
+        return;
+
+    asprintf(&path, "%s/%s.cap", settings->capture_dir, session->id);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1) {
+        STRACE(TRACE_ERR,session->id,"failed to open capture file %s: %s (%d)",path,strerror(errno),errno);
+        free(path);
+        return;
+    }
+
+    if ((capture_fh = fdopen(fd, "w")) == NULL) {
+        STRACE(TRACE_ERR,session->id,"failed to open capture file %s: %s (%d)",path,strerror(errno),errno);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    STRACE(TRACE_DEBUG,session->id,"capturing client dialog to %s",path);
+    free(path);
+
+    gettimeofday(&capture_start, NULL);
+    fprintf(capture_fh, "spmfilter-capture 1 %ld.%06ld\n",
+        (long)capture_start.tv_sec, (long)capture_start.tv_usec);
+}
+
+/* append a line received from the client to the capture file */
+static void smf_smtpd_capture(const char *buf, size_t len) {
+    struct timeval now, offset;
+
+    if (capture_fh == NULL)
+        return;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &capture_start, &offset);
+
+    fprintf(capture_fh, "%ld.%06ld %zu\n", (long)offset.tv_sec, (long)offset.tv_usec, len);
+    fwrite(buf, sizeof(char), len, capture_fh);
+}
+
+static void smf_smtpd_capture_close(void) {
+    if (capture_fh == NULL)
+        return;
+
+    fclose(capture_fh);
+    capture_fh = NULL;
+}
+
+/* write the timing record, if enabled, and destroy the session */
+static void smf_smtpd_session_free(SMFSettings_T *settings, SMFSession_T *session) {
+    if (settings->timing_log != NULL)
+        smf_session_timing_write(session, settings->timing_log);
+
+    smf_session_free(session);
+}
+
 int smf_smtpd_process_modules(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q) {
     int ret;
     /* now tun the process queue */
@@ -150,6 +229,41 @@ int smf_smtpd_process_modules(SMFSession_T *session, SMFSettings_T *settings, SM
     return(0);
 }
 
+/* reply to the envelope and data hooks of the modules, returns 1 if the
+ * sender, recipient or message has been refused */
+static int smf_smtpd_hook_reply(SMFSettings_T *settings, SMFSession_T *session, int ret) {
+    char *code_str = NULL;
+    char *msg = NULL;
+
+    if (ret == 0)
+        return 0;
+
+    if (ret == -1) {
+        switch (settings->module_fail) {
+            case 1: return 0;
+            case 2: ret = 552;
+                    break;
+            default: ret = 451;
+                    break;
+        }
+        smf_smtpd_code_reply(session->sock,ret,settings->smtp_codes);
+    } else {
+        asprintf(&code_str,"%d",ret);
+        if ((msg = session->response_msg) == NULL)
+            msg = smf_dict_get(settings->smtp_codes,code_str);
+        free(code_str);
+
+        smf_smtpd_string_reply(session->sock,"%d %s\r\n",ret,
+            msg != NULL ? msg : "Requested action not taken");
+    }
+
+    /* the text belongs to this reply only */
+    free(session->response_msg);
+    session->response_msg = NULL;
+
+    return 1;
+}
+
 char *smf_smtpd_get_req_value(char *req, int jmp) {
     char *p = NULL;
     char *r = NULL;
@@ -165,6 +279,43 @@ char *smf_smtpd_get_req_value(char *req, int jmp) {
     return smf_core_strstrip(r);
 }
 
+/* cut the ESMTP parameters off a MAIL FROM value, returns the message
+ * size declared with SIZE= (RFC 1870), 0 if none was given, LONG_MAX if
+ * the size is too large to be represented or -1 if the parameter is 
+ * invalid */
+static long smf_smtpd_mail_params(char *value) {
+    char *p = NULL;
+    char *end = NULL;
+    long size = 0;
+
+    /* parameters follow the address, separated by spaces */
+    p = strchr(value, '>');
+    p = (p != NULL) ? p + 1 : value;
+    if ((p = strpbrk(p, " \t")) == NULL)
+        return 0;
+
+    *p++ = '\0';
+    while ((p = strcasestr(p, "SIZE=")) != NULL) {
+        /* only whole parameters, no XSIZE= or similar */
+        if ((p[-1] == ' ') || (p[-1] == '\t') || (p[-1] == '\0')) {
+            errno = 0;
+            size = strtol(p + 5, &end, 10);
+            if ((end == p + 5) || (size < 0) || 
+                    ((*end != '\0') && (*end != ' ') && (*end != '\t')))
+                return -1;
+            /* a size, which overflows long, exceeds every limit (RFC 1870) */
+            if (errno == ERANGE)
+                return LONG_MAX;
+            if (errno != 0)
+                return -1;
+            return size;
+        }
+        p += 5;
+    }
+
+    return 0;
+}
+
 /* dot-stuffing */
 void smf_smtpd_stuffing(char chain[]) {
     int i, j;
@@ -179,34 +330,42 @@ void smf_smtpd_stuffing(char chain[]) {
     chain[j]='\0';
 }
 
+#define discard_and_return(stream) \
+    { \
+        fclose(stream); \
+        if (tmpname != NULL) { \
+            unlink(tmpname); \
+            free(tmpname); \
+        } \
+        return -1; \
+    }
+
 #define fputs_or_return(s, stream) \
     if (fputs(s, stream)<=0) { \
         STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno); \
-        fclose(stream); \
-        return -1; \
+        discard_and_return(stream); \
     }
 
-int smf_smtpd_append_missing_headers(SMFSession_T *session, char *queue_dir, int mid, int to, int from, int date, int headers, char *nl) {
+int smf_smtpd_append_missing_headers(SMFSession_T *session, char *queue_dir, FILE **spool_file, int mid, int to, int from, int date, int headers, char *nl) {
     int fd;
     FILE *new = NULL;
-    FILE *old = NULL;
-    char tmpname[PATH_MAX];
-    size_t len;
-    char buf[BUFSIZE];
+    char *tmpname = NULL;
     time_t currtime;  
     char *t1 = NULL;
     char *t2 = NULL;
 
-    snprintf(tmpname, sizeof(tmpname), "%s/XXXXXX", queue_dir);
-    if ((fd = mkstemp(tmpname)) == -1) {
+    if ((fd = smf_core_spool_open(queue_dir, session->id, &tmpname)) == -1) {
         STRACE(TRACE_ERR,session->id,"failed to create temporary file: %s (%d)",strerror(errno),errno);
         return -1;
     }
     
-    close(fd);
-    
-    if((new = fopen(tmpname, "w"))==NULL) {
+    if((new = fdopen(fd, "w+"))==NULL) {
         STRACE(TRACE_ERR,session->id,"unable to open temporary file: %s (%d)",strerror(errno), errno);
+        close(fd);
+        if (tmpname != NULL) {
+            unlink(tmpname);
+            free(tmpname);
+        }
         return -1;
     }
 
@@ -245,38 +404,28 @@ int smf_smtpd_append_missing_headers(SMFSession_T *session, char *queue_dir, int
         free(t1);
     }
 
-    if((old = fopen(session->message_file, "r"))==NULL) {
-        STRACE(TRACE_ERR,session->id,"unable to open queue file: %s (%d)",strerror(errno), errno);
-        fclose(new);
-        return -1;
+    /* copy the received message behind the new headers */
+    if ((fflush(*spool_file) != 0) || (fflush(new) != 0)) {
+        STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
+        discard_and_return(new);
     }
 
-    while(!feof(old)) {
-        if ((len = fread(&buf,sizeof(char),BUFSIZE,old)) <= 0) {
-            STRACE(TRACE_ERR,session->id,"failed to read queue file: %s (%d)",strerror(errno),errno);
-            fclose(old);
-            fclose(new);
-            return -1;
-        }
-        if (fwrite(buf,sizeof(char),len,new) <= 0) {
-            STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
-            fclose(old);
-            fclose(new);
-            return -1;
-        }
+    if (smf_internal_copy_fd(fileno(*spool_file), 0, fileno(new)) == -1) {
+        STRACE(TRACE_ERR,session->id,"failed to copy queue file: %s (%d)",strerror(errno),errno);
+        discard_and_return(new);
     }
-    fclose(old); 
-    fclose(new);
-
-    if (unlink(session->message_file)!=0) {
-        STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
-        return -1;
+    fseeko(new, 0, SEEK_END);
+
+    /* an unnamed spool file just vanishes, a named one has to be removed */
+    fclose(*spool_file);
+    if (session->message_file != NULL) {
+        if (unlink(session->message_file)!=0)
+            STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+        free(session->message_file);
     }
 
-    if (rename(tmpname,session->message_file)!=0) {
-        STRACE(TRACE_ERR,session->id,"failed to rename queue file: %s (%d)",strerror(errno),errno);
-        return -1;
-    }
+    session->message_file = tmpname;
+    *spool_file = new;
 
     return 0;
 }
@@ -342,6 +491,30 @@ void smf_smtpd_code_reply(int sock, int code, SMFDict_T *codes) {
     free(out);
 }
 
+/* remove the spool file, unnamed ones are gone with the last close() */
+static void smf_smtpd_spool_discard(SMFSession_T *session) {
+    if (session->message_file == NULL)
+        return;
+
+    STRACE(TRACE_DEBUG,session->id,"removing spool file %s",session->message_file);
+    if (remove(session->message_file) != 0)
+        STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+
+    free(session->message_file);
+    session->message_file = NULL;
+}
+
+/* feed a chunk to the data hooks, returns the code, which refused the
+ * message or 0. Failures are handled according to module_fail */
+static int smf_smtpd_data_hook(SMFSettings_T *settings, SMFSession_T *session, const char *buf, size_t len) {
+    int ret = smf_modules_process_data(settings, session, buf, len);
+
+    if ((ret == -1) && (settings->module_fail == 1))
+        return 0;
+
+    return ret;
+}
+
 void smf_smtpd_process_data(SMFSession_T *session, SMFSettings_T *settings, SMFProcessQueue_T *q) {
 	ssize_t br;
     char buf[MAXLINE];
@@ -357,31 +530,71 @@ void smf_smtpd_process_data(SMFSession_T *session, SMFSettings_T *settings, SMFP
     int reti;
     char *nl = NULL;
     char *mid = NULL;
+    SMFSessionSpan_T *span = NULL;
+    char *qdir = NULL;
+    int fd;
+    int oversize = 0;
+    int refused = 0;
+    char *chunk = NULL;
+    size_t chunk_len = 0;
+    size_t len;
+    size_t max_size = smf_settings_get_max_size(settings);
 
     reti = regcomp(&regex, "[A-Za-z0-9\\._-]*:.*", 0);
 
-	smf_core_gen_queue_file(settings->queue_dir, &session->message_file, session->id);
-    if (session->message_file == NULL) {
-        STRACE(TRACE_ERR,session->id,"got no spool file path");
-        smf_smtpd_code_reply(session->sock, 552,settings->smtp_codes);
+    qdir = smf_core_queue_dir(settings->queue_dir, session->id, settings->queue_hash_depth);
+    if (qdir == NULL) {
+        STRACE(TRACE_ERR,session->id,"failed to create queue directory: %s (%d)",strerror(errno),errno);
+        smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
         return;
     }
-    
-    /* open the spool file */
-    spool_file = fopen(session->message_file, "w+");
+
+    /* open the spool file, it stays unnamed until a path is required */
+    if ((fd = smf_core_spool_open(qdir, session->id, &session->message_file)) == -1) {
+        STRACE(TRACE_ERR,session->id,"unable to create spool file: %s (%d)",strerror(errno), errno);
+        smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
+        free(qdir);
+        return;
+    }
+
+    spool_file = fdopen(fd, "w+");
     if(spool_file == NULL) {
         STRACE(TRACE_ERR,session->id,"unable to open spool file: %s (%d)",strerror(errno), errno);
         smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
+        close(fd);
+        smf_smtpd_spool_discard(session);
+        free(qdir);
         return;
     }
 
-    STRACE(TRACE_DEBUG,session->id,"using spool file: '%s'", session->message_file); 
+    setvbuf(spool_file, NULL, _IOFBF, IOBUFSIZE);
+
+    /* modules with a data hook scan the message while it's received */
+    if (smf_modules_data_hooks(settings) > 0)
+        chunk = malloc(IOBUFSIZE);
+
+    STRACE(TRACE_DEBUG,session->id,"using spool file: '%s'", 
+        session->message_file != NULL ? session->message_file : "unnamed"); 
+    span = smf_session_span_begin(session, "data");
     smf_smtpd_string_reply(session->sock,"354 End data with <CR><LF>.<CR><LF>\r\n");
 
     while((br = smf_internal_readline(session->sock,buf,MAXLINE,&rl)) > 0) {
+        smf_smtpd_capture(buf, br);
         if ((strncasecmp(buf,".\r\n",3)==0)||(strncasecmp(buf,".\n",2)==0)) break;
         if (strncasecmp(buf,".",1)==0) smf_smtpd_stuffing(buf);
 
+        /* once the limit is crossed, the rest of the message is drained 
+         * without storing it */
+        session->message_size += br;
+        if (oversize || refused) 
+            continue;
+
+        if ((max_size != 0) && (session->message_size > max_size)) {
+            STRACE(TRACE_DEBUG,session->id,"max message size limit exceeded, discarding data"); 
+            oversize = 1;
+            continue;
+        }
+
         if (strncasecmp(buf,"Message-Id:",11)==0) found_mid = 1;
         if (strncasecmp(buf,"Date:",5)==0) found_date = 1;
         if (strncasecmp(buf,"To:",3)==0) found_to = 1;
@@ -396,45 +609,101 @@ void smf_smtpd_process_data(SMFSession_T *session, SMFSettings_T *settings, SMFP
             }
         }
 
-        if (fwrite(buf, sizeof(char), strlen(buf), spool_file)<=0) {
+        len = strlen(buf);
+        if (fwrite(buf, sizeof(char), len, spool_file)<=0) {
             STRACE(TRACE_ERR,session->id,"failed to write queue file: %s (%d)",strerror(errno),errno);
             smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
             fclose(spool_file);
+            smf_smtpd_spool_discard(session);
+            free(chunk);
+            free(qdir);
             return;
         }
-        session->message_size += br;
+
+        if (chunk != NULL) {
+            if (chunk_len + len > IOBUFSIZE) {
+                refused = smf_smtpd_data_hook(settings, session, chunk, chunk_len);
+                chunk_len = 0;
+            }
+            memcpy(chunk + chunk_len, buf, len);
+            chunk_len += len;
+        }
     }
     if (rl !=NULL) free(rl);
+
+    /* the last chunk and the end of data */
+    if ((chunk != NULL) && !oversize && !refused) {
+        if ((refused = smf_smtpd_data_hook(settings, session, chunk, chunk_len)) == 0)
+            refused = smf_smtpd_data_hook(settings, session, NULL, 0);
+    }
+    free(chunk);
     regfree(&regex);
-    fclose(spool_file);
+    smf_session_span_end(span);
   
-    if ((found_mid==0)||(found_to==0)||(found_from==0)||(found_date==0)) 
-        smf_smtpd_append_missing_headers(session, settings->queue_dir,found_mid,found_to,found_from,found_date,found_header,nl);
-    
-    
     STRACE(TRACE_DEBUG,session->id,"data complete, message size: %d", (u_int32_t)session->message_size);
     
-    if ((session->message_size > smf_settings_get_max_size(settings))&&(smf_settings_get_max_size(settings) != 0)) {
-        STRACE(TRACE_DEBUG,session->id,"max message size limit exceeded"); 
-        smf_smtpd_string_reply(session->sock,"552 message size exceeds fixed maximium message size\r\n");
-    } else {
-        if(smf_message_from_file(&message,session->message_file,1) != 0) {
-            STRACE(TRACE_ERR, session->id, "smf_message_from_file() failed");
-            smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
-            return;
-        }
+    if (oversize) {
+        /* rejected messages never get a name in the queue */
+        smf_smtpd_string_reply(session->sock,CODE_552_SIZE);
+        fclose(spool_file);
+        smf_smtpd_spool_discard(session);
+        free(qdir);
+        return;
+    } 
 
-        mid = strdup(smf_message_get_message_id(message));
-        mid = smf_core_strstrip(mid);
-        STRACE(TRACE_INFO,session->id,"processing message-id=%s",mid);
-        free(mid);
-        session->envelope->message = message;
-        smf_smtpd_process_modules(session,settings,q);
+    if (refused) {
+        smf_smtpd_hook_reply(settings, session, refused);
+        fclose(spool_file);
+        smf_smtpd_spool_discard(session);
+        free(qdir);
+        return;
     }
+    
+    if ((found_mid==0)||(found_to==0)||(found_from==0)||(found_date==0)) 
+        smf_smtpd_append_missing_headers(session, qdir, &spool_file, found_mid,found_to,found_from,found_date,found_header,nl);
 
-    STRACE(TRACE_DEBUG,session->id,"removing spool file %s",session->message_file);
-    if (remove(session->message_file) != 0)
-        STRACE(TRACE_ERR,session->id,"failed to remove queue file: %s (%d)",strerror(errno),errno);
+    /* modules and nexthop work on a path, link the spool file into the queue */
+    if ((fflush(spool_file) != 0) || 
+            (smf_core_spool_link(fileno(spool_file), qdir, session->id, &session->message_file) != 0)) {
+        STRACE(TRACE_ERR,session->id,"failed to link spool file: %s (%d)",strerror(errno),errno);
+        smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
+        fclose(spool_file);
+        smf_smtpd_spool_discard(session);
+        free(qdir);
+        return;
+    }
+    free(qdir);
+    STRACE(TRACE_DEBUG,session->id,"linked spool file: '%s'", session->message_file); 
+
+    /* the message has to be on disk before the client gets its 250 */
+    span = smf_session_span_begin(session, "sync");
+    if (smf_server_spool_sync(settings, fileno(spool_file), session->message_file) != 0) {
+        STRACE(TRACE_ERR,session->id,"failed to sync spool file: %s (%d)",strerror(errno),errno);
+        smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
+        fclose(spool_file);
+        smf_smtpd_spool_discard(session);
+        return;
+    }
+    smf_session_span_end(span);
+    fclose(spool_file);
+
+    span = smf_session_span_begin(session, "parse");
+    if(smf_message_from_file(&message,session->message_file,1) != 0) {
+        STRACE(TRACE_ERR, session->id, "smf_message_from_file() failed");
+        smf_smtpd_code_reply(session->sock, 451, settings->smtp_codes);
+        smf_smtpd_spool_discard(session);
+        return;
+    }
+    smf_session_span_end(span);
+
+    mid = strdup(smf_message_get_message_id(message));
+    mid = smf_core_strstrip(mid);
+    STRACE(TRACE_INFO,session->id,"processing message-id=%s",mid);
+    free(mid);
+    session->envelope->message = message;
+    smf_smtpd_process_modules(session,settings,q);
+
+    smf_smtpd_spool_discard(session);
 }
 
 void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFProcessQueue_T *q) {
@@ -444,23 +713,26 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFProcessQueu
     char req[MAXLINE];
     char *req_value = NULL;
     char *t = NULL;
+    char *addr = NULL;
+    long declared_size;
     int state=ST_INIT;
-    SMFSession_T *session = smf_session_new();
+    SMFSession_T *session = NULL;
+    SMFSessionSpan_T *span = NULL;
     SMFListElem_T *elem = NULL;
     struct tms start_acct;
     struct sigaction action;
     
     start_acct = smf_internal_init_runtime_stats();
+    session = smf_smtpd_session_new(settings, client);
+    smf_smtpd_capture_open(settings, session);
 
-    /* send signal to parent that we've got a new client */
-    kill(getppid(),SIGUSR1);
-
-    session->sock = client;
     client_sock = client;
 
+    span = smf_session_span_begin(session, "connect");
     hostname = (char *)malloc(MAXHOSTNAMELEN);
     gethostname(hostname,MAXHOSTNAMELEN);
     smf_smtpd_string_reply(session->sock,"220 %s spmfilter\r\n",hostname);
+    smf_session_span_end(span);
 
 
     /* set timeout */
@@ -481,6 +753,7 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFProcessQueu
     for (;;) {
         if ((br = smf_internal_readline(session->sock,req,MAXLINE,&rl)) < 1) 
             break; /* EOF or error */
+        smf_smtpd_capture(req, br);
 
         STRACE(TRACE_DEBUG,session->id,"client smtp dialog: [%s]",req);
 
@@ -498,13 +771,13 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFProcessQueu
             alarm(settings->smtpd_timeout);
             
             if (state != ST_INIT) {
-                smf_session_free(session);
+                smf_smtpd_session_free(settings, session);
                 /* reinit session */
-                session = smf_session_new();
-                session->sock = client;
+                session = smf_smtpd_session_new(settings, client);
                 STRACE(TRACE_DEBUG,session->id,"session reset, helo/ehlo recieved not in init state");
             }
             STRACE(TRACE_DEBUG,session->id,"SMTP: 'helo/ehlo' received");
+            span = smf_session_span_begin(session, "helo");
             req_value = smf_smtpd_get_req_value(req,4);
             smf_session_set_helo(session,req_value);
             
@@ -515,12 +788,13 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFProcessQueu
 
                 if (strncasecmp(req, "ehlo", 4)==0) {
                     smf_smtpd_string_reply(session->sock,
-                        "250-%s\r\n250-XFORWARD ADDR\r\n250 SIZE %i\r\n",hostname,settings->max_size);
+                        "250-%s\r\n250-XFORWARD ADDR\r\n250 SIZE %lu\r\n",hostname,settings->max_size);
                 } else {
                     smf_smtpd_string_reply(session->sock,"250 %s\r\n",hostname);
                 }
                 state = ST_HELO;
             }
+            smf_session_span_end(span);
             
             free(req_value);
         } else if (strncasecmp(req,"xforward",8)==0) {
@@ -552,26 +826,39 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFProcessQueu
 
             alarm(settings->smtpd_timeout);
             STRACE(TRACE_DEBUG,session->id,"SMTP: 'mail from' received");
+            span = smf_session_span_begin(session, "mail");
             if (state == ST_MAIL) {
                 /* we already got the mail command */
                 smf_smtpd_string_reply(session->sock,"503 Error: nested MAIL command\r\n");
             } else {
                 req_value = smf_smtpd_get_req_value(req,10);
+                declared_size = smf_smtpd_mail_params(req_value);
                 if (strcmp(req_value,"") == 0) {
                     /* empty mail from? */
                     smf_smtpd_string_reply(session->sock,"501 Syntax: MAIL FROM:<address>\r\n");
+                } else if (declared_size == -1) {
+                    smf_smtpd_string_reply(session->sock,"501 5.5.4 Syntax: invalid SIZE parameter\r\n");
+                } else if ((declared_size == LONG_MAX) || 
+                        ((settings->max_size != 0) && ((unsigned long)declared_size > settings->max_size))) {
+                    /* no need to receive a message we are going to reject */
+                    STRACE(TRACE_DEBUG,session->id,"declared message size %ld exceeds limit",declared_size);
+                    smf_smtpd_string_reply(session->sock,CODE_552_SIZE);
                 } else {
                     smf_envelope_set_sender(session->envelope,req_value);
                     STRACE(TRACE_DEBUG,session->id,"session->envelope->sender: [%s]",session->envelope->sender);
-                    smf_smtpd_code_reply(session->sock,250,settings->smtp_codes);
-                    state = ST_MAIL;
+                    if (!smf_smtpd_hook_reply(settings,session,smf_modules_process_mail(settings,session))) {
+                        smf_smtpd_code_reply(session->sock,250,settings->smtp_codes);
+                        state = ST_MAIL;
+                    }
                 }
                 free(req_value);
                 
             }
+            smf_session_span_end(span);
         } else if (strncasecmp(req, "rcpt to:", 8)==0) {
             alarm(settings->smtpd_timeout);
             STRACE(TRACE_DEBUG,session->id,"SMTP: 'rcpt to' received");
+            span = smf_session_span_begin(session, "rcpt");
             if ((state != ST_MAIL) && (state != ST_RCPT)) {
                 /* someone wants to break smtp rules... */
                 smf_smtpd_string_reply(session->sock,"503 Error: need MAIL command\r\n");
@@ -581,14 +868,20 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFProcessQueu
                     /* empty rcpt to? */
                     smf_smtpd_string_reply(session->sock,"501 Syntax: RCPT TO:<address>\r\n");
                 } else {
-                    smf_envelope_add_rcpt(session->envelope, req_value);
-                    smf_smtpd_code_reply(session->sock,250,settings->smtp_codes);
-                    elem = smf_list_tail(session->envelope->recipients);
-                    STRACE(TRACE_DEBUG,session->id,"session->envelope->recipients: [%s]",(char *)smf_list_data(elem));
-                    state = ST_RCPT;
+                    /* refused recipients never make it into the envelope */
+                    addr = smf_internal_strip_email_addr(req_value);
+                    if (!smf_smtpd_hook_reply(settings,session,smf_modules_process_rcpt(settings,session,addr))) {
+                        smf_envelope_add_rcpt(session->envelope, req_value);
+                        smf_smtpd_code_reply(session->sock,250,settings->smtp_codes);
+                        elem = smf_list_tail(session->envelope->recipients);
+                        STRACE(TRACE_DEBUG,session->id,"session->envelope->recipients: [%s]",(char *)smf_list_data(elem));
+                        state = ST_RCPT;
+                    }
+                    free(addr);
                 }
                 free(req_value);
             }
+            smf_session_span_end(span);
         } else if (strncasecmp(req,"data", 4)==0) {
             alarm(settings->smtpd_timeout);
             if ((state != ST_RCPT) && (state != ST_MAIL)) {
@@ -605,10 +898,9 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFProcessQueu
         } else if (strncasecmp(req,"rset", 4)==0) {
             alarm(settings->smtpd_timeout);
             STRACE(TRACE_DEBUG,session->id,"SMTP: 'rset' received");
-            smf_session_free(session);
+            smf_smtpd_session_free(settings, session);
             /* reinit session */
-            session = smf_session_new();
-            session->sock = client;
+            session = smf_smtpd_session_new(settings, client);
             smf_smtpd_code_reply(session->sock,250,settings->smtp_codes);
             state = ST_INIT;
         } else if (strncasecmp(req, "noop", 4)==0) {
@@ -623,19 +915,18 @@ void smf_smtpd_handle_client(SMFSettings_T *settings, int client, SMFProcessQueu
     }
     free(rl);
     free(hostname);
-    
-    /* client has finished */
-    kill(getppid(),SIGUSR2);
 
+    smf_smtpd_capture_close();
     smf_internal_print_runtime_stats(start_acct,session->id);
-    smf_session_free(session);
+    smf_smtpd_session_free(settings, session);
     
     smf_settings_free(settings);
     exit(0);
 }
 
 int load(SMFSettings_T *settings) {
-    int sd;
+    int *sds = NULL;
+    int num_sds;
     SMFProcessQueue_T *q;
 
     TRACE(TRACE_INFO,"starting smtpd engine");
@@ -652,13 +943,14 @@ int load(SMFSettings_T *settings) {
         return(-1);
     }
 
-    if ((sd = smf_server_listen(settings)) < 0) {
+    if ((num_sds = smf_server_listen(settings,&sds)) < 0) {
         exit(EXIT_FAILURE);
     }
 
-    smf_server_init(settings,sd);
-    smf_server_loop(settings,sd,q,smf_smtpd_handle_client);
+    smf_server_init(settings);
+    smf_server_loop(settings,sds,num_sds,q,smf_smtpd_handle_client);
 
+    free(sds);
     free(q);
     
     return 0;
@@ -28,6 +28,7 @@
 #define CODE_451 "451 Requested action aborted: local error in processing\r\n"
 #define CODE_502 "502 Command not implemented\r\n"
 #define CODE_552 "552 Requested action aborted: local error in processing\r\n"
+#define CODE_552_SIZE "552 5.3.4 Message size exceeds fixed maximum message size\r\n"
 
 /* SMTP States */
 #define ST_INIT 0
@@ -46,6 +47,7 @@ char *smf_smtpd_get_req_value(char *req, int jmp);
 void smf_smtpd_stuffing(char chain[]);
 int smf_smtpd_append_missing_headers(SMFSession_T *session, 
     char *queue_dir, 
+    FILE **spool_file,
     int mid, 
     int to, 
     int from, 
@@ -36,4 +36,7 @@
 /* db4 */
 #cmakedefine HAVE_DB4
 
+/* copy_file_range(2) */
+#cmakedefine HAVE_COPY_FILE_RANGE
+
 #endif /* _SPMFILTER_CONFIG_H */
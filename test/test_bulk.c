@@ -0,0 +1,172 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner, Werner Detter and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "../src/smf_list.h"
+#include "../src/smf_dict.h"
+#include "../src/smf_settings.h"
+#include "../src/smf_settings_private.h"
+#include "../src/smf_internal.h"
+#include "../src/smf_modules.h"
+
+#include "test.h"
+#include "testdirs.h"
+
+int load(SMFSettings_T *settings);
+
+static int write_mbox(char *mbox, char *sample, int count) {
+    FILE *in, *out;
+    char buf[1024];
+    int i;
+
+    if ((out = fopen(mbox, "w")) == NULL)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        if ((in = fopen(sample, "r")) == NULL) {
+            fclose(out);
+            return -1;
+        }
+        fprintf(out, "From sender@example.org Thu Jan  1 00:00:00 2012\n");
+        while (fgets(buf, sizeof(buf), in) != NULL) {
+            if (strncmp(buf, "From ", 5) == 0)
+                fputc('>', out);
+            fputs(buf, out);
+        }
+        fputc('\n', out);
+        fclose(in);
+    }
+
+    return fclose(out);
+}
+
+/* run the engine and pick up the counts of its final report */
+static int run_bulk(SMFSettings_T *settings, long *done, long *total, long *stopped, long *failed) {
+    FILE *fh;
+    char buf[1024];
+    int fd, out;
+    int found = 0;
+    int ret;
+
+    if ((fd = open(BINARY_DIR "/test_bulk.out", O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+        return -1;
+
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    ret = load(settings);
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    close(fd);
+
+    if ((fh = fopen(BINARY_DIR "/test_bulk.out", "r")) == NULL)
+        return -1;
+
+    while (fgets(buf, sizeof(buf), fh) != NULL) {
+        if (sscanf(buf, "done: %ld/%ld messages, %ld stopped, %ld failed", 
+                done, total, stopped, failed) == 4)
+            found = 1;
+    }
+    fclose(fh);
+    unlink(BINARY_DIR "/test_bulk.out");
+
+    return (found == 1) ? ret : -1;
+}
+
+static int count_files(char *dir) {
+    DIR *d;
+    struct dirent *de;
+    int n = 0;
+
+    if ((d = opendir(dir)) == NULL)
+        return -1;
+
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] != '.')
+            n++;
+    }
+    closedir(d);
+
+    return n;
+}
+
+int main (int argc, char const *argv[]) {
+    SMFSettings_T *settings = smf_settings_new();
+    char *fname;
+    char *mbox;
+    char *qdir = BINARY_DIR "/test_bulk_queue";
+    long done, total, stopped, failed;
+
+    printf("Start smf_bulk tests...\n");
+
+    printf("* preparing bulk engine...\t\t\t");
+    smf_settings_set_debug(settings, 1);
+    mkdir(qdir, 0700);
+    smf_settings_set_queue_dir(settings, qdir);
+    smf_settings_set_engine(settings, "bulk");
+
+    /* messages must not be delivered, an unreachable nexthop would fail */
+    smf_settings_set_nexthop(settings, "127.0.0.1:1");
+
+    /* add test modules */
+    smf_settings_add_module(settings, BINARY_DIR "/libtestmod1.so");
+    smf_settings_add_module(settings, BINARY_DIR "/libtestmod2.so");
+
+    asprintf(&fname, "%s/m0001.txt", SAMPLES_DIR);
+    asprintf(&mbox, "%s/test_bulk.mbox", BINARY_DIR);
+
+    if (write_mbox(mbox, fname, 5) != 0) {
+        printf("failed\n");
+        return -1;
+    }
+
+    smf_dict_set(settings->groups, "bulk:source", mbox);
+    smf_dict_set(settings->groups, "bulk:workers", "2");
+    printf("passed\n");
+
+    printf("* processing mbox...\t\t\t\t");
+    if ((run_bulk(settings, &done, &total, &stopped, &failed) != 0) ||
+            (done != 5) || (total != 5) || (stopped != 0) || (failed != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    printf("* checking nexthop and spool files...\t\t");
+    if ((settings->nexthop != NULL) || (count_files(qdir) != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    rmdir(qdir);
+    unlink(mbox);
+    free(mbox);
+    free(fname);
+    smf_settings_free(settings);
+    return 0;
+}
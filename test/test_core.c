@@ -120,6 +120,58 @@ START_TEST(gen_queue_file) {
 }
 END_TEST
 
+START_TEST(queue_dir) {
+    char *d;
+    char *s;
+    char expected[1024];
+    struct stat fstat;
+
+    snprintf(expected, sizeof(expected), "%s/A/B", BINARY_DIR);
+    fail_unless((d = smf_core_queue_dir(BINARY_DIR, "AB34567890", 2)) != NULL);
+    fail_unless(strcmp(d, expected) == 0);
+    fail_unless(stat(d, &fstat) == 0);
+    fail_unless(S_ISDIR(fstat.st_mode));
+
+    /* existing levels are reused */
+    free(d);
+    fail_unless((d = smf_core_queue_dir(BINARY_DIR, "AB34567890", 2)) != NULL);
+    fail_unless(smf_core_gen_queue_file(d, &s, "AB34567890") == 0);
+    fail_unless(strncmp(s, expected, strlen(expected)) == 0);
+    fail_unless(unlink(s) == 0);
+    free(s);
+    free(d);
+
+    fail_unless((d = smf_core_queue_dir(BINARY_DIR, "AB34567890", 0)) != NULL);
+    fail_unless(strcmp(d, BINARY_DIR) == 0);
+    free(d);
+
+    fail_unless(rmdir(expected) == 0);
+    expected[strlen(expected) - 2] = '\0';
+    fail_unless(rmdir(expected) == 0);
+}
+END_TEST
+
+START_TEST(spool_link) {
+    char *s = NULL;
+    int fd;
+    struct stat fstat;
+
+    fail_unless((fd = smf_core_spool_open(BINARY_DIR, "1234567890", &s)) != -1);
+    fail_unless(write(fd, "test\n", 5) == 5);
+    fail_unless(smf_core_spool_link(fd, BINARY_DIR, "1234567890", &s) == 0);
+    fail_unless(s != NULL);
+    fail_unless(smf_core_spool_sync(fd, s, 0) == 0);
+    fail_unless(smf_core_spool_sync(fd, s, 1) == 0);
+    fail_unless(close(fd) == 0);
+    fail_unless(stat(s, &fstat) == 0);
+    fail_unless(S_ISREG(fstat.st_mode));
+    fail_unless(fstat.st_size == 5);
+    fail_unless(unlink(s) == 0);
+
+    free(s);
+}
+END_TEST
+
 START_TEST(md5sum) {
     char *s;
 
@@ -256,6 +308,8 @@ TCase *core_tcase() {
     tcase_add_test(tc, strsplit_with_nelems);
     tcase_add_test(tc, strsplit_no_split);
     tcase_add_test(tc, gen_queue_file);
+    tcase_add_test(tc, queue_dir);
+    tcase_add_test(tc, spool_link);
     tcase_add_test(tc, md5sum);
     tcase_add_test(tc, get_maildir_filename);
     tcase_add_test(tc, expand_string_unsupported_option);
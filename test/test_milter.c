@@ -0,0 +1,231 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner, Werner Detter and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "testdirs.h"
+#include "../src/smf_internal.h"
+#include "../src/smf_settings.h"
+#include "../src/smf_settings_private.h"
+#include "../src/smf_milter.h"
+
+#define TEST_PORT 33334
+
+int load(SMFSettings_T *settings);
+
+static int send_packet(int sd, char cmd, const char *data, size_t len) {
+    uint32_t nlen = htonl(len + 1);
+
+    if ((smf_internal_writen(sd, &nlen, sizeof(nlen)) != sizeof(nlen)) ||
+            (smf_internal_writen(sd, &cmd, 1) != 1))
+        return -1;
+
+    if ((len > 0) && (smf_internal_writen(sd, data, len) != (ssize_t)len))
+        return -1;
+
+    return 0;
+}
+
+/* read packets until a final response, returns its command */
+static char read_response(int sd) {
+    uint32_t nlen;
+    char buf[1024];
+    size_t len;
+
+    for (;;) {
+        if (smf_internal_readn(sd, &nlen, sizeof(nlen)) != sizeof(nlen))
+            return 0;
+
+        len = ntohl(nlen);
+        if ((len < 1) || (len > sizeof(buf)) || (smf_internal_readn(sd, buf, len) != (ssize_t)len))
+            return 0;
+
+        if (buf[0] != SMFIR_ADDHEADER && buf[0] != SMFIR_CHGHEADER && 
+                buf[0] != SMFIR_ADDRCPT && buf[0] != SMFIR_DELRCPT && buf[0] != SMFIR_CHGFROM)
+            return buf[0];
+    }
+}
+
+/* read the option negotiation reply, returns the protocol flags */
+static int read_optneg(int sd, uint32_t *protocol) {
+    uint32_t nlen;
+    char buf[1 + 3 * sizeof(uint32_t)];
+
+    if ((smf_internal_readn(sd, &nlen, sizeof(nlen)) != sizeof(nlen)) || (ntohl(nlen) != sizeof(buf)) ||
+            (smf_internal_readn(sd, buf, sizeof(buf)) != sizeof(buf)) || (buf[0] != SMFIC_OPTNEG))
+        return -1;
+
+    memcpy(protocol, buf + 1 + 2 * sizeof(uint32_t), sizeof(uint32_t));
+    *protocol = ntohl(*protocol);
+    return 0;
+}
+
+static int connect_engine(void) {
+    struct sockaddr_in sa;
+    int sd, i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(TEST_PORT);
+    sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    /* give the engine some time to start */
+    for (i = 0; i < 50; i++) {
+        if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+        if (connect(sd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+            return sd;
+        close(sd);
+        usleep(100000);
+    }
+
+    return -1;
+}
+
+static int send_message(int sd) {
+    uint32_t optneg[3] = { htonl(SMFI_VERSION), htonl(MILTER_ACTIONS), htonl(0) };
+    const char helo[] = "localhost";
+    const char mail[] = "<sender@example.org>";
+    const char rcpt[] = "<rcpt@example.org>";
+    const char subject[] = "Subject\0test message";
+    const char body[] = "test body\r\n";
+
+    if ((send_packet(sd, SMFIC_OPTNEG, (char *)optneg, sizeof(optneg)) != 0) || (read_response(sd) != SMFIC_OPTNEG))
+        return -1;
+    if ((send_packet(sd, SMFIC_HELO, helo, sizeof(helo)) != 0) || (read_response(sd) != SMFIR_CONTINUE))
+        return -1;
+    if ((send_packet(sd, SMFIC_MAIL, mail, sizeof(mail)) != 0) || (read_response(sd) != SMFIR_CONTINUE))
+        return -1;
+    if ((send_packet(sd, SMFIC_RCPT, rcpt, sizeof(rcpt)) != 0) || (read_response(sd) != SMFIR_CONTINUE))
+        return -1;
+    if ((send_packet(sd, SMFIC_HEADER, subject, sizeof(subject)) != 0) || (read_response(sd) != SMFIR_CONTINUE))
+        return -1;
+    if ((send_packet(sd, SMFIC_EOH, NULL, 0) != 0) || (read_response(sd) != SMFIR_CONTINUE))
+        return -1;
+    if ((send_packet(sd, SMFIC_BODY, body, strlen(body)) != 0) || (read_response(sd) != SMFIR_CONTINUE))
+        return -1;
+    if ((send_packet(sd, SMFIC_BODYEOB, NULL, 0) != 0) || (read_response(sd) != SMFIR_ACCEPT))
+        return -1;
+
+    return send_packet(sd, SMFIC_QUIT, NULL, 0);
+}
+
+/* testmod2 refuses reject@example.org and messages with X-Reject-Test */
+static int send_refused(int sd) {
+    uint32_t optneg[3] = { htonl(SMFI_VERSION), htonl(MILTER_ACTIONS), htonl(MILTER_NO_REPLY) };
+    uint32_t protocol;
+    const char mail[] = "<sender@example.org>";
+    const char reject[] = "<reject@example.org>";
+    const char rcpt[] = "<rcpt@example.org>";
+    const char subject[] = "Subject\0test message";
+    const char header[] = "X-Reject-Test\0yes";
+
+    /* the steps with hooks must be answered, even if the MTA offers to skip them */
+    if ((send_packet(sd, SMFIC_OPTNEG, (char *)optneg, sizeof(optneg)) != 0) || (read_optneg(sd, &protocol) != 0) ||
+            (protocol & (SMFIP_NR_MAIL | SMFIP_NR_RCPT | SMFIP_NR_HDR | SMFIP_NR_EOH | SMFIP_NR_BODY)))
+        return -1;
+    if ((send_packet(sd, SMFIC_MAIL, mail, sizeof(mail)) != 0) || (read_response(sd) != SMFIR_CONTINUE))
+        return -1;
+    if ((send_packet(sd, SMFIC_RCPT, reject, sizeof(reject)) != 0) || (read_response(sd) != SMFIR_REPLYCODE))
+        return -1;
+    if ((send_packet(sd, SMFIC_RCPT, rcpt, sizeof(rcpt)) != 0) || (read_response(sd) != SMFIR_CONTINUE))
+        return -1;
+    if ((send_packet(sd, SMFIC_HEADER, subject, sizeof(subject)) != 0) || (read_response(sd) != SMFIR_CONTINUE))
+        return -1;
+    if ((send_packet(sd, SMFIC_HEADER, header, sizeof(header)) != 0) || (read_response(sd) != SMFIR_REPLYCODE))
+        return -1;
+    if (send_packet(sd, SMFIC_ABORT, NULL, 0) != 0)
+        return -1;
+
+    return send_packet(sd, SMFIC_QUIT, NULL, 0);
+}
+
+int main (int argc, char const *argv[]) {
+    SMFSettings_T *settings = smf_settings_new();
+    int sd;
+    int ret = 0;
+    pid_t pid;
+
+    smf_settings_set_pid_file(settings, "/tmp/smf_test_milter.pid");
+    smf_settings_set_bind_ip(settings, "127.0.0.1");
+    smf_settings_set_bind_port(settings, TEST_PORT);
+    smf_settings_set_foreground(settings, 1);
+    smf_settings_set_spare_childs(settings, 0);
+    smf_settings_set_max_childs(settings,1);
+    smf_settings_set_debug(settings,1);
+    smf_settings_set_queue_dir(settings, BINARY_DIR);
+    smf_settings_set_engine(settings, "milter");
+
+    /* add test modules */
+    smf_settings_add_module(settings, BINARY_DIR "/libtestmod1.so");
+    smf_settings_add_module(settings, BINARY_DIR "/libtestmod2.so");
+
+    printf("Start smf_milter tests...\n");
+
+    printf("* preparing milter engine...\t\t\t");
+    printf("passed\n");
+
+    switch(pid = fork()) {
+        case -1:
+            printf("failed\n");
+            return -1;
+        case 0:
+            if (load(settings) != 0) {
+                return -1;
+            }
+            break;
+        default:
+            printf("* sending test message ...\t\t\t");
+            if (((sd = connect_engine()) < 0) || (send_message(sd) != 0)) {
+                printf("failed\n");
+                ret = -1;
+            } else 
+                printf("passed\n");
+
+            if (sd >= 0)
+                close(sd);
+
+            printf("* refusing recipient and message ...\t\t");
+            if (((sd = connect_engine()) < 0) || (send_refused(sd) != 0)) {
+                printf("failed\n");
+                ret = -1;
+            } else 
+                printf("passed\n");
+
+            if (sd >= 0)
+                close(sd);
+            kill(pid,SIGTERM);
+            waitpid(pid, NULL, 0);
+            break;
+    }
+
+    smf_settings_free(settings);
+    return ret;
+}
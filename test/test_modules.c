@@ -20,7 +20,15 @@
 #include <sys/types.h>
 #include <check.h>
 #include <stdio.h>
+#include <string.h>
+#include <dirent.h>
 #include <utime.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "../src/smf_modules.h"
 #include "../src/smf_session.h"
@@ -45,6 +53,8 @@ static struct cb_data mod3_data;
 static struct cb_data error_data;
 static struct cb_data processing_error_data;
 static struct cb_data nexthop_error_data;
+static struct cb_data *ro_data; /* shared with the workers of ro1 and ro2 */
+static pid_t test_pid;
 
 static void init_cb_data(struct cb_data* data) {
     data->count = 0;
@@ -108,6 +118,48 @@ static int mod3(SMFSettings_T *set, SMFSession_T *s) {
     return mod3_data.rc;
 }
 
+/* read-only modules run in a worker process with a copy of the session */
+static int ro1(SMFSettings_T *set, SMFSession_T *s) {
+    fail_unless(getpid() != test_pid);
+    fail_unless(s != session);
+    ro_data[0].count++;
+    if (ro_data[0].rc != 0)
+        smf_session_set_response_msg(s, "ro1 refused");
+    return ro_data[0].rc;
+}
+
+static int ro2(SMFSettings_T *set, SMFSession_T *s) {
+    fail_unless(getpid() != test_pid);
+    fail_unless(s != session);
+    ro_data[1].count++;
+    smf_session_set_response_msg(s, "ro2 refused");
+    return ro_data[1].rc;
+}
+
+static int slow(SMFSettings_T *set, SMFSession_T *s) {
+    sleep(2);
+    return 0;
+}
+
+/* would outlive its deadline */
+static int stuck(SMFSettings_T *set, SMFSession_T *s) {
+    signal(SIGTERM, SIG_IGN);
+    sleep(3);
+    return 0;
+}
+
+/* modules with a deadline run in a worker process, which reports its 
+ * changes */
+static int modify(SMFSettings_T *set, SMFSession_T *s) {
+    fail_unless(getpid() != test_pid);
+    fail_unless(s == session);
+    smf_envelope_set_sender(s->envelope, "changed@example.org");
+    smf_envelope_add_rcpt(s->envelope, "added@example.org");
+    smf_message_set_header(s->envelope->message, "X-Worker: yes");
+    smf_session_set_response_msg(s, "modified");
+    return 0;
+}
+
 static int message_file_changed_cb(SMFSettings_T *set, SMFSession_T *s) {
   struct stat fstat;
   struct utimbuf times;
@@ -158,6 +210,12 @@ static void setup() {
     init_cb_data(&error_data);
     init_cb_data(&processing_error_data);
     init_cb_data(&nexthop_error_data);
+
+    ro_data = mmap(NULL, 2 * sizeof(struct cb_data), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    fail_unless(ro_data != MAP_FAILED);
+    init_cb_data(&ro_data[0]);
+    init_cb_data(&ro_data[1]);
+    test_pid = getpid();
 }
 
 static void teardown() {
@@ -165,6 +223,7 @@ static void teardown() {
     smf_settings_free(settings);
     smf_session_free(session);
     free(queue);
+    munmap(ro_data, 2 * sizeof(struct cb_data));
     session = NULL;
 }
 
@@ -266,6 +325,57 @@ START_TEST(process_err_stop_queue) {
 }
 END_TEST
 
+/* path of the journal of a process, journal.<pid>.<n> */
+static char *find_journal(pid_t pid) {
+    DIR *dir;
+    struct dirent *de;
+    char *prefix = NULL;
+    char *path = NULL;
+
+    asprintf(&prefix, "journal.%d.", (int)pid);
+    if ((dir = opendir(BINARY_DIR)) != NULL) {
+        while ((path == NULL) && ((de = readdir(dir)) != NULL)) {
+            if (strncmp(de->d_name, prefix, strlen(prefix)) == 0)
+                asprintf(&path, "%s/%s", BINARY_DIR, de->d_name);
+        }
+        closedir(dir);
+    }
+    free(prefix);
+
+    return path;
+}
+
+START_TEST(journal_resume) {
+    SMFDict_T *modules = smf_dict_new();
+    SMFDict_T *envelopes = smf_dict_new();
+    SMFDict_T *finished = smf_dict_new();
+    char *path = NULL;
+
+    smf_list_append(settings->modules, smf_module_create_callback("mod1", mod1));
+    smf_list_append(settings->modules, smf_module_create_callback("mod2", mod2));
+
+    mod2_data.rc = 1;
+    processing_error_data.rc = 0; // halt the queue
+    fail_unless(smf_modules_process(queue, session, settings) == -1);
+
+    /* the halted message is in the journal of this process */
+    fail_unless((path = find_journal(getpid())) != NULL);
+    fail_unless(smf_modules_journal_read(path, modules, envelopes, finished, NULL) == 0);
+    fail_unless(modules->n == 1);
+    fail_unless(envelopes->n == 0);
+
+    mod2_data.rc = 0;
+    fail_unless(smf_modules_process(queue, session, settings) == 0);
+    fail_unless(mod1_data.count == 1); // skipped
+    fail_unless(mod2_data.count == 2);
+
+    smf_dict_free(modules);
+    smf_dict_free(envelopes);
+    smf_dict_free(finished);
+    free(path);
+}
+END_TEST
+
 START_TEST(process_err_nexthop) {
     smf_settings_set_nexthop(settings, "/dev/null");
         
@@ -320,6 +430,143 @@ START_TEST(message_file_changed) {
 }
 END_TEST
 
+START_TEST(envelope_hooks) {
+    smf_list_append(settings->modules, smf_module_create(BINARY_DIR "/libtestmod1.so"));
+    smf_list_append(settings->modules, smf_module_create(BINARY_DIR "/libtestmod2.so"));
+    smf_list_append(settings->modules, smf_module_create_callback("mod1", mod1));
+
+    fail_unless(smf_modules_process_mail(settings, session) == 0);
+    fail_unless(smf_modules_process_rcpt(settings, session, "user@example.org") == 0);
+    fail_unless(session->response_msg == NULL);
+    fail_unless(smf_modules_process_rcpt(settings, session, "reject@example.org") == 550);
+    fail_unless(session->response_msg != NULL);
+    fail_unless(mod1_data.count == 0); // no hooks for callbacks
+}
+END_TEST
+
+START_TEST(process_readonly) {
+    SMFModule_T *module;
+
+    fail_unless((module = smf_module_create_callback("ro1", ro1)) != NULL);
+    module->flags = SMF_MODULE_READONLY;
+    smf_list_append(settings->modules, module);
+    fail_unless((module = smf_module_create_callback("ro2", ro2)) != NULL);
+    module->flags = SMF_MODULE_READONLY;
+    smf_list_append(settings->modules, module);
+    smf_list_append(settings->modules, smf_module_create_callback("mod3", mod3));
+
+    fail_unless(smf_modules_process(queue, session, settings) == 0);
+    fail_unless(ro_data[0].count == 1);
+    fail_unless(ro_data[1].count == 1);
+    fail_unless(mod3_data.count == 1);
+
+    /* the response of a successful module is kept as well */
+    fail_unless(strcmp(session->response_msg, "ro2 refused") == 0);
+
+    /* both run, but the result of the first one in the list counts */
+    ro_data[0].rc = 550;
+    ro_data[1].rc = 451;
+    processing_error_data.rc = 1; // stop processing
+    fail_unless(smf_modules_process(queue, session, settings) == 1);
+    fail_unless(ro_data[0].count == 2);
+    fail_unless(ro_data[1].count == 2);
+    fail_unless(mod3_data.count == 1);
+    fail_unless(processing_error_data.count == 1);
+    fail_unless(strcmp(session->response_msg, "ro1 refused") == 0);
+}
+END_TEST
+
+START_TEST(process_async) {
+    SMFModule_T *module;
+
+    fail_unless((module = smf_module_create(BINARY_DIR "/libtestmod3.so")) != NULL);
+    fail_unless(module->flags == SMF_MODULE_READONLY);
+    fail_unless(smf_module_invoke(settings, module, session) == 0);
+    smf_list_append(settings->modules, module);
+
+    /* waits for the pipe, while ro1 runs in a worker */
+    fail_unless((module = smf_module_create_callback("ro1", ro1)) != NULL);
+    module->flags = SMF_MODULE_READONLY;
+    smf_list_append(settings->modules, module);
+
+    fail_unless(smf_modules_process(queue, session, settings) == 0);
+    fail_unless(ro_data[0].count == 1);
+    fail_unless(processing_error_data.count == 0);
+}
+END_TEST
+
+START_TEST(module_timeout) {
+    SMFModule_T *module;
+
+    fail_unless((module = smf_module_create_callback("slow", slow)) != NULL);
+    smf_settings_set_module_timeout(settings, 1);
+    fail_unless(smf_module_invoke(settings, module, session) == 451);
+    fail_unless(module->timeouts == 1);
+
+    smf_settings_set_module_timeout_action(settings, SMF_MODULE_TIMEOUT_SKIP);
+    fail_unless(smf_module_invoke(settings, module, session) == 0);
+    fail_unless(module->timeouts == 2);
+
+    /* [slow]timeout overrides module_timeout */
+    smf_settings_set_module_timeout(settings, 0);
+    smf_dict_set(settings->groups, "slow:timeout", "1");
+    smf_settings_set_module_timeout_action(settings, SMF_MODULE_TIMEOUT_TEMPFAIL);
+    fail_unless(smf_module_invoke(settings, module, session) == 451);
+    fail_unless(module->timeouts == 3);
+    fail_unless(smf_module_destroy(module) == 0);
+}
+END_TEST
+
+START_TEST(module_stuck) {
+    SMFModule_T *module;
+    time_t start = time(NULL);
+
+    fail_unless((module = smf_module_create_callback("stuck", stuck)) != NULL);
+    smf_settings_set_module_timeout(settings, 1);
+    fail_unless(smf_module_invoke(settings, module, session) == 451);
+    fail_unless(time(NULL) - start < 3);
+
+    /* the worker has been killed and reaped, nothing is left behind */
+    fail_unless((waitpid(-1, NULL, WNOHANG) == -1) && (errno == ECHILD));
+    fail_unless(smf_module_destroy(module) == 0);
+}
+END_TEST
+
+START_TEST(module_worker) {
+    SMFModule_T *module;
+    SMFMessage_T *msg = session->envelope->message;
+
+    fail_unless((module = smf_module_create_callback("modify", modify)) != NULL);
+    smf_settings_set_module_timeout(settings, 10);
+    fail_unless(smf_module_invoke(settings, module, session) == 0);
+    fail_unless(strcmp(smf_envelope_get_sender(session->envelope), "changed@example.org") == 0);
+    fail_unless(smf_list_size(session->envelope->recipients) == 1);
+    fail_unless(strcmp(session->response_msg, "modified") == 0);
+
+    /* the header has been written to the spool file and the message
+     * has been reloaded */
+    fail_unless(session->envelope->message != msg);
+    fail_unless(smf_message_get_header(session->envelope->message, "X-Worker") != NULL);
+    fail_unless(smf_module_destroy(module) == 0);
+}
+END_TEST
+
+START_TEST(data_hooks) {
+    const char *clean = "Subject: test\r\n\r\nbody\r\n";
+    const char *reject = "X-Reject-Test: yes\r\n\r\nbody\r\n";
+
+    smf_list_append(settings->modules, smf_module_create(BINARY_DIR "/libtestmod1.so"));
+    smf_list_append(settings->modules, smf_module_create(BINARY_DIR "/libtestmod2.so"));
+
+    fail_unless(smf_modules_data_hooks(settings) == 1);
+    fail_unless(smf_modules_process_data(settings, session, clean, strlen(clean)) == 0);
+    fail_unless(smf_modules_process_data(settings, session, NULL, 0) == 0);
+    fail_unless(session->response_msg == NULL);
+    fail_unless(smf_modules_process_data(settings, session, reject, strlen(reject)) == 554);
+    fail_unless(session->response_msg != NULL);
+}
+END_TEST
+
 TCase *modules_tcase() {
     TCase* tc = tcase_create("modules");
     tcase_add_checked_fixture(tc, setup, teardown);
@@ -329,9 +576,17 @@ TCase *modules_tcase() {
     tcase_add_test(tc, process_success);
     tcase_add_test(tc, process_err_halt_queue);
     tcase_add_test(tc, process_err_stop_queue);
+    tcase_add_test(tc, journal_resume);
     tcase_add_test(tc, process_err_nexthop);
     tcase_add_test(tc, process_err_nexthop_err);
     tcase_add_test(tc, message_file_changed);
+    tcase_add_test(tc, process_readonly);
+    tcase_add_test(tc, process_async);
+    tcase_add_test(tc, module_timeout);
+    tcase_add_test(tc, module_stuck);
+    tcase_add_test(tc, module_worker);
+    tcase_add_test(tc, envelope_hooks);
+    tcase_add_test(tc, data_hooks);
     
     return tc;
 }
@@ -0,0 +1,147 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner, Werner Detter and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "testdirs.h"
+#include "../src/smf_internal.h"
+#include "../src/smf_settings.h"
+#include "../src/smf_settings_private.h"
+
+#define TEST_PORT 33335
+
+int load(SMFSettings_T *settings);
+
+static int connect_engine(void) {
+    struct sockaddr_in sa;
+    int sd, i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(TEST_PORT);
+    sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    /* give the engine some time to start */
+    for (i = 0; i < 50; i++) {
+        if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+        if (connect(sd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+            return sd;
+        close(sd);
+        usleep(100000);
+    }
+
+    return -1;
+}
+
+static int send_request(int sd, const char *rcpt, const char *action, void **rl) {
+    char *req = NULL;
+    char buf[MAXLINE];
+    int ret = -1;
+
+    asprintf(&req, "request=smtpd_access_policy\nprotocol_state=RCPT\n"
+        "client_address=127.0.0.1\nhelo_name=localhost\n"
+        "sender=%s\nrecipient=%s\n\n", test_email, rcpt);
+
+    if ((smf_internal_writen(sd, req, strlen(req)) == (ssize_t)strlen(req)) &&
+            (smf_internal_readline(sd, buf, sizeof(buf), rl) > 0) &&
+            (strcmp(buf, action) == 0) &&
+            (smf_internal_readline(sd, buf, sizeof(buf), rl) > 0) &&
+            (strcmp(buf, "\n") == 0))
+        ret = 0;
+
+    free(req);
+    return ret;
+}
+
+int main (int argc, char const *argv[]) {
+    SMFSettings_T *settings = smf_settings_new();
+    void *rl = NULL;
+    int sd = -1;
+    int ret = 0;
+    pid_t pid;
+
+    smf_settings_set_pid_file(settings, "/tmp/smf_test_policy.pid");
+    smf_settings_set_bind_ip(settings, "127.0.0.1");
+    smf_settings_set_bind_port(settings, TEST_PORT);
+    smf_settings_set_foreground(settings, 1);
+    smf_settings_set_spare_childs(settings, 0);
+    smf_settings_set_max_childs(settings,1);
+    smf_settings_set_debug(settings,1);
+    smf_settings_set_queue_dir(settings, BINARY_DIR);
+    smf_settings_set_engine(settings, "policy");
+
+    /* add test modules */
+    smf_settings_add_module(settings, BINARY_DIR "/libtestmod1.so");
+    smf_settings_add_module(settings, BINARY_DIR "/libtestmod2.so");
+
+    printf("Start smf_policy tests...\n");
+
+    printf("* preparing policy engine...\t\t\t");
+    printf("passed\n");
+
+    switch(pid = fork()) {
+        case -1:
+            printf("failed\n");
+            return -1;
+        case 0:
+            if (load(settings) != 0) {
+                return -1;
+            }
+            break;
+        default:
+            printf("* sending policy request ...\t\t\t");
+            if (((sd = connect_engine()) < 0) || 
+                    (send_request(sd, test_email, "action=DUNNO\n", &rl) != 0)) {
+                printf("failed\n");
+                ret = -1;
+            } else 
+                printf("passed\n");
+
+            /* the rcpt hook of testmod2 refuses this recipient */
+            printf("* sending rejected policy request ...\t\t");
+            if ((ret != 0) || (send_request(sd, "reject@example.org", 
+                    "action=550 5.1.1 Recipient address rejected\n", &rl) != 0)) {
+                printf("failed\n");
+                ret = -1;
+            } else 
+                printf("passed\n");
+
+            free(rl);
+
+            if (sd >= 0)
+                close(sd);
+            kill(pid,SIGTERM);
+            waitpid(pid, NULL, 0);
+            break;
+    }
+
+    smf_settings_free(settings);
+    return ret;
+}
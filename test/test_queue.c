@@ -0,0 +1,266 @@
+/* spmfilter - mail filtering framework
+ * Copyright (C) 2009-2012 Axel Steiner, Werner Detter and SpaceNet AG
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../src/smf_list.h"
+#include "../src/smf_dict.h"
+#include "../src/smf_settings.h"
+#include "../src/smf_settings_private.h"
+#include "../src/smf_session.h"
+#include "../src/smf_envelope.h"
+#include "../src/smf_message.h"
+#include "../src/smf_modules.h"
+
+#include "test.h"
+#include "testdirs.h"
+
+int load(SMFSettings_T *settings);
+
+static int crashing = 0;
+
+static int crash(SMFSettings_T *settings, SMFSession_T *session) {
+    if (crashing)
+        _exit(1);
+
+    return 0;
+}
+
+static int copy_file(char *src, char *dst) {
+    FILE *in, *out;
+    char buf[1024];
+    size_t n;
+
+    if ((in = fopen(src, "r")) == NULL)
+        return -1;
+
+    if ((out = fopen(dst, "w")) == NULL) {
+        fclose(in);
+        return -1;
+    }
+
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, n, out);
+
+    fclose(in);
+    return fclose(out);
+}
+
+static void drop(char *key, char *value, void *args) {
+    smf_dict_remove((SMFDict_T *)args, key);
+}
+
+/* path of the journal of a process, journal.<pid>.<n> */
+static char *find_journal(pid_t pid) {
+    DIR *dir;
+    struct dirent *de;
+    char *prefix = NULL;
+    char *path = NULL;
+
+    asprintf(&prefix, "journal.%d.", (int)pid);
+    if ((dir = opendir(BINARY_DIR)) != NULL) {
+        while ((path == NULL) && ((de = readdir(dir)) != NULL)) {
+            if (strncmp(de->d_name, prefix, strlen(prefix)) == 0)
+                asprintf(&path, "%s/%s", BINARY_DIR, de->d_name);
+        }
+        closedir(dir);
+    }
+    free(prefix);
+
+    return path;
+}
+
+int main (int argc, char const *argv[]) {
+    SMFSettings_T *settings = smf_settings_new();
+    SMFSession_T *session = smf_session_new();
+    SMFMessage_T *message = smf_message_new();
+    SMFProcessQueue_T *q = NULL;
+    SMFDict_T *modules = NULL;
+    SMFDict_T *envelopes = NULL;
+    SMFDict_T *finished = NULL;
+    SMFDict_T *attempts = NULL;
+    FILE *fh;
+    char *fname;
+    char *journal;
+    char *reused;
+    char *done;
+    int status;
+    pid_t pid;
+
+    printf("Start smf_queue tests...\n");
+
+    printf("* preparing queue runner...\t\t\t");
+    smf_settings_set_debug(settings, 1);
+    smf_settings_set_queue_dir(settings, BINARY_DIR);
+    smf_settings_set_engine(settings, "queue");
+    smf_settings_set_queue_recovery(settings, 1);
+    smf_dict_set(settings->groups, "queue:workers", "2");
+
+    asprintf(&fname, "%s/m0001.txt", SAMPLES_DIR);
+    asprintf(&session->message_file, "%s/%s.queue", BINARY_DIR, session->id);
+    if ((copy_file(fname, session->message_file) != 0) ||
+            (smf_message_from_file(&message, session->message_file, 1) != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    session->envelope->message = message;
+    smf_envelope_set_sender(session->envelope, "sender@example.org");
+    smf_envelope_add_rcpt(session->envelope, "rcpt@example.org");
+
+    q = smf_modules_pqueue_init(NULL, NULL, NULL);
+    printf("passed\n");
+
+    printf("* crashing while processing...\t\t\t");
+    smf_settings_add_module(settings, BINARY_DIR "/libtestmod1.so");
+    smf_list_append(settings->modules, smf_module_create_callback("crash", crash));
+
+    fflush(stdout);
+    switch(pid = fork()) {
+        case -1:
+            printf("failed\n");
+            return -1;
+        case 0:
+            crashing = 1;
+            smf_modules_process(q, session, settings);
+            exit(0);
+        default:
+            waitpid(pid, &status, 0);
+            break;
+    }
+
+    /* spool file and journal are left behind */
+    journal = find_journal(pid);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 1) ||
+            (access(session->message_file, F_OK) != 0) || (journal == NULL)) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    /* the pid of the journal belongs to a living process now, but the 
+     * journal isn't locked */
+    asprintf(&reused, "%s/journal.%d.1", BINARY_DIR, (int)getppid());
+    if (rename(journal, reused) != 0) {
+        printf("failed\n");
+        return -1;
+    }
+
+    printf("* recovering orphaned message...\t\t");
+    fflush(stdout);
+    if ((load(settings) != 0) || (access(session->message_file, F_OK) == 0) || 
+            (access(reused, F_OK) == 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    /* a message, which can't be resumed, is carried over to a journal of
+     * the queue runner */
+    printf("* keeping unprocessed message...\t\t");
+    fflush(stdout);
+    free(journal);
+    if (((fh = fopen(reused, "w")) == NULL) || 
+            (fprintf(fh, "invalid +%s\t\t\n", session->message_file) < 0) || (fclose(fh) != 0) ||
+            (load(settings) == 0) || (access(reused, F_OK) == 0) || 
+            ((journal = find_journal(getpid())) == NULL)) {
+        printf("failed\n");
+        return -1;
+    }
+
+    modules = smf_dict_new();
+    envelopes = smf_dict_new();
+    finished = smf_dict_new();
+    attempts = smf_dict_new();
+    if ((smf_modules_journal_read(journal, modules, envelopes, finished, attempts) != 2) ||
+            (smf_dict_get(envelopes, "invalid") == NULL) || 
+            (strcmp(smf_dict_get(attempts, "invalid"), "1") != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    /* the carried journal is picked up again, until the message has 
+     * failed max_attempts times */
+    printf("* giving up unprocessed message...\t\t");
+    fflush(stdout);
+    free(journal);
+    smf_dict_set(settings->groups, "queue:max_attempts", "2");
+    if ((load(settings) == 0) || ((journal = find_journal(getpid())) == NULL)) {
+        printf("failed\n");
+        return -1;
+    }
+    free(journal);
+    if ((load(settings) != 0) || ((journal = find_journal(getpid())) != NULL)) {
+        printf("failed\n");
+        return -1;
+    }
+    printf("passed\n");
+
+    /* a message, which is done, isn't recorded again by an older record,
+     * in whatever order the journals are read */
+    printf("* reading finished message...\t\t\t");
+    asprintf(&journal, "%s/journal.%d.2", BINARY_DIR, (int)getppid());
+    asprintf(&done, "%s/journal.%d.3", BINARY_DIR, (int)getppid());
+    if (((fh = fopen(journal, "w")) == NULL) || 
+            (fprintf(fh, "done +%s\t\t\ndone #1\n", session->message_file) < 0) || (fclose(fh) != 0) ||
+            ((fh = fopen(done, "w")) == NULL) || (fprintf(fh, "done -\n") < 0) || (fclose(fh) != 0)) {
+        printf("failed\n");
+        return -1;
+    }
+
+    smf_dict_free(envelopes);
+    envelopes = smf_dict_new();
+    smf_modules_journal_read(done, modules, envelopes, finished, attempts);
+    smf_modules_journal_read(journal, modules, envelopes, finished, attempts);
+    smf_dict_map(finished, drop, envelopes);
+    if ((envelopes->n != 0) || (smf_dict_get(finished, "done") == NULL)) {
+        printf("failed\n");
+        return -1;
+    }
+
+    smf_modules_journal_read(journal, modules, envelopes, finished, attempts);
+    smf_modules_journal_read(done, modules, envelopes, finished, attempts);
+    smf_dict_map(finished, drop, envelopes);
+    if ((envelopes->n != 0) || (smf_dict_get(finished, "done") == NULL)) {
+        printf("failed\n");
+        return -1;
+    }
+    unlink(journal);
+    unlink(done);
+    printf("passed\n");
+
+    smf_dict_free(modules);
+    smf_dict_free(envelopes);
+    smf_dict_free(finished);
+    smf_dict_free(attempts);
+    free(done);
+    free(q);
+    free(reused);
+    free(journal);
+    free(fname);
+    smf_session_free(session);
+    smf_settings_free(settings);
+    return 0;
+}
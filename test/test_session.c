@@ -16,6 +16,10 @@
  */
 
 #include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "../src/smf_session.h"
 
@@ -70,6 +74,35 @@ START_TEST(set_get_xforward_v6) {
 }
 END_TEST
 
+START_TEST(timing_spans) {
+    char path[] = "/tmp/smf_timing_XXXXXX";
+    char buf[1024];
+    SMFSessionSpan_T *span;
+    FILE *fh;
+    int fd;
+
+    fail_unless((fd = mkstemp(path)) != -1);
+    close(fd);
+
+    /* timing is disabled by default */
+    fail_unless(smf_session_span_begin(session, "helo") == NULL);
+
+    smf_session_enable_timing(session);
+    fail_unless((span = smf_session_span_begin(session, "module:%s", "foo")) != NULL);
+    smf_session_span_end(span);
+    fail_unless(smf_session_timing_write(session, path) == 0);
+
+    fail_unless((fh = fopen(path, "r")) != NULL);
+    fail_unless(fgets(buf, sizeof(buf), fh) != NULL);
+    fclose(fh);
+    unlink(path);
+
+    fail_unless(strstr(buf, smf_session_get_id(session)) != NULL);
+    fail_unless(strstr(buf, "\"name\":\"session\"") != NULL);
+    fail_unless(strstr(buf, "\"name\":\"module:foo\"") != NULL);
+}
+END_TEST
+
 TCase *session_tcase() {
     TCase* tc = tcase_create("session");
 
@@ -80,6 +113,7 @@ TCase *session_tcase() {
     tcase_add_test(tc, set_get_message_file);
     tcase_add_test(tc, set_get_xforward_v4);
     tcase_add_test(tc, set_get_xforward_v6);
+    tcase_add_test(tc, timing_spans);
 
     return tc;
 }
@@ -31,6 +31,11 @@
 #include <errno.h>
 #include <pwd.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 
 #include "test.h"
@@ -42,8 +47,189 @@
 #include "../src/smf_smtp.h"
 #include "../src/smf_envelope.h"
 
+#define TEST_PORT 33332
+#define TEST_QUEUE BINARY_DIR "/smtpd_queue"
+#define TEST_MAX_SIZE 1048576
+
 int load(SMFSettings_T *settings);
 
+static int connect_engine(void) {
+    struct sockaddr_in sa;
+    int sd, i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(TEST_PORT);
+    sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    /* give the engine some time to start */
+    for (i = 0; i < 50; i++) {
+        if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+        if (connect(sd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+            return sd;
+        close(sd);
+        usleep(100000);
+    }
+
+    return -1;
+}
+
+/* read a (possibly multiline) reply, returns the code of the last line,
+ * whose text is copied to reply, if not NULL */
+static int read_reply(int sd, char *reply, size_t size) {
+    char line[1024];
+    size_t len;
+
+    for (;;) {
+        len = 0;
+        while (len < sizeof(line) - 1) {
+            if (read(sd, &line[len], 1) != 1)
+                return -1;
+            if (line[len++] == '\n')
+                break;
+        }
+        line[len] = '\0';
+
+        if (len < 4)
+            return -1;
+        if (line[3] != '-') {
+            if (reply != NULL)
+                snprintf(reply, size, "%s", line);
+            return atoi(line);
+        }
+    }
+}
+
+static int smtp_command(int sd, const char *cmd, char *reply, size_t size) {
+    if (smf_internal_writen(sd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+        return -1;
+
+    return read_reply(sd, reply, size);
+}
+
+/* send a message of the given size after DATA, returns the final reply */
+static int smtp_message(int sd, const char *headers, size_t size, char *reply, size_t reply_size) {
+    const char line[] = "0123456789012345678901234567890123456789012345678901234567890123456789\r\n";
+    size_t sent;
+
+    if (smtp_command(sd, "DATA\r\n", NULL, 0) != 354)
+        return -1;
+
+    if (smf_internal_writen(sd, headers, strlen(headers)) != (ssize_t)strlen(headers))
+        return -1;
+
+    for (sent = 0; sent < size; sent += sizeof(line) - 1) {
+        if (smf_internal_writen(sd, line, sizeof(line) - 1) != sizeof(line) - 1)
+            return -1;
+    }
+
+    return smtp_command(sd, ".\r\n", reply, reply_size);
+}
+
+/* number of entries in the queue directory */
+static int queue_files(void) {
+    DIR *dir;
+    struct dirent *de;
+    int count = 0;
+
+    if ((dir = opendir(TEST_QUEUE)) == NULL)
+        return -1;
+
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] != '.')
+            count++;
+    }
+    closedir(dir);
+
+    return count;
+}
+
+/* testmod2 refuses blocked@example.org, reject@example.org and messages
+ * with an X-Reject-Test header */
+static int test_hooks(void) {
+    char reply[1024];
+    int sd;
+    int files = queue_files();
+    int ret = -1;
+
+    if ((sd = connect_engine()) < 0)
+        return -1;
+
+    if ((files != -1) &&
+            (read_reply(sd, NULL, 0) == 220) &&
+            (smtp_command(sd, "HELO localhost\r\n", NULL, 0) == 250) &&
+            (smtp_command(sd, "MAIL FROM:<blocked@example.org>\r\n", reply, sizeof(reply)) == 553) &&
+            (strcmp(reply, "553 5.7.1 Sender address rejected\r\n") == 0) &&
+            (smtp_command(sd, "MAIL FROM:<sender@example.org>\r\n", NULL, 0) == 250) &&
+            (smtp_command(sd, "RCPT TO:<reject@example.org>\r\n", reply, sizeof(reply)) == 550) &&
+            (strcmp(reply, "550 5.1.1 Recipient address rejected\r\n") == 0) &&
+            (smtp_command(sd, "RCPT TO:<rcpt@example.org>\r\n", NULL, 0) == 250) &&
+            /* refused with the first chunk, long before the end of data */
+            (smtp_message(sd, "Subject: refused\r\nX-Reject-Test: yes\r\n\r\n", 4 * IOBUFSIZE, 
+                reply, sizeof(reply)) == 554) &&
+            (strcmp(reply, "554 5.7.1 Message content rejected\r\n") == 0) &&
+            (smtp_command(sd, "NOOP\r\n", NULL, 0) == 250) &&
+            (smtp_command(sd, "QUIT\r\n", NULL, 0) == 221) &&
+            (queue_files() == files))
+        ret = 0;
+
+    close(sd);
+    return ret;
+}
+
+static int test_size(void) {
+    char *cmd = NULL;
+    int sd;
+    int ret = -1;
+
+    if ((sd = connect_engine()) < 0)
+        return -1;
+
+    if ((read_reply(sd, NULL, 0) == 220) &&
+            (smtp_command(sd, "EHLO localhost\r\n", NULL, 0) == 250) &&
+            /* malformed and negative sizes */
+            (smtp_command(sd, "MAIL FROM:<sender@example.org> SIZE=abc\r\n", NULL, 0) == 501) &&
+            (smtp_command(sd, "MAIL FROM:<sender@example.org> SIZE=-1\r\n", NULL, 0) == 501) &&
+            /* a size beyond LONG_MAX overflows */
+            (smtp_command(sd, "MAIL FROM:<sender@example.org> SIZE=99999999999999999999999\r\n", NULL, 0) == 552) &&
+            (asprintf(&cmd, "MAIL FROM:<sender@example.org> SIZE=%ld\r\n", LONG_MAX) != -1) &&
+            (smtp_command(sd, cmd, NULL, 0) == 552) &&
+            (smtp_command(sd, "MAIL FROM:<sender@example.org> SIZE=1048577\r\n", NULL, 0) == 552) &&
+            (smtp_command(sd, "MAIL FROM:<sender@example.org> SIZE=1048576\r\n", NULL, 0) == 250) &&
+            (smtp_command(sd, "QUIT\r\n", NULL, 0) == 221))
+        ret = 0;
+
+    free(cmd);
+    close(sd);
+    return ret;
+}
+
+/* a message beyond max_size is read to the end, but never stored */
+static int test_oversize(void) {
+    int sd;
+    int files = queue_files();
+    int ret = -1;
+
+    if ((sd = connect_engine()) < 0)
+        return -1;
+
+    if ((files != -1) && 
+            (read_reply(sd, NULL, 0) == 220) &&
+            (smtp_command(sd, "HELO localhost\r\n", NULL, 0) == 250) &&
+            (smtp_command(sd, "MAIL FROM:<sender@example.org>\r\n", NULL, 0) == 250) &&
+            (smtp_command(sd, "RCPT TO:<rcpt@example.org>\r\n", NULL, 0) == 250) &&
+            (smtp_message(sd, "Subject: oversize\r\n\r\n", 4 * TEST_MAX_SIZE, NULL, 0) == 552) &&
+            /* the rest of the message must not be taken for commands */
+            (smtp_command(sd, "NOOP\r\n", NULL, 0) == 250) &&
+            (smtp_command(sd, "QUIT\r\n", NULL, 0) == 221) &&
+            (queue_files() == files))
+        ret = 0;
+
+    close(sd);
+    return ret;
+}
+
 int main (int argc, char const *argv[]) {
     char *msg_file = NULL;
     SMFSmtpStatus_T *status = NULL;
@@ -57,7 +243,10 @@ int main (int argc, char const *argv[]) {
     smf_settings_set_spare_childs(settings, 0);
     smf_settings_set_max_childs(settings,1);
     smf_settings_set_debug(settings,1);
-    smf_settings_set_queue_dir(settings, BINARY_DIR);
+    mkdir(TEST_QUEUE, 0700);
+    smf_settings_set_bind_port(settings, TEST_PORT);
+    smf_settings_set_queue_dir(settings, TEST_QUEUE);
+    smf_settings_set_max_size(settings, TEST_MAX_SIZE);
     smf_settings_set_engine(settings, "smtpd");
 
     /* add test modules */
@@ -96,6 +285,31 @@ int main (int argc, char const *argv[]) {
             
             smf_smtp_status_free(status);
             printf("passed\n");
+
+            printf("* checking SIZE parameter ...\t\t\t");
+            if (test_size() != 0) {
+                kill(pid,SIGTERM);
+                printf("failed\n");
+                return -1;
+            }
+            printf("passed\n");
+
+            printf("* sending oversized message ...\t\t\t");
+            if (test_oversize() != 0) {
+                kill(pid,SIGTERM);
+                printf("failed\n");
+                return -1;
+            }
+            printf("passed\n");
+
+            printf("* refusing sender, recipient and message ...\t");
+            if (test_hooks() != 0) {
+                kill(pid,SIGTERM);
+                printf("failed\n");
+                return -1;
+            }
+            printf("passed\n");
+
             kill(pid,SIGTERM);
             waitpid(pid, NULL, 0);
 
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <string.h>
 
 #include "../src/smf_settings.h"
 #include "../src/smf_session.h"
@@ -10,4 +12,33 @@ int load(SMFSettings_T *settings, SMFSession_T *session) {
     STRACE(TRACE_DEBUG,session->id,"Hello testmod2\n");
 
     return 0;
-}
\ No newline at end of file
+}
+
+int mail(SMFSettings_T *settings, SMFSession_T *session) {
+    STRACE(TRACE_DEBUG,session->id,"testmod2 mail hook\n");
+
+    if ((session->envelope->sender != NULL) && (strstr(session->envelope->sender, "blocked@example.org") != NULL)) {
+        smf_session_set_response_msg(session, "5.7.1 Sender address rejected");
+        return 553;
+    }
+
+    return 0;
+}
+
+int rcpt(SMFSettings_T *settings, SMFSession_T *session, char *rcpt) {
+    if (strcmp(rcpt, "reject@example.org") == 0) {
+        smf_session_set_response_msg(session, "5.1.1 Recipient address rejected");
+        return 550;
+    }
+
+    return 0;
+}
+
+int data(SMFSettings_T *settings, SMFSession_T *session, const char *buf, size_t len) {
+    if ((len > 0) && (memmem(buf, len, "X-Reject-Test:", 14) != NULL)) {
+        smf_session_set_response_msg(session, "5.7.1 Message content rejected");
+        return 554;
+    }
+
+    return 0;
+}
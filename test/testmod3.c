@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "../src/smf_settings.h"
+#include "../src/smf_session.h"
+#include "../src/smf_modules.h"
+#include "../src/smf_trace.h"
+
+#define THIS_MODULE "testmod3"
+
+const unsigned int module_flags = SMF_MODULE_READONLY;
+
+/* the answer has arrived, the module is done */
+static int done(SMFSettings_T *settings, SMFSession_T *session, SMFModuleWait_T *wait) {
+    int *fds = (int *)wait->data;
+    char c;
+    int ret;
+
+    ret = (read(fds[0], &c, 1) == 1) ? 0 : -1;
+    close(fds[0]);
+    free(fds);
+    STRACE(TRACE_DEBUG,session->id,"testmod3 done\n");
+
+    return ret;
+}
+
+/* the request can be sent, wait for the answer */
+static int request(SMFSettings_T *settings, SMFSession_T *session, SMFModuleWait_T *wait) {
+    int *fds = (int *)wait->data;
+
+    if (write(fds[1], "x", 1) != 1)
+        return -1;
+    close(fds[1]);
+
+    wait->fd = fds[0];
+    wait->events = POLLIN;
+    wait->resume = done;
+
+    return SMF_MODULE_PENDING;
+}
+
+int load_async(SMFSettings_T *settings, SMFSession_T *session, SMFModuleWait_T *wait) {
+    int *fds;
+
+    if ((fds = malloc(2 * sizeof(int))) == NULL)
+        return -1;
+
+    if (pipe(fds) != 0) {
+        free(fds);
+        return -1;
+    }
+
+    wait->fd = fds[1];
+    wait->events = POLLOUT;
+    wait->resume = request;
+    wait->data = fds;
+
+    return SMF_MODULE_PENDING;
+}